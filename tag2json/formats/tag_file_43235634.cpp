@@ -89,24 +89,7 @@ bool TagFileReader43235634::ReadHeader(std::ifstream& file) {
       return false;
     }
     file.read((char*)&f32, sizeof(f32)); // padding
-
-    uint64_t f64;
-    file.read((char*)&f64, sizeof(f64)); // tag table pos
-    tag_table_pos_ = f64;
-    file.read((char*)&f64, sizeof(f64)); // file table pos
-    file_table_pos_ = f64;
-
-    uint16_t f16;
-    file.read((char*)&f16, sizeof(f16)); // tag size
-    tag_record_size_ = f16;
-    file.read((char*)&f16, sizeof(f16)); // tag amount
-    tags_max_amount_ = f16;
-    file.read((char*)&f16, sizeof(f16)); // padding
-    file.read((char*)&f16, sizeof(f16)); // fileblock size
-    fileblock_size_ = f16;
-
-    file.read((char*)&f64, sizeof(f64)); // fileblock amount
-    fileblock_amount_ = f64;
+    ReadHeaderFields(file);
 
     return true;
   } catch (std::exception& e) {
@@ -116,6 +99,26 @@ bool TagFileReader43235634::ReadHeader(std::ifstream& file) {
   return false;
 }
 
+void TagFileReader43235634::ReadHeaderFields(std::ifstream& file) {
+  uint64_t f64;
+  file.read((char*)&f64, sizeof(f64)); // tag table pos
+  tag_table_pos_ = f64;
+  file.read((char*)&f64, sizeof(f64)); // file table pos
+  file_table_pos_ = f64;
+
+  uint16_t f16;
+  file.read((char*)&f16, sizeof(f16)); // tag size
+  tag_record_size_ = f16;
+  file.read((char*)&f16, sizeof(f16)); // tag amount
+  tags_max_amount_ = f16;
+  file.read((char*)&f16, sizeof(f16)); // padding
+  file.read((char*)&f16, sizeof(f16)); // fileblock size
+  fileblock_size_ = f16;
+
+  file.read((char*)&f64, sizeof(f64)); // fileblock amount
+  fileblock_amount_ = f64;
+}
+
 bool TagFileReader43235634::ReadTags(std::ifstream& file) {
   const size_t kTagHeaderSize = 4;
 
@@ -188,6 +191,9 @@ bool TagFileReader43235634::ReadFiles(std::ifstream& file) {
 
       if (prev_block == static_cast<uint64_t>(-1)) { continue; } // Free (unused) block
       if (prev_block == static_cast<uint64_t>(-2)) { continue; } // Reserved block
+      if (prev_block == static_cast<uint64_t>(-3)) { continue; } // Service block (file name index)
+      if (prev_block == static_cast<uint64_t>(-4)) { continue; } // Service block (tag index)
+      if (prev_block == static_cast<uint64_t>(-5)) { continue; } // Service block (journal)
 
       FileBlockInfo fb;
       fb.Index = i;
@@ -267,6 +273,8 @@ bool TagFileReader43235634::ComposeFiles() {
     std::memcpy(&tags_size, data.data(), 2);
     std::memcpy(&name_size, data.data() + 2, 2);
     std::memcpy(&target_size, data.data() + 4, 4);
+    bool sparse = tags_size & kTagsFieldSparse;
+    tags_size &= ~kTagsFieldSparse;
     if (data.size() < (8 + tags_size + name_size + target_size)) {
       std::cerr << "File information is corrupted" << std::endl;
       continue;
@@ -274,7 +282,13 @@ bool TagFileReader43235634::ComposeFiles() {
 
     size_t disp = 8;
     FileInfo fi;
-    for (size_t tb = 0; tb < tags_size; ++tb) {
+    for (size_t tb = 0; sparse && tb + 1 < tags_size; tb += 2) {
+      uint16_t tag;
+
+      std::memcpy(&tag, data.data() + disp + tb, 2);
+      fi.Tags.push_back(tag);
+    }
+    for (size_t tb = 0; !sparse && tb < tags_size; ++tb) {
       uint8_t bits = data[disp + tb];
 
       for (size_t b = 0; b < 8; ++b) {
@@ -44,6 +44,22 @@ class TagFileReader43235634: public TagFileReader {
   uint16_t GetFileBlockSize();
 
 
+ protected:
+  /*! Прочитать хедер файла (с проверкой метки формата) */
+  virtual bool ReadHeader(std::ifstream& file);
+
+  /*! Прочитать общие для версий поля хедера: от таблицы тэгов до количества
+  файловых блоков. Файловый поток должен стоять на позиции 0x08 */
+  void ReadHeaderFields(std::ifstream& file);
+
+  uint16_t tag_record_size_; //!< Размер записи с информацией о тэге
+  uint16_t tags_max_amount_; //!< Максимальное количество тэгов в файловой системе
+  uint16_t fileblock_size_; //!< Размер файлового блока (подробнее см. формат хранения)
+  uint64_t fileblock_amount_; //!< Количество файловых блоков
+
+  uint64_t tag_table_pos_;
+  uint64_t file_table_pos_;
+
  private:
   TagFileReader43235634(const TagFileReader43235634&) = delete;
   TagFileReader43235634(TagFileReader43235634&&) = delete;
@@ -59,14 +75,7 @@ class TagFileReader43235634: public TagFileReader {
 
   static const uint32_t kFormatMagicWord = 0x43235634;
   const size_t kMaxFileBlocks = 1000; //!< Предельное ограничение на очень длинное описание файла (в блоках)
-
-  uint16_t tag_record_size_; //!< Размер записи с информацией о тэге
-  uint16_t tags_max_amount_; //!< Максимальное количество тэгов в файловой системе
-  uint16_t fileblock_size_; //!< Размер файлового блока (подробнее см. формат хранения)
-  uint64_t fileblock_amount_; //!< Количество файловых блоков
-
-  uint64_t tag_table_pos_;
-  uint64_t file_table_pos_;
+  static const uint16_t kTagsFieldSparse = 0x8000; //!< Поле тэгов - номера тэгов, а не маска (только в версии 2 с разреженными тэгами)
 
   std::map<uint16_t, TagInfo> tags_;
   std::map<uint64_t, FileBlockInfo> file_blocks_;
@@ -75,7 +84,6 @@ class TagFileReader43235634: public TagFileReader {
   /*! Подчистим все поля, выставим дефалтовые значения */
   void ClearAll();
 
-  bool ReadHeader(std::ifstream& file);
   bool ReadTags(std::ifstream& file);
   bool ReadFiles(std::ifstream& file);
   bool ComposeFiles();
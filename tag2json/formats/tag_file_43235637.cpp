@@ -0,0 +1,47 @@
+#include "tag_file_43235637.h"
+
+#include <iostream>
+
+#include <boost/endian.hpp>
+
+namespace be = boost::endian;
+
+
+TagFileReader43235637::TagFileReader43235637(): version_(0) {
+}
+
+bool TagFileReader43235637::ReadHeader(std::ifstream& file) {
+  try {
+    file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+    file.seekg(0);
+    uint32_t f32;
+    file.read((char*)&f32, sizeof(f32)); // magic word
+    if (be::big_to_native(f32) != kFormatMagicWord) {
+      std::cerr << "Wrong header marker" << std::endl;
+      return false;
+    }
+    file.read((char*)&f32, sizeof(f32)); // version
+    version_ = be::little_to_native(f32);
+    if (version_ < 2 || version_ > kFormatVersionMax) {
+      std::cerr << "Wrong format version " << version_ << std::endl;
+      return false;
+    }
+    ReadHeaderFields(file);
+
+    file.seekg(kFeaturesPos);
+    file.read((char*)&f32, sizeof(f32)); // compatible features
+    file.read((char*)&f32, sizeof(f32)); // incompatible features
+    f32 = be::little_to_native(f32);
+    if (f32 & ~kIncompatSupported) {
+      std::cerr << "Unsupported format features: " << std::hex <<
+          (f32 & ~kIncompatSupported) << std::dec << std::endl;
+      return false;
+    }
+
+    return true;
+  } catch (std::exception& e) {
+    std::cerr << "File error: " << e.what() << std::endl;
+  }
+
+  return false;
+}
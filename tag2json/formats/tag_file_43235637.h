@@ -0,0 +1,31 @@
+#ifndef TAG_FILE_43235637_H
+#define TAG_FILE_43235637_H
+
+#include <fstream>
+
+#include "tag_file_43235634.h"
+
+
+/*! Чтение хранилища версии 2 и выше. Таблицы тэгов и файлов такие же, как в
+версии 1, отличается только хедер: в нём есть версия, флаги возможностей и
+ссылки на индексы (индексы при экспорте не нужны и не читаются) */
+class TagFileReader43235637: public TagFileReader43235634 {
+ public:
+  TagFileReader43235637();
+
+ protected:
+  bool ReadHeader(std::ifstream& file) override;
+
+ private:
+  static const uint32_t kFormatMagicWord = 0x43235637;
+  static const uint32_t kFormatVersionMax = 2; //!< Последняя известная версия формата
+  static const uint32_t kIncompatPostings = 1 << 0; //!< Устаревший сохранённый индекс тэгов (на чтение записей не влияет)
+  static const uint32_t kIncompatSparseTags = 1 << 1; //!< Тэги файлов могут храниться номерами (разбираются общим кодом)
+  static const uint32_t kIncompatSupported = kIncompatPostings | kIncompatSparseTags;
+  static const std::streamoff kFeaturesPos = 0x48; //!< Позиция флагов возможностей в хедере
+
+  uint32_t version_; //!< Версия формата
+};
+
+
+#endif // TAG_FILE_43235637_H
@@ -5,6 +5,7 @@
 #include <boost/endian.hpp>
 
 #include "formats/tag_file_43235634.h"
+#include "formats/tag_file_43235637.h"
 
 namespace be = boost::endian;
 
@@ -18,6 +19,9 @@ std::shared_ptr<TagFileReader> GetReader(std::ifstream& file) {
     if (frm == 0x43235634) {
       auto tf = std::make_shared<TagFileReader43235634>();
       if (tf->Load(file)) { return tf; }
+    } else if (frm == 0x43235637) {
+      auto tf = std::make_shared<TagFileReader43235637>();
+      if (tf->Load(file)) { return tf; }
     } else {
       std::cerr << "Unknown file format" << std::endl;
     }
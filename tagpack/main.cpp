@@ -0,0 +1,80 @@
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+#include "tag_pack.h"
+
+#define TAGPACK_VERSION "1.0"
+
+void PrintHelp() {
+  std::cout << "tagpack utility for offline compaction and repacking of tagvfs storage. Evgeny Kislov, 2024" << std::endl;
+  std::cout << "Usage:" << std::endl;
+  std::cout << "  tagpack [-f] [-t amount] [-r size] [-b size] tagfile [newtagfile] [--help|-h] [--version]" << std::endl;
+  std::cout << "Storage must be unmounted: files get new numbers." << std::endl;
+  std::cout << "Options:" << std::endl;
+  std::cout << "  tagfile storage file for packing. Without newtagfile the storage is replaced by packed one" << std::endl;
+  std::cout << "  newtagfile file for packed storage" << std::endl;
+  std::cout << "  -t amount maximum amount of tags in the packed storage" << std::endl;
+  std::cout << "  -r size size of tag record (multiple of 8, limits tag name length)" << std::endl;
+  std::cout << "  -b size size of file block (e.g. enough for typical file record)" << std::endl;
+  std::cout << "  -f force rewrite output file, without confirmation" << std::endl;
+  std::cout << "  -h, --help show help and exit" << std::endl;
+  std::cout << "  --version show version information and exit" << std::endl;
+}
+
+/*! Разобрать числовой параметр опции
+\param arg текст параметра
+\param value возвращает значение (от 1 до 65535)
+\return признак правильного параметра */
+bool ParseSize(const char* arg, uint16_t& value) {
+  try {
+    size_t pos;
+    unsigned long v = std::stoul(arg, &pos);
+    if (arg[pos] != 0 || v == 0 || v > UINT16_MAX) { return false; }
+    value = static_cast<uint16_t>(v);
+    return true;
+  } catch (std::exception&) {
+  }
+  return false;
+}
+
+int main(int argc, char** argv) {
+  bool opt_force = false;
+  std::string opt_src, opt_dst;
+  TagPackOptions opts = {};
+  bool bad_cmd = false;
+  for (int i = 1; i < argc; ++i) {
+    std::string opt = argv[i];
+    if (opt == "-h" || opt == "--help") {
+      PrintHelp();
+      return 0;
+    } else if (opt == "--version") {
+      std::cout << TAGPACK_VERSION << std::endl;
+      return 0;
+    } else if (opt == "-f") {
+      opt_force = true;
+    } else if (opt == "-t" || opt == "-r" || opt == "-b") {
+      uint16_t& value = opt == "-t" ? opts.TagMaxAmount :
+          (opt == "-r" ? opts.TagRecordSize : opts.FileBlockSize);
+      if ((i + 1) >= argc || !ParseSize(argv[i + 1], value)) {
+        bad_cmd = true;
+        break;
+      }
+      ++i;
+    } else if (!opt.empty() && opt[0] == '-') {
+      bad_cmd = true;
+    } else if (opt_src.empty()) {
+      opt_src = opt;
+    } else if (opt_dst.empty()) {
+      opt_dst = opt;
+    } else {
+      bad_cmd = true;
+    }
+  }
+  if (bad_cmd || opt_src.empty()) {
+    PrintHelp();
+    return 1;
+  }
+
+  return TagPack(opt_src, opt_dst, opt_force, opts);
+}
@@ -0,0 +1,103 @@
+#include "tag_pack.h"
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "tag_storage_reader.h"
+#include "tag_storage_writer.h"
+
+
+/*! Сбросить файл (или каталог) на диск
+\return true - сброшен */
+static bool SyncPath(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) { return false; }
+  bool ok = fsync(fd) == 0;
+  if (close(fd)) { ok = false; }
+  return ok;
+}
+
+/*! Каталог, в котором лежит файл */
+static std::string DirName(const std::string& path) {
+  size_t pos = path.rfind('/');
+  if (pos == std::string::npos) { return "."; }
+  if (pos == 0) { return "/"; }
+  return path.substr(0, pos);
+}
+
+
+int TagPack(const std::string& src, const std::string& dst, bool rewrite,
+    const TagPackOptions& opts) {
+  bool in_place = dst.empty();
+  std::string out = in_place ? src + ".pack" : dst;
+
+  if (!rewrite && !in_place) {
+    std::ifstream def(dst, std::ios_base::in);
+    if (def) {
+      std::cerr << "Target file '" << dst <<
+          "' is existed now. For overwriting use option '-f'" << std::endl;
+      return 1;
+    }
+  }
+
+  TagStorageReader reader;
+  if (!reader.Open(src)) { return 1; }
+
+  TagStorageSettings settings = reader.GetSettings();
+  if (opts.TagMaxAmount) { settings.TagMaxAmount = opts.TagMaxAmount; }
+  if (opts.TagRecordSize) { settings.TagRecordSize = opts.TagRecordSize; }
+  if (opts.FileBlockSize) { settings.FileBlockSize = opts.FileBlockSize; }
+
+  TagStorageWriter writer;
+  if (!writer.Create(out, settings)) { return 1; }
+
+  bool ok = true;
+  TagStorageTag tag;
+  while (ok && reader.NextTag(tag)) {
+    ok = writer.AddTag(tag);
+  }
+
+  TagStorageFile file;
+  size_t files_amount = 0;
+  while (ok && reader.NextFile(file)) {
+    uint64_t ino;
+
+    ok = writer.AddFile(file, ino);
+    ++files_amount;
+  }
+  if (!ok || reader.Failed() || !writer.Finish()) {
+    std::cerr << "Storage isn't packed" << std::endl;
+    std::remove(out.c_str());
+    return 1;
+  }
+  // Хранилище заменяется только упакованным файлом, который уже на диске:
+  // иначе после сбоя на месте хранилища мог бы оказаться недописанный файл
+  if (!SyncPath(out)) {
+    std::cerr << "Can't sync packed file '" << out << "'" << std::endl;
+    std::remove(out.c_str());
+    return 1;
+  }
+
+  if (in_place && std::rename(out.c_str(), src.c_str())) {
+    std::cerr << "Can't replace storage '" << src << "' by packed file '" <<
+        out << "'" << std::endl;
+    return 1;
+  }
+  if (!SyncPath(DirName(in_place ? src : out))) {
+    std::cerr << "Can't sync directory of storage '" << (in_place ? src : out) <<
+        "'" << std::endl;
+    return 1;
+  }
+
+  std::cout << "Files: " << files_amount << ", file blocks: " <<
+      reader.GetSettings().FileBlockAmount << " -> " <<
+      writer.GetFileBlockAmount() << ", block size: " <<
+      reader.GetSettings().FileBlockSize << " -> " << settings.FileBlockSize <<
+      ", tags: " << reader.GetSettings().TagMaxAmount << " -> " <<
+      settings.TagMaxAmount << std::endl;
+  return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef TAG_PACK_H
+#define TAG_PACK_H
+
+#include <cstdint>
+#include <string>
+
+/*! Параметры нового хранилища. Нулевое значение - параметр берётся из
+исходного хранилища */
+struct TagPackOptions {
+  uint16_t TagMaxAmount; //!< Максимальное количество тэгов
+  uint16_t TagRecordSize; //!< Размер записи тэга (кратно 8 байт)
+  uint16_t FileBlockSize; //!< Размер файлового блока
+};
+
+/*! Сжатие и переупаковка хранилища: все файловые записи переписываются в новое
+хранилище непрерывными последовательностями блоков в порядке номеров файлов.
+Свободные, зарезервированные и служебные блоки отбрасываются. Заодно можно
+поменять ёмкость тэгов, размер записи тэга и размер файлового блока. Хранилище
+читается и пишется за один проход, в памяти держится одна файловая запись.
+Номера файлов при этом меняются, поэтому хранилище не должно быть смонтировано
+\param src имя файла исходного хранилища
+\param dst имя файла нового хранилища. Пустое имя - исходное хранилище
+заменяется новым
+\param rewrite признак принудительной перезаписи файла dst
+\param opts параметры нового хранилища
+\return код ошибки (код завершения процесса). 0 - нет ошибок */
+int TagPack(const std::string& src, const std::string& dst, bool rewrite,
+    const TagPackOptions& opts);
+
+#endif // TAG_PACK_H
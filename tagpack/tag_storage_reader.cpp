@@ -0,0 +1,244 @@
+#include "tag_storage_reader.h"
+
+#include <cstring>
+#include <iostream>
+
+#include <boost/endian.hpp>
+
+namespace be = boost::endian;
+
+
+TagStorageReader::TagStorageReader(): settings_(), tag_table_pos_(0),
+    file_table_pos_(0), next_tag_(0), next_block_(0), failed_(false) {
+}
+
+bool TagStorageReader::Open(const std::string& path) {
+  scan_.open(path, std::ios_base::in | std::ios_base::binary);
+  chain_.open(path, std::ios_base::in | std::ios_base::binary);
+  if (!scan_ || !chain_) {
+    std::cerr << "Can't open storage file '" << path << "'" << std::endl;
+    return false;
+  }
+
+  try {
+    scan_.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+    chain_.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+
+    uint32_t f32;
+    uint64_t f64;
+    uint16_t f16;
+    scan_.read((char*)&f32, sizeof(f32)); // magic word
+    uint32_t magic = be::little_to_native(f32);
+    scan_.read((char*)&f32, sizeof(f32)); // version (padding in version 1)
+    if (magic == kMagicWordV2) {
+      if (be::little_to_native(f32) < 2) {
+        std::cerr << "Wrong format version " << be::little_to_native(f32) << std::endl;
+        return false;
+      }
+    } else if (magic != kMagicWordV1) {
+      std::cerr << "Unknown file format" << std::endl;
+      return false;
+    }
+
+    scan_.read((char*)&f64, sizeof(f64)); // tag table pos
+    tag_table_pos_ = be::little_to_native(f64);
+    scan_.read((char*)&f64, sizeof(f64)); // file table pos
+    file_table_pos_ = be::little_to_native(f64);
+    scan_.read((char*)&f16, sizeof(f16)); // tag size
+    settings_.TagRecordSize = be::little_to_native(f16);
+    scan_.read((char*)&f16, sizeof(f16)); // tag amount
+    settings_.TagMaxAmount = be::little_to_native(f16);
+    scan_.read((char*)&f16, sizeof(f16)); // padding
+    scan_.read((char*)&f16, sizeof(f16)); // fileblock size
+    settings_.FileBlockSize = be::little_to_native(f16);
+    scan_.read((char*)&f64, sizeof(f64)); // fileblock amount
+    settings_.FileBlockAmount = be::little_to_native(f64);
+
+    if (magic == kMagicWordV2) {
+      scan_.seekg(kFeaturesPos + sizeof(f32));
+      scan_.read((char*)&f32, sizeof(f32)); // incompatible features
+      f32 = be::little_to_native(f32);
+      if (f32 & (kIncompatJournal | kIncompatOpen)) {
+        std::cerr << "Storage is mounted or wasn't unmounted cleanly. " <<
+            "Mount and unmount it before packing" << std::endl;
+        return false;
+      }
+      if (f32 & ~kIncompatSupported) {
+        std::cerr << "Unsupported format features: " << std::hex <<
+            (f32 & ~kIncompatSupported) << std::dec << std::endl;
+        return false;
+      }
+    }
+
+    if (settings_.TagRecordSize <= kTagHeaderSize) {
+      std::cerr << "Bad file format: Tag record size is very small" << std::endl;
+      return false;
+    }
+    if (settings_.FileBlockSize <= kFileBlockHeaderSize + kFileHeaderSize) {
+      std::cerr << "Bad file format: File block size is very small" << std::endl;
+      return false;
+    }
+
+    scan_.seekg(tag_table_pos_);
+    return true;
+  } catch (std::exception& e) {
+    std::cerr << "File error: " << e.what() << std::endl;
+  }
+
+  return false;
+}
+
+bool TagStorageReader::NextTag(TagStorageTag& tag) {
+  if (failed_ || next_tag_ >= settings_.TagMaxAmount) { return false; }
+
+  try {
+    size_t tail_size = settings_.TagRecordSize - kTagHeaderSize;
+    std::vector<char> tail(tail_size);
+    uint16_t f16;
+
+    scan_.read((char*)&f16, sizeof(f16)); // tag flags
+    tag.Flags = be::little_to_native(f16);
+    scan_.read((char*)&f16, sizeof(f16)); // name length
+    uint16_t len = be::little_to_native(f16);
+    scan_.read(tail.data(), tail_size);
+    ++next_tag_;
+
+    tag.Name.clear();
+    if (tag.Flags != 0) {
+      if (len == 0 || len > tail_size) {
+        std::cerr << "Corrupted file: wrong length of tag name. Continue ..." << std::endl;
+        tag.Flags = 0;
+      } else {
+        tag.Name.assign(tail.data(), len);
+      }
+    }
+    if (next_tag_ == settings_.TagMaxAmount) {
+      scan_.seekg(file_table_pos_);
+    }
+    return true;
+  } catch (std::exception& e) {
+    std::cerr << "File error: " << e.what() << std::endl;
+  }
+
+  failed_ = true;
+  return false;
+}
+
+void TagStorageReader::ReadBlock(std::ifstream& file, uint64_t& prev,
+    uint64_t& next, std::vector<uint8_t>& data) {
+  uint64_t f64;
+
+  file.read((char*)&f64, sizeof(f64));
+  prev = be::little_to_native(f64);
+  file.read((char*)&f64, sizeof(f64));
+  next = be::little_to_native(f64);
+  data.resize(settings_.FileBlockSize - kFileBlockHeaderSize);
+  file.read((char*)data.data(), data.size());
+}
+
+bool TagStorageReader::NextFile(TagStorageFile& file) {
+  if (failed_) { return false; }
+  if (next_tag_ < settings_.TagMaxAmount) {
+    // Таблица тэгов не дочитана: переходим сразу к файловым блокам
+    next_tag_ = settings_.TagMaxAmount;
+    try {
+      scan_.seekg(file_table_pos_ + next_block_ * settings_.FileBlockSize);
+    } catch (std::exception& e) {
+      std::cerr << "File error: " << e.what() << std::endl;
+      failed_ = true;
+      return false;
+    }
+  }
+
+  try {
+    std::vector<uint8_t> data;
+
+    while (next_block_ < settings_.FileBlockAmount) {
+      uint64_t ino = next_block_++;
+      uint64_t prev, next;
+
+      ReadBlock(scan_, prev, next, data);
+      // Свободные, зарезервированные и служебные блоки имеют метки, а блоки
+      // продолжения цепочек ссылаются на другие блоки
+      if (prev != ino) { continue; }
+      if (ComposeFile(ino, next, data, file)) { return true; }
+    }
+    return false;
+  } catch (std::bad_alloc&) {
+    std::cerr << "Unavailable memory" << std::endl;
+  } catch (std::exception& e) {
+    std::cerr << "File error: " << e.what() << std::endl;
+  }
+
+  failed_ = true;
+  return false;
+}
+
+bool TagStorageReader::ComposeFile(uint64_t ino, uint64_t next,
+    std::vector<uint8_t>& data, TagStorageFile& file) {
+  std::vector<uint8_t> block;
+  uint64_t cur = ino;
+
+  for (size_t i = 1; next != cur; ++i) {
+    uint64_t block_index = next;
+    uint64_t prev;
+
+    if (i >= kMaxFileBlocks || block_index >= settings_.FileBlockAmount) {
+      std::cerr << "File blocks chain of file " << ino <<
+          " is corrupted. Skipped" << std::endl;
+      return false;
+    }
+    chain_.seekg(file_table_pos_ + block_index * settings_.FileBlockSize);
+    ReadBlock(chain_, prev, next, block);
+    if (prev != cur) {
+      std::cerr << "File blocks chain of file " << ino <<
+          " is corrupted (failed parent). Skipped" << std::endl;
+      return false;
+    }
+    data.insert(data.end(), block.begin(), block.end());
+    cur = block_index;
+  }
+
+  uint16_t tags_size, name_size;
+  uint32_t target_size;
+  std::memcpy(&tags_size, data.data(), 2);
+  std::memcpy(&name_size, data.data() + 2, 2);
+  std::memcpy(&target_size, data.data() + 4, 4);
+  tags_size = be::little_to_native(tags_size);
+  name_size = be::little_to_native(name_size);
+  target_size = be::little_to_native(target_size);
+  bool sparse = tags_size & kTagsFieldSparse;
+  tags_size &= ~kTagsFieldSparse;
+  if (data.size() < kFileHeaderSize + tags_size + name_size + target_size) {
+    std::cerr << "File information of file " << ino << " is corrupted. Skipped" <<
+        std::endl;
+    return false;
+  }
+
+  size_t disp = kFileHeaderSize;
+  file.Ino = ino;
+  file.Tags.clear();
+  if (sparse) {
+    for (size_t tb = 0; tb + 1 < tags_size; tb += 2) {
+      uint16_t tag;
+
+      std::memcpy(&tag, data.data() + disp + tb, 2);
+      file.Tags.push_back(be::little_to_native(tag));
+    }
+  } else {
+    for (size_t tb = 0; tb < tags_size; ++tb) {
+      uint8_t bits = data[disp + tb];
+
+      for (size_t b = 0; bits; ++b, bits >>= 1) {
+        if (bits & 0x01) {
+          file.Tags.push_back((uint16_t)(tb * 8 + b));
+        }
+      }
+    }
+  }
+  disp += tags_size;
+  file.FileName.assign((const char*)data.data() + disp, name_size);
+  disp += name_size;
+  file.TargetName.assign((const char*)data.data() + disp, target_size);
+  return true;
+}
@@ -0,0 +1,96 @@
+#ifndef TAG_STORAGE_READER_H
+#define TAG_STORAGE_READER_H
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+
+/*! Настройки хранилища (поля хедера, нужные для чтения и записи таблиц) */
+struct TagStorageSettings {
+  uint16_t TagRecordSize; //!< Размер записи с информацией о тэге
+  uint16_t TagMaxAmount; //!< Максимальное количество тэгов
+  uint16_t FileBlockSize; //!< Размер файлового блока
+  uint64_t FileBlockAmount; //!< Количество файловых блоков
+};
+
+struct TagStorageTag {
+  uint16_t Flags; //!< Флаги тэга. 0 - запись тэга не используется
+  std::string Name;
+};
+
+struct TagStorageFile {
+  uint64_t Ino; //!< Номер файла (первый блок цепочки)
+  std::string FileName;
+  std::string TargetName;
+  std::vector<uint16_t> Tags; //!< Номера тэгов по возрастанию
+};
+
+
+/*! Потоковое чтение хранилища (версий 1 и 2). Таблица файловых блоков
+просматривается один раз по возрастанию номеров блоков, в памяти держится
+только текущая файловая запись. Продолжения цепочек дочитываются отдельным
+потоком, поэтому память не зависит от размера хранилища */
+class TagStorageReader {
+ public:
+  TagStorageReader();
+
+  /*! Открыть хранилище и прочитать хедер
+  \param path путь к файлу хранилища
+  \return признак успешного открытия */
+  bool Open(const std::string& path);
+
+  const TagStorageSettings& GetSettings() const { return settings_; }
+
+  /*! Прочитать очередную запись таблицы тэгов (по порядку номеров)
+  \param tag заполняемая информация о тэге
+  \return false - записи закончились или ошибка чтения (см. Failed) */
+  bool NextTag(TagStorageTag& tag);
+
+  /*! Прочитать очередную файловую запись (по возрастанию номеров файлов).
+  Повреждённые записи пропускаются с сообщением об ошибке
+  \param file заполняемая информация о файле
+  \return false - записи закончились или ошибка чтения (см. Failed) */
+  bool NextFile(TagStorageFile& file);
+
+  /*! Признак ошибки чтения. После ошибки чтение прекращается */
+  bool Failed() const { return failed_; }
+
+ private:
+  TagStorageReader(const TagStorageReader&) = delete;
+  TagStorageReader& operator=(const TagStorageReader&) = delete;
+
+  static const uint32_t kMagicWordV1 = 0x34562343;
+  static const uint32_t kMagicWordV2 = 0x37562343;
+  static const uint32_t kIncompatSupported = (1 << 0) | (1 << 1); //!< Устаревший сохранённый индекс тэгов (не читается), разреженные тэги
+  static const uint32_t kIncompatJournal = 1 << 2; //!< В журнале могут быть неприменённые транзакции
+  static const uint32_t kIncompatOpen = 1 << 3; //!< Хранилище открыто драйвером на запись (или не закрыто после сбоя)
+  static const std::streamoff kFeaturesPos = 0x48;
+  static const size_t kTagHeaderSize = 4;
+  static const size_t kFileBlockHeaderSize = 16;
+  static const size_t kFileHeaderSize = 8;
+  static const uint16_t kTagsFieldSparse = 0x8000;
+  static const size_t kMaxFileBlocks = 1000; //!< Предельное ограничение на очень длинное описание файла (в блоках)
+
+  TagStorageSettings settings_;
+  uint64_t tag_table_pos_;
+  uint64_t file_table_pos_;
+  std::ifstream scan_; //!< Последовательный просмотр таблиц
+  std::ifstream chain_; //!< Чтение продолжений цепочек блоков
+  size_t next_tag_;
+  uint64_t next_block_;
+  bool failed_;
+
+  /*! Прочитать заголовок и данные блока из потока, стоящего на начале блока */
+  void ReadBlock(std::ifstream& file, uint64_t& prev, uint64_t& next,
+      std::vector<uint8_t>& data);
+
+  /*! Собрать запись из цепочки блоков и разобрать её
+  \return false - запись повреждена */
+  bool ComposeFile(uint64_t ino, uint64_t next, std::vector<uint8_t>& data,
+      TagStorageFile& file);
+};
+
+
+#endif // TAG_STORAGE_READER_H
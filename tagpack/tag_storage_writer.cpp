@@ -0,0 +1,250 @@
+#include "tag_storage_writer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+#include <boost/endian.hpp>
+
+namespace be = boost::endian;
+
+
+namespace {
+
+template <typename T>
+void PutLE(std::vector<uint8_t>& buf, size_t pos, T value) {
+  value = be::native_to_little(value);
+  std::memcpy(buf.data() + pos, &value, sizeof(value));
+}
+
+uint64_t AlignTable(uint64_t pos, uint64_t alignment) {
+  return (pos + alignment - 1) / alignment * alignment;
+}
+
+} // namespace
+
+
+TagStorageWriter::TagStorageWriter(): settings_(), tag_table_pos_(0),
+    file_table_pos_(0), mask_byte_size_(0), tags_written_(0),
+    fileblock_amount_(0), sparse_tags_(false), ext_table_pos_(0) {
+}
+
+bool TagStorageWriter::Create(const std::string& path,
+    const TagStorageSettings& settings) {
+  settings_ = settings;
+  if (settings_.TagRecordSize <= kTagHeaderSize || settings_.TagRecordSize % 8) {
+    std::cerr << "Wrong tag record size " << settings_.TagRecordSize << std::endl;
+    return false;
+  }
+  if (settings_.TagMaxAmount == 0) {
+    std::cerr << "Wrong tags amount" << std::endl;
+    return false;
+  }
+  if (settings_.FileBlockSize <= kFileBlockHeaderSize + kFileHeaderSize) {
+    std::cerr << "Wrong file block size " << settings_.FileBlockSize << std::endl;
+    return false;
+  }
+
+  tag_table_pos_ = AlignTable(kHeaderSize, kTablesAlignment);
+  file_table_pos_ = AlignTable(tag_table_pos_ +
+      (uint64_t)settings_.TagRecordSize * settings_.TagMaxAmount, kTablesAlignment);
+  mask_byte_size_ = (settings_.TagMaxAmount + 63) / 64 * 8;
+  tags_written_ = 0;
+  fileblock_amount_ = 0;
+  sparse_tags_ = false;
+  ext_table_pos_ = 0;
+
+  file_.open(path, std::ios_base::out | std::ios_base::trunc | std::ios_base::binary);
+  if (!file_) {
+    std::cerr << "Can't create/open file '" << path << "' for writing" << std::endl;
+    return false;
+  }
+  return WriteHeader();
+}
+
+bool TagStorageWriter::WriteHeader() {
+  std::vector<uint8_t> h(kHeaderSize, 0);
+
+  PutLE<uint32_t>(h, 0x00, kMagicWordV2);
+  PutLE<uint32_t>(h, 0x04, kFormatVersion);
+  PutLE<uint64_t>(h, 0x08, tag_table_pos_);
+  PutLE<uint64_t>(h, 0x10, file_table_pos_);
+  PutLE<uint16_t>(h, 0x18, settings_.TagRecordSize);
+  PutLE<uint16_t>(h, 0x1a, settings_.TagMaxAmount);
+  PutLE<uint16_t>(h, 0x1e, settings_.FileBlockSize);
+  PutLE<uint64_t>(h, 0x20, fileblock_amount_);
+  // 0x28 - 0x47 - резерв
+  PutLE<uint32_t>(h, 0x48, 0);
+  PutLE<uint32_t>(h, 0x4c, sparse_tags_ ? kIncompatSparseTags : 0);
+  PutLE<uint64_t>(h, 0x50, ext_table_pos_);
+
+  file_.seekp(0);
+  file_.write((const char*)h.data(), h.size());
+  return (bool)file_;
+}
+
+bool TagStorageWriter::AddTag(const TagStorageTag& tag) {
+  size_t tail_size = settings_.TagRecordSize - kTagHeaderSize;
+  std::vector<uint8_t> rec(settings_.TagRecordSize, 0);
+
+  if (tags_written_ >= settings_.TagMaxAmount) {
+    if (tag.Flags == 0) { return true; }
+    std::cerr << "Tag '" << tag.Name << "' doesn't fit into " <<
+        settings_.TagMaxAmount << " tags" << std::endl;
+    return false;
+  }
+
+  if (tag.Flags) {
+    if (tag.Name.size() > tail_size) {
+      std::cerr << "Tag name '" << tag.Name << "' doesn't fit into " <<
+          tail_size << " bytes of tag record" << std::endl;
+      return false;
+    }
+    PutLE<uint16_t>(rec, 0, tag.Flags);
+    PutLE<uint16_t>(rec, 2, tag.Name.size());
+    std::memcpy(rec.data() + kTagHeaderSize, tag.Name.data(), tag.Name.size());
+  }
+  file_.seekp(tag_table_pos_ + tags_written_ * settings_.TagRecordSize);
+  file_.write((const char*)rec.data(), rec.size());
+  ++tags_written_;
+  return (bool)file_;
+}
+
+bool TagStorageWriter::FinishTags() {
+  TagStorageTag free_tag;
+
+  free_tag.Flags = 0;
+  while (tags_written_ < settings_.TagMaxAmount) {
+    if (!AddTag(free_tag)) { return false; }
+  }
+  return true;
+}
+
+bool TagStorageWriter::ComposeTagField(const std::vector<uint16_t>& tags,
+    std::vector<uint8_t>& field, uint16_t& field_size) {
+  for (auto tag: tags) {
+    if (tag >= settings_.TagMaxAmount) {
+      std::cerr << "Tag " << tag << " doesn't fit into " <<
+          settings_.TagMaxAmount << " tags" << std::endl;
+      return false;
+    }
+  }
+
+  field.clear();
+  if (mask_byte_size_ > kSparseTagsMaskMin &&
+      tags.size() * sizeof(uint16_t) < mask_byte_size_) {
+    // Тэгов мало: номера тэгов по возрастанию (пустое поле - нет тэгов)
+    std::vector<uint16_t> sorted(tags);
+
+    std::sort(sorted.begin(), sorted.end());
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+    field.resize(sorted.size() * sizeof(uint16_t));
+    for (size_t i = 0; i < sorted.size(); ++i) {
+      PutLE<uint16_t>(field, i * sizeof(uint16_t), sorted[i]);
+    }
+    field_size = field.empty() ? 0 : (field.size() | kTagsFieldSparse);
+    sparse_tags_ = true;
+    return true;
+  }
+
+  field.assign(mask_byte_size_, 0);
+  for (auto tag: tags) {
+    field[tag / 8] |= 1 << (tag % 8);
+  }
+  field_size = mask_byte_size_;
+  return true;
+}
+
+bool TagStorageWriter::AddFile(const TagStorageFile& file, uint64_t& ino) {
+  std::vector<uint8_t> field;
+  uint16_t field_size;
+
+  if (tags_written_ < settings_.TagMaxAmount && !FinishTags()) { return false; }
+  if (file.FileName.empty() || file.FileName.size() > UINT16_MAX ||
+      file.TargetName.size() > UINT32_MAX) {
+    std::cerr << "Wrong file name '" << file.FileName << "'" << std::endl;
+    return false;
+  }
+  if (!ComposeTagField(file.Tags, field, field_size)) { return false; }
+
+  size_t record_size = kFileHeaderSize + field.size() + file.FileName.size() +
+      file.TargetName.size();
+  size_t payload = settings_.FileBlockSize - kFileBlockHeaderSize;
+  size_t blocks = (record_size + payload - 1) / payload;
+  if (blocks > kMaxFileBlocks) {
+    std::cerr << "File information of '" << file.FileName << "' is too long" << std::endl;
+    return false;
+  }
+
+  std::vector<uint8_t> record(blocks * payload, 0);
+  PutLE<uint16_t>(record, 0, field_size);
+  PutLE<uint16_t>(record, 2, file.FileName.size());
+  PutLE<uint32_t>(record, 4, file.TargetName.size());
+  size_t pos = kFileHeaderSize;
+  std::memcpy(record.data() + pos, field.data(), field.size());
+  pos += field.size();
+  std::memcpy(record.data() + pos, file.FileName.data(), file.FileName.size());
+  pos += file.FileName.size();
+  std::memcpy(record.data() + pos, file.TargetName.data(), file.TargetName.size());
+
+  // Блоки записи идут подряд: первый ссылается на себя как на предыдущий,
+  // последний - на себя как на следующий
+  ino = fileblock_amount_;
+  std::vector<uint8_t> block(settings_.FileBlockSize);
+  file_.seekp(file_table_pos_ + ino * settings_.FileBlockSize);
+  for (size_t i = 0; i < blocks; ++i) {
+    uint64_t cur = ino + i;
+
+    PutLE<uint64_t>(block, 0, i ? cur - 1 : cur);
+    PutLE<uint64_t>(block, 8, i + 1 < blocks ? cur + 1 : cur);
+    std::memcpy(block.data() + kFileBlockHeaderSize, record.data() + i * payload,
+        payload);
+    file_.write((const char*)block.data(), block.size());
+  }
+  fileblock_amount_ += blocks;
+  return (bool)file_;
+}
+
+bool TagStorageWriter::WriteJournal() {
+  size_t payload = settings_.FileBlockSize - kFileBlockHeaderSize;
+
+  if (payload < kJournalHeaderSize + kExtTableHeaderSize + kExtEntrySize) { return true; }
+
+  uint64_t blocks = 1 + (kJournalSize + payload - 1) / payload;
+  uint64_t region_pos = file_table_pos_ + fileblock_amount_ * settings_.FileBlockSize;
+  std::vector<uint8_t> block(settings_.FileBlockSize, 0);
+
+  // Блоки данных журнала пустые: в них нет транзакций текущего поколения
+  PutLE<uint64_t>(block, 0, kJournalBlockMark);
+  PutLE<uint64_t>(block, 8, kJournalBlockMark);
+  file_.seekp(region_pos + settings_.FileBlockSize);
+  for (uint64_t i = 1; i < blocks; ++i) {
+    file_.write((const char*)block.data(), block.size());
+  }
+
+  // Первый блок: заголовок журнала и таблица расширений с записью о журнале
+  size_t pos = kFileBlockHeaderSize;
+  PutLE<uint32_t>(block, pos, kJournalMagic);
+  PutLE<uint64_t>(block, pos + 8, 1);
+  pos += kJournalHeaderSize;
+  PutLE<uint32_t>(block, pos, 1);
+  PutLE<uint32_t>(block, pos + 4, kExtEntrySize);
+  pos += kExtTableHeaderSize;
+  PutLE<uint32_t>(block, pos, kExtJournal);
+  PutLE<uint64_t>(block, pos + 8, region_pos);
+  PutLE<uint64_t>(block, pos + 16, blocks * settings_.FileBlockSize);
+  file_.seekp(region_pos);
+  file_.write((const char*)block.data(), block.size());
+
+  ext_table_pos_ = region_pos + kFileBlockHeaderSize + kJournalHeaderSize;
+  fileblock_amount_ += blocks;
+  return (bool)file_;
+}
+
+bool TagStorageWriter::Finish() {
+  if (!FinishTags()) { return false; }
+  if (!WriteJournal()) { return false; }
+  if (!WriteHeader()) { return false; }
+  file_.close();
+  return !file_.fail();
+}
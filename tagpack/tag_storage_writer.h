@@ -0,0 +1,93 @@
+#ifndef TAG_STORAGE_WRITER_H
+#define TAG_STORAGE_WRITER_H
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "tag_storage_reader.h"
+
+
+/*! Последовательная запись нового хранилища (текущей версии формата). Тэги
+пишутся по порядку номеров, затем файлы: каждая файловая запись занимает
+непрерывную последовательность блоков сразу за предыдущей записью. За
+файлами идёт пустой журнал записи (как в хранилище, созданном модулем) */
+class TagStorageWriter {
+ public:
+  TagStorageWriter();
+
+  /*! Создать файл хранилища и записать в него хедер
+  \param path путь к создаваемому файлу (существующий файл перезаписывается)
+  \param settings настройки хранилища (количество блоков не используется)
+  \return признак успешного создания */
+  bool Create(const std::string& path, const TagStorageSettings& settings);
+
+  /*! Записать очередную запись таблицы тэгов. Записи, которые не записаны до
+  первого файла, считаются свободными
+  \return признак успешной записи (false - тэг или его имя не помещается в
+  хранилище с новыми параметрами) */
+  bool AddTag(const TagStorageTag& tag);
+
+  /*! Записать файловую запись в следующие свободные блоки
+  \param file информация о файле (номер файла не используется)
+  \param ino возвращает номер файла в новом хранилище
+  \return признак успешной записи */
+  bool AddFile(const TagStorageFile& file, uint64_t& ino);
+
+  /*! Дописать журнал и хедер (количество блоков) и закрыть файл
+  \return признак успешной записи */
+  bool Finish();
+
+  /*! Количество записанных файловых блоков */
+  uint64_t GetFileBlockAmount() const { return fileblock_amount_; }
+
+ private:
+  TagStorageWriter(const TagStorageWriter&) = delete;
+  TagStorageWriter& operator=(const TagStorageWriter&) = delete;
+
+  static const uint32_t kMagicWordV2 = 0x37562343;
+  static const uint32_t kFormatVersion = 2;
+  static const uint32_t kIncompatSparseTags = 1 << 1;
+  static const size_t kHeaderSize = 0x58;
+  static const uint64_t kTablesAlignment = 256;
+  static const size_t kTagHeaderSize = 4;
+  static const size_t kFileBlockHeaderSize = 16;
+  static const size_t kFileHeaderSize = 8;
+  static const uint16_t kTagsFieldSparse = 0x8000;
+  static const size_t kSparseTagsMaskMin = 16; //!< Номера тэгов пишутся при маске больше этого размера (как в модуле)
+  static const size_t kMaxFileBlocks = 1000;
+  static const uint32_t kExtJournal = 1; //!< Тип расширения хедера: журнал
+  static const uint64_t kJournalBlockMark = (uint64_t)(-5); //!< Поля заголовка блока журнала
+  static const size_t kJournalSize = 1 << 20; //!< Размер данных журнала (как в модуле)
+  static const uint32_t kJournalMagic = 0x4a564754;
+  static const size_t kJournalHeaderSize = 16;
+  static const size_t kExtTableHeaderSize = 8;
+  static const size_t kExtEntrySize = 24;
+
+  TagStorageSettings settings_;
+  uint64_t tag_table_pos_;
+  uint64_t file_table_pos_;
+  size_t mask_byte_size_; //!< Размер маски тэгов (выровнен на 8 байт, как в модуле)
+  std::ofstream file_;
+  size_t tags_written_;
+  uint64_t fileblock_amount_;
+  bool sparse_tags_; //!< Записано поле с номерами тэгов (в хедере нужен kIncompatSparseTags)
+  uint64_t ext_table_pos_; //!< Позиция таблицы расширений хедера (в первом блоке журнала). 0 - журнала нет
+
+  bool WriteHeader();
+  bool FinishTags();
+
+  /*! Записать пустой журнал (первое поколение) за файловыми записями. Если
+  заголовок журнала не помещается в блок, то хранилище остаётся без журнала */
+  bool WriteJournal();
+
+  /*! Сформировать поле тэгов: номера тэгов, если их мало (и хранилище
+  больше чем со 128 тэгами), иначе маска
+  \return false - номер тэга вне ёмкости хранилища */
+  bool ComposeTagField(const std::vector<uint16_t>& tags,
+      std::vector<uint8_t>& field, uint16_t& field_size);
+};
+
+
+#endif // TAG_STORAGE_WRITER_H
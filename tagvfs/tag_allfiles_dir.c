@@ -30,52 +30,77 @@
 extern const struct dentry_operations tagfs_allfiles_dir_negative_dentry_ops;
 
 
+/*! Курсор итерации по директории. Связывает позицию в директории с номером
+файла, выданного последним. Позволяет продолжать выдачу со следующего файла,
+без поиска файла по порядковому номеру */
 struct dir_data {
-  unsigned long last_iterate_ino;
+  size_t last_iterate_ino; //!< Номер файла, выданного последним
+  loff_t last_iterate_pos; //!< Позиция файла, выданного последним. Или -1, если файлов не выдавалось
+  FileFilter filter; //!< Фильтр файлов (без тэгов), строится при открытии директории
 };
 
 
 int tagfs_allfiles_dir_iterate(struct file* f, struct dir_context* dc) {
+  struct dir_data* dd = (struct dir_data*)(f->private_data);
   size_t ino;
   Storage stor;
   struct dentry* parent;
-  struct qstr name = get_null_qstr();
-  size_t start_index;
-  struct TagMask zero;
+  struct DirEmitFile ef;
+  int res;
 
+  WARN_ON(!dd);
   stor = inode_storage(file_inode(f));
   parent = file_dentry(f);
   if (!parent) { return -EFAULT; }
-  zero = tagmask_init_zero(tagfs_get_maximum_tags_amount(stor));
   if (!dir_emit_dots(f, dc)) { return -ENOMEM; }
 
-  start_index = dc->pos - 2;
-  for (name = tagfs_get_nth_file(stor, zero, zero, start_index, &ino);
-      ino != kNotFoundIno; name = tagfs_get_next_file(stor, zero, zero, &ino)) {
-    if (!dir_emit(dc, name.name, name.len, ino + kFSRealFilesStartIno, DT_LNK)) {
-      return -ENOMEM;
-    }
-    dc->pos += 1;
+  if (dd->last_iterate_pos != -1 && dc->pos == dd->last_iterate_pos + 1) {
+    // Продолжаем выдачу после последнего выданного файла
+    ino = dd->last_iterate_ino;
+    res = tagfs_visit_next_file(stor, dd->filter, &ino, copy_file_for_emit, &ef);
+  } else {
+    // Первая выдача или позиция изменилась (seekdir, rewinddir и т.п.)
+    res = tagfs_visit_nth_file(stor, dd->filter, dc->pos - kPosAfterDots, &ino,
+        copy_file_for_emit, &ef);
+  }
 
-    free_qstr(&name);
+  for (; res == 0; res = tagfs_visit_next_file(stor, dd->filter, &ino,
+      copy_file_for_emit, &ef)) {
+    // Имя выдаётся вне чтения таблицы файлов: dir_emit может засыпать
+    res = emit_copied_file(dc, &ef);
+    if (res) { break; }
+    dd->last_iterate_ino = ino;
+    dd->last_iterate_pos = dc->pos;
+    dc->pos += 1;
   }
 
-  return 0;
+  return res == -ENOENT ? 0 : res;
 }
 
 int tagfs_allfiles_dir_open(struct inode *inode, struct file *file) {
   struct dir_data* dd;
-
-  file->private_data = kzalloc(sizeof(struct dir_data), GFP_KERNEL);
-  if (!file->private_data) { return -ENOMEM; }
-
-  dd = (struct dir_data*)(file->private_data);
-  dd->last_iterate_ino = 0;
+  int res;
+
+  dd = kzalloc(sizeof(struct dir_data), GFP_KERNEL);
+  if (!dd) { return -ENOMEM; }
+
+  dd->last_iterate_ino = kNotFoundIno;
+  dd->last_iterate_pos = -1;
+  res = tagfs_init_file_filter(inode_storage(inode), &dd->filter, tagmask_empty(),
+      tagmask_empty());
+  if (res) {
+    kfree(dd);
+    return res;
+  }
+  file->private_data = dd;
   return 0;
 }
 
 int tagfs_allfiles_dir_release(struct inode *inode, struct file *file) {
-  kfree(file->private_data);
+  struct dir_data* dd = (struct dir_data*)(file->private_data);
+
+  if (dd) { tagfs_release_file_filter(&dd->filter); }
+  kfree(dd);
   file->private_data = NULL;
   return 0;
 }
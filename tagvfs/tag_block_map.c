@@ -0,0 +1,222 @@
+// This file is part of tagvfs
+// Copyright (C) 2023 Evgeny Kislov
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "tag_block_map.h"
+
+#include <linux/bitmap.h>
+#include <linux/bitops.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+
+#include "tag_storage.h"
+
+#define kBlockMapMinCapacity 4096
+
+
+struct BlockMapInternal {
+  unsigned long* free_bits; //!< Маска блоков: 1 - блок свободен
+  unsigned long* summary; //!< Сводная маска: 1 - в слове free_bits есть свободные блоки
+  struct BlockLink* links; //!< Связи блоков в цепочках. Неизвестная связь - kNotFoundIno
+  size_t amount; //!< Количество блоков в карте
+  size_t capacity; //!< Количество блоков, под которое выделена память
+  size_t free_amount; //!< Количество свободных блоков
+};
+
+
+/*! Обновить бит сводной маски для слова, в котором находится блок */
+void update_summary(struct BlockMapInternal* bmi, size_t block) {
+  size_t word = BIT_WORD(block);
+
+  if (bmi->free_bits[word]) {
+    __set_bit(word, bmi->summary);
+  } else {
+    __clear_bit(word, bmi->summary);
+  }
+}
+
+
+// Описание в хедере
+int tagfs_init_block_map(BlockMap* map) {
+  struct BlockMapInternal* bmi;
+
+  if (map == NULL || (*map) != NULL) { return -EINVAL; }
+
+  bmi = kzalloc(sizeof(struct BlockMapInternal), GFP_KERNEL);
+  if (!bmi) { return -ENOMEM; }
+
+  *map = bmi;
+  return 0;
+}
+
+
+// Описание в хедере
+void tagfs_release_block_map(BlockMap* map) {
+  struct BlockMapInternal* bmi;
+
+  if (map == NULL || (*map) == NULL) { return; }
+
+  bmi = (struct BlockMapInternal*)(*map);
+  kvfree(bmi->free_bits);
+  kvfree(bmi->summary);
+  kvfree(bmi->links);
+  kfree(bmi);
+  *map = NULL;
+}
+
+
+// Описание в хедере
+int tagfs_block_map_resize(BlockMap map, size_t amount) {
+  struct BlockMapInternal* bmi = (struct BlockMapInternal*)(map);
+
+  if (unlikely(!bmi)) { return -EINVAL; }
+
+  if (amount > bmi->capacity) {
+    size_t new_cap = max3(bmi->capacity * 2, amount, (size_t)kBlockMapMinCapacity);
+    size_t words = BITS_TO_LONGS(new_cap);
+    unsigned long* new_bits = kvcalloc(words, sizeof(unsigned long), GFP_KERNEL);
+    unsigned long* new_summary = kvcalloc(BITS_TO_LONGS(words),
+        sizeof(unsigned long), GFP_KERNEL);
+    struct BlockLink* new_links = kvmalloc_array(new_cap, sizeof(struct BlockLink),
+        GFP_KERNEL);
+
+    if (!new_bits || !new_summary || !new_links) {
+      kvfree(new_bits);
+      kvfree(new_summary);
+      kvfree(new_links);
+      return -ENOMEM;
+    }
+    if (bmi->capacity) {
+      bitmap_copy(new_bits, bmi->free_bits, bmi->capacity);
+      bitmap_copy(new_summary, bmi->summary, BITS_TO_LONGS(bmi->capacity));
+      memcpy(new_links, bmi->links, bmi->capacity * sizeof(struct BlockLink));
+    }
+    // Связи новых блоков неизвестны (все байты 0xff - kNotFoundIno)
+    memset(new_links + bmi->capacity, 0xff,
+        (new_cap - bmi->capacity) * sizeof(struct BlockLink));
+    kvfree(bmi->free_bits);
+    kvfree(bmi->summary);
+    kvfree(bmi->links);
+    bmi->free_bits = new_bits;
+    bmi->summary = new_summary;
+    bmi->links = new_links;
+    bmi->capacity = new_cap;
+  }
+
+  if (amount < bmi->amount) {
+    // Отбрасываемые блоки не должны остаться свободными
+    size_t block;
+
+    for (block = amount; block < bmi->amount; ++block) {
+      if (__test_and_clear_bit(block, bmi->free_bits)) {
+        --bmi->free_amount;
+        update_summary(bmi, block);
+      }
+      bmi->links[block].prev = kNotFoundIno;
+      bmi->links[block].next = kNotFoundIno;
+    }
+  }
+
+  bmi->amount = amount;
+  return 0;
+}
+
+
+// Описание в хедере
+void tagfs_block_map_set_free(BlockMap map, size_t block) {
+  struct BlockMapInternal* bmi = (struct BlockMapInternal*)(map);
+
+  if (unlikely(!bmi) || block >= bmi->amount) { return; }
+  bmi->links[block].prev = kNotFoundIno;
+  bmi->links[block].next = kNotFoundIno;
+  if (__test_and_set_bit(block, bmi->free_bits)) { return; }
+
+  ++bmi->free_amount;
+  __set_bit(BIT_WORD(block), bmi->summary);
+}
+
+
+// Описание в хедере
+size_t tagfs_block_map_take_free(BlockMap map) {
+  struct BlockMapInternal* bmi = (struct BlockMapInternal*)(map);
+  size_t words;
+  size_t word;
+  size_t block;
+
+  if (unlikely(!bmi) || bmi->free_amount == 0) { return kNotFoundIno; }
+
+  words = BITS_TO_LONGS(bmi->amount);
+  word = find_first_bit(bmi->summary, words);
+  if (word >= words) { return kNotFoundIno; }
+
+  block = word * BITS_PER_LONG + __ffs(bmi->free_bits[word]);
+  __clear_bit(block, bmi->free_bits);
+  --bmi->free_amount;
+  update_summary(bmi, block);
+  return block;
+}
+
+
+// Описание в хедере
+size_t tagfs_block_map_take_run(BlockMap map, size_t amount) {
+  struct BlockMapInternal* bmi = (struct BlockMapInternal*)(map);
+  size_t start = 0;
+
+  if (unlikely(!bmi) || amount == 0) { return kNotFoundIno; }
+  if (amount == 1) { return tagfs_block_map_take_free(map); }
+
+  while (bmi->free_amount >= amount) {
+    size_t first = find_next_bit(bmi->free_bits, bmi->amount, start);
+    size_t last;
+    size_t block;
+
+    if (first >= bmi->amount) { break; }
+    last = find_next_zero_bit(bmi->free_bits, bmi->amount, first);
+    if (last - first < amount) {
+      start = last;
+      continue;
+    }
+
+    bitmap_clear(bmi->free_bits, first, amount);
+    bmi->free_amount -= amount;
+    for (block = first; block < first + amount; block += BITS_PER_LONG) {
+      update_summary(bmi, block);
+    }
+    update_summary(bmi, first + amount - 1);
+    return first;
+  }
+
+  return kNotFoundIno;
+}
+
+
+// Описание в хедере
+void tagfs_block_map_set_link(BlockMap map, size_t block, size_t prev, size_t next) {
+  struct BlockMapInternal* bmi = (struct BlockMapInternal*)(map);
+
+  if (unlikely(!bmi) || block >= bmi->amount) { return; }
+  bmi->links[block].prev = prev;
+  bmi->links[block].next = next;
+}
+
+
+// Описание в хедере
+bool tagfs_block_map_get_link(BlockMap map, size_t block, struct BlockLink* link) {
+  struct BlockMapInternal* bmi = (struct BlockMapInternal*)(map);
+
+  if (unlikely(!bmi) || block >= bmi->amount) { return false; }
+  *link = bmi->links[block];
+  return link->prev != kNotFoundIno;
+}
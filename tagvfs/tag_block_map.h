@@ -0,0 +1,82 @@
+// This file is part of tagvfs
+// Copyright (C) 2023 Evgeny Kislov
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef TAG_BLOCK_MAP_H
+#define TAG_BLOCK_MAP_H
+
+#include <linux/kernel.h>
+
+/*! Карта свободных файловых блоков. Хранится битовой маской (1 - блок свободен)
+и сводной маской по словам (1 - в слове есть свободные блоки), поэтому поиск
+свободного блока не требует чтения хранилища и перебора занятых блоков.
+Также карта хранит связи блоков в цепочках файловых записей (копии полей
+заголовков блоков), чтобы изменение цепочки не требовало чтения заголовков.
+Карта не имеет собственной блокировки: все вызовы выполняются под блокировкой
+распределения блоков хранилища (alloc_lock). */
+typedef void* BlockMap;
+
+/*! Связи блока в цепочке. Если связь неизвестна (блок свободен или его
+заголовок ещё не загружен), то оба поля равны kNotFoundIno */
+struct BlockLink {
+  size_t prev;
+  size_t next;
+};
+
+
+/*! Создать пустую карту (без блоков)
+\param map указатель на переменную для карты. Изначально в переменной должен быть NULL
+\return отрицательный код ошибки. Если ошибок нет - возвращается 0 */
+int tagfs_init_block_map(BlockMap* map);
+
+/*! Удалить карту, освободить все ресурсы
+\param map указатель на переменную с удаляемой картой */
+void tagfs_release_block_map(BlockMap* map);
+
+/*! Изменить количество блоков в карте. Добавленные блоки считаются занятыми,
+их связи - неизвестными
+\param amount новое количество блоков
+\return отрицательный код ошибки. 0 - ошибок нет */
+int tagfs_block_map_resize(BlockMap map, size_t amount);
+
+/*! Отметить блок свободным. Связи блока становятся неизвестными. Блоки вне
+карты игнорируются
+\param block номер блока */
+void tagfs_block_map_set_free(BlockMap map, size_t block);
+
+/*! Найти свободный блок и отметить его занятым
+\return номер блока или kNotFoundIno, если свободных блоков нет */
+size_t tagfs_block_map_take_free(BlockMap map);
+
+/*! Найти непрерывную последовательность свободных блоков и отметить её занятой
+\param amount требуемое количество блоков
+\return номер первого блока последовательности или kNotFoundIno, если такой
+последовательности нет */
+size_t tagfs_block_map_take_run(BlockMap map, size_t amount);
+
+/*! Запомнить связи блока в цепочке (после записи заголовка блока). Блоки вне
+карты игнорируются
+\param block номер блока
+\param prev, next предыдущий и следующий блоки (как в заголовке блока).
+kNotFoundIno - связь неизвестна */
+void tagfs_block_map_set_link(BlockMap map, size_t block, size_t prev, size_t next);
+
+/*! Выдать связи блока в цепочке
+\param block номер блока
+\param link возвращает связи блока
+\return true - связи известны. false - связи нужно прочитать из заголовка блока */
+bool tagfs_block_map_get_link(BlockMap map, size_t block, struct BlockLink* link);
+
+#endif // TAG_BLOCK_MAP_H
@@ -37,6 +37,28 @@ bool get_unique_dirino(size_t* dirino) {
 }
 
 
+// Описание в хедере
+int copy_file_for_emit(void* ctx, size_t ino, const struct qstr name,
+    const struct TagMask mask, const struct qstr target) {
+  struct DirEmitFile* ef = (struct DirEmitFile*)(ctx);
+
+  if (name.len > sizeof(ef->name)) { return -ENAMETOOLONG; }
+  ef->ino = ino;
+  ef->name_len = name.len;
+  memcpy(ef->name, name.name, name.len);
+  return 0;
+}
+
+
+// Описание в хедере
+int emit_copied_file(struct dir_context* dc, const struct DirEmitFile* ef) {
+  if (!dir_emit(dc, ef->name, ef->name_len, ef->ino + kFSRealFilesStartIno, DT_LNK)) {
+    return -ENOMEM;
+  }
+  return 0;
+}
+
+
 /*! Создаём новую ноду для директории
 \param sb указатель на суперблок файловой системы
 \param dirino номер ноды для создаваемой директории. Может быть 0 - тогда ноде
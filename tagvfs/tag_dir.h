@@ -20,6 +20,8 @@
 #include <linux/fs.h>
 #include <linux/kernel.h>
 
+#include "tag_tag_mask.h"
+
 /*! Выдаёт уникальный номер ноды для директории.
 \param dirino указатель для получения уникального номера. Не может быть NULL.
 Значение под указателем может быть изменено даже в случае ошибок
@@ -50,6 +52,29 @@ struct inode* fill_dentry_by_new_directory_inode(struct super_block* sb,
     struct dentry* owner_de, size_t dirino,
     const struct inode_operations* inode_ops, const struct file_operations* file_ops);
 
+/*! Файл для выдачи в листинг директории. Имя копируется из таблицы файлов под
+её блокировкой (см. copy_file_for_emit), а в листинг выдаётся уже после снятия
+блокировки (см. emit_copied_file): выдача может обращаться к памяти
+пользователя */
+struct DirEmitFile {
+  size_t ino;
+  size_t name_len;
+  char name[NAME_MAX];
+};
+
+/*! Копирует номер и имя файла для выдачи в листинг. Колбэк для
+tagfs_visit_*_file
+\param ctx структура DirEmitFile
+\return 0 или -ENAMETOOLONG, если имя не помещается */
+int copy_file_for_emit(void* ctx, size_t ino, const struct qstr name,
+    const struct TagMask mask, const struct qstr target);
+
+/*! Выдаёт скопированный файл в листинг директории
+\param dc структура dir_context листинга
+\param ef файл, заполненный copy_file_for_emit
+\return 0 или -ENOMEM, если листинг заполнен */
+int emit_copied_file(struct dir_context* dc, const struct DirEmitFile* ef);
+
 /*! Отладочный вывод (в kern.log) содержимого dentry
 \param de указатель на выводимуй структуру. Может быть NULL */
 void tagfs_printk_dentry(struct dentry* de);
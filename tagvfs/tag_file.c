@@ -29,39 +29,42 @@ void flink_delay_buffer(void* buf) {
   kfree(buf);
 }
 
+/*! Колбэк для копирования целевой ссылки файла сразу в выдаваемый буфер.
+Буфер выделяется заранее: колбэк не должен засыпать
+\param ctx буфер размером PATH_MAX (char*)
+\return отрицательный код ошибки (-ENAMETOOLONG - ссылка не помещается в
+буфер). 0 - ошибок нет */
+int flink_copy_target(void* ctx, size_t ino, const struct qstr name,
+    const struct TagMask mask, const struct qstr target) {
+  char* data = (char*)(ctx);
+
+  if (target.len >= PATH_MAX) { return -ENAMETOOLONG; }
+  memcpy(data, target.name, target.len);
+  data[target.len] = '\0';
+  return 0;
+}
+
 const char* flink_getlink(struct dentry* de, struct inode* inode,
     struct delayed_call* delay_call) {
   char* data;
   size_t ino;
-  struct qstr lnk = QSTR_INIT(NULL, 0);
   Storage stor = inode_storage(inode);
-  const char* res = kEmptyLink;
 
   if (inode->i_ino < kFSRealFilesStartIno || inode->i_ino > kFSRealFilesFinishIno) {
     return kEmptyLink;
   }
   ino = inode->i_ino - kFSRealFilesStartIno;
 
-  lnk = tagfs_get_file_link(stor, ino);
-  if (lnk.len == 0) {
+  data = kmalloc(PATH_MAX, GFP_KERNEL);
+  if (!data) { return kEmptyLink; }
+  if (tagfs_visit_file(stor, ino, flink_copy_target, data) || !data[0]) {
+    kfree(data);
     return kEmptyLink;
   }
 
-  data = (char*)kzalloc(lnk.len + 1, GFP_KERNEL);
-  if (!data) { goto ea_ad; }
-  memcpy(data, lnk.name, lnk.len);
-  data[lnk.len] = '\0';
-  free_qstr(&lnk);
-
   set_delayed_call(delay_call, flink_delay_buffer, data);
 
   return data;
-
-// -------------
-ea_ad: // Errors after allocation of data
-  free_qstr(&lnk);
-  kfree(data);
-  return res;
 }
 
 const static struct file_operations linkfile_fops = {
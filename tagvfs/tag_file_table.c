@@ -0,0 +1,1219 @@
+// This file is part of tagvfs
+// Copyright (C) 2023 Evgeny Kislov
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "tag_file_table.h"
+
+#include <linux/hash.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
+#include <linux/slab.h>
+
+#include "common.h"
+#include "tag_storage.h"
+
+#define kNoRecord U32_MAX
+#define kNoChunk U32_MAX
+#define kInlineMaskSize 16 //!< Размер маски в байтах, которая хранится прямо в записи (128 тэгов)
+#define kSegmentBits 10 //!< Количество битов номера записи внутри сегмента таблицы
+#define kSegmentSize (1 << kSegmentBits) //!< Количество записей в сегменте таблицы
+#define kSegmentDirMin 16 //!< Начальная ёмкость каталога сегментов
+#define kArenaOffsetBits 17 //!< Количество битов смещения в позиции строки. Старшие биты - номер куска буфера
+#define kArenaChunkMax (1 << kArenaOffsetBits) //!< Наибольший размер куска строкового буфера
+#define kArenaChunksMax (1 << (32 - kArenaOffsetBits)) //!< Наибольшее количество кусков строкового буфера
+#define kArenaMinSize 4096 //!< Размер первого куска строкового буфера
+#define kArenaDirMin 16 //!< Начальная ёмкость каталога кусков
+#define kNameHashMaxLoad 2 //!< Среднее количество файлов на корзину, после которого хэш имён увеличивается
+#define kNameHashMinLoadDiv 8 //!< Хэш имён уменьшается, если файлов меньше 1/8 от количества корзин
+#define kRehashStep 64 //!< Количество корзин, переносимых при перестроении хэша за одну операцию изменения
+
+#define kInlineTagsMax (kInlineMaskSize / sizeof(u16)) //!< Количество тэгов разреженного набора, который хранится прямо в записи
+
+const u16 kRecordActive = 0x0001;
+const u16 kRecordSparse = 0x0002; //!< Тэги хранятся разреженным набором номеров, а не маской
+const u16 kRecordExt = 0x0004; //!< Маска или набор тэгов выделены отдельно (FileRecord::ext)
+const u16 kRecordTagsMask = 0xff00; //!< Количество тэгов встроенного разреженного набора
+#define kRecordTagsShift 8
+
+
+/*! Отдельно выделенные маска или разреженный набор тэгов записи. Данные не
+меняются: при изменении тэгов выделяется новый объект, а прежний удаляется
+после окончания текущих чтений */
+struct RecordExt {
+  struct rcu_head rcu;
+  u8 data[]; //!< Маска или набор тэгов (первый элемент - количество тэгов)
+};
+
+/*! Запись о файле. Строки хранятся в общем буфере (arena) по позициям (см.
+arena_chunk).
+Тэги файла хранятся одним из способов (выбирается по каждому файлу):
+- маска прямо в записи, если вся маска не больше kInlineMaskSize байт;
+- разреженный набор номеров тэгов прямо в записи (до kInlineTagsMax тэгов);
+- разреженный набор в отдельном буфере (первый элемент - количество тэгов),
+  если он меньше маски;
+- маска в отдельном буфере */
+struct FileRecord {
+  u32 name_pos;
+  u16 name_len;
+  u16 flags;
+  u32 target_pos;
+  u32 target_len;
+  u32 name_hash; //!< Полный хэш имени (для быстрого сравнения)
+  u32 hash_next; //!< Следующий номер в цепочке хэша имён или kNoRecord
+  union {
+    u8 mask[kInlineMaskSize]; //!< Маска тэгов, если она помещается в запись
+    u16 tags[kInlineTagsMax]; //!< Отсортированные номера тэгов (kRecordSparse)
+    struct RecordExt* ext; //!< Отдельно выделенные маска или набор тэгов (kRecordExt)
+  };
+};
+
+/*! Каталог сегментов таблицы записей. Сегменты не переносятся при росте
+таблицы: добавляются новые сегменты, а копируется только каталог */
+struct SegmentDir {
+  struct rcu_head rcu;
+  size_t capacity;
+  size_t amount; //!< Количество выделенных сегментов. Увеличивается после записи указателя на сегмент
+  struct FileRecord* segments[];
+};
+
+/*! Заголовок строк файла (имя и целевая ссылка подряд) в куске буфера.
+По номеру файла при уплотнении куска находится запись, которая ссылается на строки */
+struct ArenaEntry {
+  u32 ino;
+  u32 len; //!< Длина строк без заголовка
+};
+
+/*! Кусок строкового буфера. Строки дописываются в конец текущего куска и
+больше не меняются, а место строк удалённых файлов освобождается уплотнением
+куска в новый кусок (см. arena_compact_wo_lock) */
+struct ArenaChunk {
+  struct rcu_head rcu;
+  u32 size;
+  u32 used;
+  u32 garbage; //!< Объём строк удалённых файлов, который ещё занимает место в куске
+  char data[];
+};
+
+/*! Каталог кусков строкового буфера. Номер куска входит в позицию строки */
+struct ArenaDir {
+  struct rcu_head rcu;
+  size_t capacity;
+  struct ArenaChunk* chunks[]; //!< NULL - номер свободен
+};
+
+/*! Хэш-таблица имён: начала цепочек, связанных через FileRecord::hash_next */
+struct NameHash {
+  struct rcu_head rcu;
+  unsigned int bits;
+  u32 buckets[];
+};
+
+struct FileTableInternal {
+  /*! Блокировка изменений таблицы. Используется мьютекс, т.к. при изменении
+  таблицы выделяется память (с возможным засыпанием). Читатели блокировку не
+  ставят (см. seq) */
+  struct mutex lock;
+  /*! Счётчик изменений. Записи файлов, цепочки хэша имён и позиции строк
+  меняются внутри секции записи, а читатели перечитывают снимок записи, если
+  секция записи прошла во время чтения. В секции записи память не
+  выделяется: всё нужное выделяется заранее. Заменённые объекты (каталоги,
+  куски буфера, отдельные тэги, таблицы хэша) удаляются после окончания
+  текущих чтений, поэтому читатели работают под rcu_read_lock */
+  seqcount_mutex_t seq;
+  size_t tags_amount;
+  size_t mask_byte_len;
+
+  /*! Записи файлов, индекс - номер файла. Записи лежат сегментами по
+  kSegmentSize, поэтому рост таблицы не копирует записи (см. record_at) */
+  struct SegmentDir* segments;
+
+  size_t files_amount;
+
+  /*! Хэш имён меняет размер вместе с количеством файлов. Перестроение
+  выполняется постепенно: каждая операция изменения переносит kRehashStep
+  корзин из основной таблицы в новую, поиск идёт по обеим таблицам. Так
+  изменения не задерживаются на перестроении всего хэша целиком */
+  struct NameHash* names; //!< Основная таблица хэша имён
+  struct NameHash* rehash; //!< Новая таблица при перестроении. Вне перестроения NULL
+  size_t rehash_pos; //!< Корзина основной таблицы, с которой продолжается перенос
+  unsigned int min_hash_bits;
+
+  /*! Общий буфер для имён и целевых ссылок. Буфер состоит из кусков не
+  больше kArenaChunkMax, поэтому перестроение буфера затрагивает только один кусок */
+  struct ArenaDir* arena;
+  u32 arena_cur; //!< Кусок, в который дописываются строки. kNoChunk - кусков нет
+};
+
+/*! Снимок записи файла для чтения без блокировки (см. snapshot_record_rcu).
+Используется под тем же rcu_read_lock, под которым снят */
+struct RecordSnapshot {
+  struct FileRecord rec;
+  const struct ArenaChunk* chunk; //!< Кусок буфера со строками файла
+};
+
+
+/*! Выдать указатель на маску тэгов записи
+\return маска или NULL, если тэги записи хранятся разреженным набором */
+u8* record_mask(struct FileRecord* rec) {
+  if (rec->flags & kRecordSparse) { return NULL; }
+  if (rec->flags & kRecordExt) { return rec->ext->data; }
+  return rec->mask;
+}
+
+
+/*! Выдать разреженный набор тэгов записи
+\param amount возвращает количество тэгов в наборе
+\return номера тэгов или NULL, если тэги записи хранятся маской */
+const u16* record_tags(const struct FileRecord* rec, size_t* amount) {
+  if (!(rec->flags & kRecordSparse)) { return NULL; }
+  if (rec->flags & kRecordExt) {
+    const u16* ext = (const u16*)(rec->ext->data);
+
+    *amount = ext[0];
+    return ext + 1;
+  }
+  *amount = (rec->flags & kRecordTagsMask) >> kRecordTagsShift;
+  return rec->tags;
+}
+
+
+/*! Заполнить маску тэгами записи
+\param mask маска, инициализированная размером таблицы */
+void record_fill_mask(struct FileTableInternal* fti, struct FileRecord* rec,
+    struct TagMask* mask) {
+  const u16* tags;
+  size_t amount;
+
+  tags = record_tags(rec, &amount);
+  if (tags) {
+    tagmask_fill_from_tags(mask, tags, amount);
+  } else {
+    tagmask_fill_from_buffer(mask, record_mask(rec), fti->mask_byte_len);
+  }
+}
+
+
+/*! Выдать копию маски тэгов записи
+\return маска (нужно потом удалить) или пустая маска при нехватке памяти */
+struct TagMask record_copy_mask(struct FileTableInternal* fti,
+    struct FileRecord* rec) {
+  struct TagMask mask = tagmask_init_zero(fti->tags_amount);
+
+  if (!tagmask_is_empty(mask)) {
+    record_fill_mask(fti, rec, &mask);
+  }
+  return mask;
+}
+
+
+/*! Количество записей, под которые выделены сегменты. Вызывается под
+блокировкой таблицы */
+size_t table_capacity(struct FileTableInternal* fti) {
+  return fti->segments ? fti->segments->amount << kSegmentBits : 0;
+}
+
+
+/*! Выдать запись файла. Вызывается под rcu_read_lock (или под блокировкой таблицы)
+\return запись или NULL, если номер за пределами выделенных сегментов */
+struct FileRecord* record_at(struct FileTableInternal* fti, size_t ino) {
+  const struct SegmentDir* dir =
+      rcu_dereference_check(fti->segments, lockdep_is_held(&fti->lock));
+
+  if (!dir || (ino >> kSegmentBits) >= smp_load_acquire(&dir->amount)) { return NULL; }
+  return &dir->segments[ino >> kSegmentBits][ino & (kSegmentSize - 1)];
+}
+
+
+/*! Проверить, что файл есть в таблице. Вызывается под блокировкой таблицы */
+bool record_active(struct FileTableInternal* fti, size_t ino) {
+  const struct FileRecord* rec = record_at(fti, ino);
+
+  return rec && (rec->flags & kRecordActive);
+}
+
+
+/*! Увеличить таблицу так, чтобы в неё поместился номер ino. Добавляются
+сегменты записей, при нехватке места каталог сегментов пересоздаётся (копируются
+только указатели на сегменты). Блокировка не ставится
+\return отрицательный код ошибки. 0 - ошибок нет */
+int table_reserve_wo_lock(struct FileTableInternal* fti, size_t ino) {
+  size_t need = (ino >> kSegmentBits) + 1;
+  struct SegmentDir* dir = fti->segments;
+
+  if (dir && need <= dir->amount) { return 0; }
+
+  if (!dir || need > dir->capacity) {
+    size_t cap = max3(dir ? dir->capacity * 2 : (size_t)0, need, (size_t)kSegmentDirMin);
+    struct SegmentDir* new_dir = kvmalloc(sizeof(struct SegmentDir) +
+        cap * sizeof(struct FileRecord*), GFP_KERNEL);
+
+    if (!new_dir) { return -ENOMEM; }
+    new_dir->capacity = cap;
+    new_dir->amount = dir ? dir->amount : 0;
+    if (dir) {
+      memcpy(new_dir->segments, dir->segments, dir->amount * sizeof(struct FileRecord*));
+    }
+    rcu_assign_pointer(fti->segments, new_dir);
+    if (dir) {
+      kvfree_rcu(dir, rcu);
+    }
+    dir = new_dir;
+  }
+
+  while (dir->amount < need) {
+    struct FileRecord* seg = kvcalloc(kSegmentSize, sizeof(struct FileRecord), GFP_KERNEL);
+
+    if (!seg) { return -ENOMEM; }
+    dir->segments[dir->amount] = seg;
+    // Читатель, увидевший новое количество, видит и указатель на сегмент
+    smp_store_release(&dir->amount, dir->amount + 1);
+  }
+  return 0;
+}
+
+
+/*! Позиция строки в буфере: номер куска и смещение в нём */
+u32 arena_pos(u32 chunk, u32 offset) {
+  return (chunk << kArenaOffsetBits) | offset;
+}
+
+
+/*! Смещение строки в куске буфера по позиции */
+u32 arena_offset(u32 pos) {
+  return pos & (kArenaChunkMax - 1);
+}
+
+
+/*! Выдать кусок буфера, в котором лежат строки по позиции. Вызывается под
+rcu_read_lock (или под блокировкой таблицы). Внутри секции чтения позиция может
+быть несогласованной, поэтому номер куска и границы строк проверяются
+\param pos, len позиция и длина строк
+\return кусок или NULL, если строк с такой позицией быть не может */
+const struct ArenaChunk* arena_chunk(struct FileTableInternal* fti, u32 pos, size_t len) {
+  const struct ArenaDir* dir =
+      rcu_dereference_check(fti->arena, lockdep_is_held(&fti->lock));
+  const struct ArenaChunk* chunk;
+  size_t slot = pos >> kArenaOffsetBits;
+
+  if (!dir || slot >= dir->capacity) { return NULL; }
+  chunk = rcu_dereference_check(dir->chunks[slot], lockdep_is_held(&fti->lock));
+  if (!chunk || arena_offset(pos) + len > chunk->size) { return NULL; }
+  return chunk;
+}
+
+
+/*! Место, которое занимают строки длиной len в куске (с заголовком и выравниванием) */
+size_t arena_entry_size(size_t len) {
+  return round_up(sizeof(struct ArenaEntry) + len, sizeof(u32));
+}
+
+
+/*! Найти свободный номер куска. При нехватке номеров каталог кусков
+пересоздаётся. Блокировка не ставится
+\return номер куска или kNoChunk (нет памяти или все номера заняты) */
+u32 arena_free_slot_wo_lock(struct FileTableInternal* fti) {
+  struct ArenaDir* dir = fti->arena;
+  struct ArenaDir* new_dir;
+  size_t cap;
+  size_t i;
+
+  for (i = 0; dir && i < dir->capacity; ++i) {
+    if (!dir->chunks[i]) { return i; }
+  }
+  if (dir && dir->capacity >= kArenaChunksMax) { return kNoChunk; }
+
+  cap = min(dir ? dir->capacity * 2 : (size_t)kArenaDirMin, (size_t)kArenaChunksMax);
+  new_dir = kvzalloc(sizeof(struct ArenaDir) + cap * sizeof(struct ArenaChunk*),
+      GFP_KERNEL);
+  if (!new_dir) { return kNoChunk; }
+  new_dir->capacity = cap;
+  if (dir) {
+    memcpy(new_dir->chunks, dir->chunks, dir->capacity * sizeof(struct ArenaChunk*));
+  }
+  i = dir ? dir->capacity : 0;
+  rcu_assign_pointer(fti->arena, new_dir);
+  if (dir) {
+    kvfree_rcu(dir, rcu);
+  }
+  return i;
+}
+
+
+/*! Выдать запись файла, которая ссылается на строки в куске буфера
+\param slot, off номер куска и смещение заголовка строк
+\return запись или NULL, если файл удалён (место в куске свободно) */
+struct FileRecord* arena_entry_owner(struct FileTableInternal* fti, u32 slot, size_t off) {
+  const struct ArenaEntry* entry =
+      (const struct ArenaEntry*)(fti->arena->chunks[slot]->data + off);
+  struct FileRecord* rec;
+
+  if (!record_active(fti, entry->ino)) { return NULL; }
+  rec = record_at(fti, entry->ino);
+  return rec->name_pos == arena_pos(slot, off + sizeof(*entry)) ? rec : NULL;
+}
+
+
+/*! Уплотнить кусок буфера: строки активных файлов копируются в новый кусок
+подряд, затем в секции записи обновляются позиции в их записях и кусок
+заменяется. Работа ограничена размером куска. Ошибка уплотнения не критична:
+кусок просто останется прежним. Блокировка не ставится
+\param slot номер куска */
+void arena_compact_wo_lock(struct FileTableInternal* fti, u32 slot) {
+  struct ArenaChunk* chunk = fti->arena->chunks[slot];
+  struct ArenaChunk* new_chunk = NULL;
+  size_t live = 0;
+  size_t off, size, used;
+
+  for (off = 0; off < chunk->used; off += size) {
+    size = arena_entry_size(((const struct ArenaEntry*)(chunk->data + off))->len);
+    if (arena_entry_owner(fti, slot, off)) { live += size; }
+  }
+  if (live) {
+    new_chunk = kvmalloc(sizeof(struct ArenaChunk) + live, GFP_KERNEL);
+    if (!new_chunk) { return; }
+    new_chunk->size = live;
+    new_chunk->used = 0;
+    new_chunk->garbage = 0;
+    for (off = 0; off < chunk->used; off += size) {
+      size = arena_entry_size(((const struct ArenaEntry*)(chunk->data + off))->len);
+      if (!arena_entry_owner(fti, slot, off)) { continue; }
+      memcpy(new_chunk->data + new_chunk->used, chunk->data + off, size);
+      new_chunk->used += size;
+    }
+  }
+
+  write_seqcount_begin(&fti->seq);
+  for (off = 0, used = 0; off < chunk->used; off += size) {
+    struct FileRecord* rec = arena_entry_owner(fti, slot, off);
+
+    size = arena_entry_size(((const struct ArenaEntry*)(chunk->data + off))->len);
+    if (!rec) { continue; }
+    rec->name_pos = arena_pos(slot, used + sizeof(struct ArenaEntry));
+    rec->target_pos = rec->name_pos + rec->name_len;
+    used += size;
+  }
+  rcu_assign_pointer(fti->arena->chunks[slot], new_chunk);
+  write_seqcount_end(&fti->seq);
+
+  kvfree_rcu(chunk, rcu);
+}
+
+
+/*! Подготовить строковый буфер для добавления строк файла общей длиной len.
+Если в текущем куске места нет, то текущим становится новый кусок (вдвое
+больше прежнего, но не больше kArenaChunkMax). Блокировка не ставится
+\return отрицательный код ошибки. 0 - ошибок нет */
+int arena_reserve_wo_lock(struct FileTableInternal* fti, size_t len) {
+  struct ArenaChunk* cur = fti->arena_cur != kNoChunk ?
+      fti->arena->chunks[fti->arena_cur] : NULL;
+  size_t need = arena_entry_size(len);
+  struct ArenaChunk* chunk;
+  size_t size;
+  u32 slot, prev;
+
+  if (cur && cur->used + need <= cur->size) { return 0; }
+
+  size = clamp(cur ? (size_t)cur->size * 2 : (size_t)kArenaMinSize, need,
+      (size_t)kArenaChunkMax);
+  chunk = kvmalloc(sizeof(struct ArenaChunk) + size, GFP_KERNEL);
+  if (!chunk) { return -ENOMEM; }
+  slot = arena_free_slot_wo_lock(fti);
+  if (slot == kNoChunk) {
+    kvfree(chunk);
+    return -ENOMEM;
+  }
+  chunk->size = size;
+  chunk->used = 0;
+  chunk->garbage = 0;
+  rcu_assign_pointer(fti->arena->chunks[slot], chunk);
+  prev = fti->arena_cur;
+  fti->arena_cur = slot;
+  if (cur && cur->garbage * 2 > cur->used) {
+    // Прежний кусок больше не пополняется - уплотним его сразу
+    arena_compact_wo_lock(fti, prev);
+  }
+  return 0;
+}
+
+
+/*! Добавить строки файла в буфер. Место должно быть заранее подготовлено
+через arena_reserve_wo_lock. Строки пишутся за концом занятой части куска,
+поэтому читатели их не видят, пока позиция не записана в запись файла.
+Блокировка не ставится
+\return позиция имени файла (целевая ссылка идёт сразу за ним) */
+u32 arena_put_wo_lock(struct FileTableInternal* fti, u32 ino,
+    const struct qstr name, const struct qstr target) {
+  struct ArenaChunk* chunk = fti->arena->chunks[fti->arena_cur];
+  struct ArenaEntry entry = { .ino = ino, .len = name.len + target.len };
+  char* dst = chunk->data + chunk->used;
+  u32 pos = arena_pos(fti->arena_cur, chunk->used + sizeof(entry));
+
+  memcpy(dst, &entry, sizeof(entry));
+  memcpy(dst + sizeof(entry), name.name, name.len);
+  if (target.len) {
+    memcpy(dst + sizeof(entry) + name.len, target.name, target.len);
+  }
+  chunk->used += arena_entry_size(entry.len);
+  return pos;
+}
+
+
+/*! Освободить строки удалённого файла. Если большая часть куска (кроме
+текущего) занята строками удалённых файлов, то кусок уплотняется. Вызывается
+после очистки записи файла. Блокировка не ставится
+\param pos, len позиция и длина строк файла */
+void arena_release_wo_lock(struct FileTableInternal* fti, u32 pos, size_t len) {
+  u32 slot = pos >> kArenaOffsetBits;
+  struct ArenaChunk* chunk = fti->arena->chunks[slot];
+
+  chunk->garbage += arena_entry_size(len);
+  if (slot != fti->arena_cur && chunk->garbage * 2 > chunk->used) {
+    arena_compact_wo_lock(fti, slot);
+  }
+}
+
+
+/*! Создать пустую таблицу хэша имён размером 2^bits корзин
+\return таблица или NULL при нехватке памяти */
+struct NameHash* name_hash_alloc(unsigned int bits) {
+  size_t size = (size_t)1 << bits;
+  struct NameHash* nh;
+
+  nh = kvmalloc(struct_size(nh, buckets, size), GFP_KERNEL);
+  if (!nh) { return NULL; }
+  memset(nh->buckets, 0xff, size * sizeof(u32)); // kNoRecord
+  nh->bits = bits;
+  return nh;
+}
+
+
+u32* name_bucket(struct NameHash* nh, u32 hash) {
+  return &nh->buckets[hash_32(hash, nh->bits)];
+}
+
+
+/*! Найти файл по имени в одной таблице хэша. Вызывается под rcu_read_lock
+(или под блокировкой таблицы) внутри секции чтения seq: во время изменения
+цепочки могут быть несогласованными, поэтому обход прерывается, как только
+секция чтения стала недействительной
+\param seq начало секции чтения
+\return номер файла или kNoRecord */
+u32 chain_find_rcu(struct FileTableInternal* fti, struct NameHash* nh,
+    const struct qstr name, u32 hash, unsigned int seq) {
+  u32 ino;
+
+  for (ino = READ_ONCE(*name_bucket(nh, hash)); ino != kNoRecord;
+      ino = READ_ONCE(record_at(fti, ino)->hash_next)) {
+    const struct FileRecord* rec = record_at(fti, ino);
+    const struct ArenaChunk* chunk;
+    u32 pos;
+
+    if (!rec || read_seqcount_retry(&fti->seq, seq)) { return kNoRecord; }
+    if (READ_ONCE(rec->name_hash) != hash || READ_ONCE(rec->name_len) != name.len) {
+      continue;
+    }
+    pos = READ_ONCE(rec->name_pos);
+    chunk = arena_chunk(fti, pos, name.len);
+    if (chunk && memcmp(chunk->data + arena_offset(pos), name.name, name.len) == 0) {
+      return ino;
+    }
+  }
+  return kNoRecord;
+}
+
+
+/*! Найти номер файла по имени. Вызывается под rcu_read_lock (или под
+блокировкой таблицы)
+\return номер файла или kNoRecord */
+u32 find_by_name_rcu(struct FileTableInternal* fti, const struct qstr name) {
+  u32 hash = full_name_hash(NULL, name.name, name.len);
+  unsigned int seq;
+  struct NameHash* nh;
+  u32 ino;
+
+  do {
+    seq = read_seqcount_begin(&fti->seq);
+    nh = rcu_dereference_check(fti->names, lockdep_is_held(&fti->lock));
+    ino = chain_find_rcu(fti, nh, name, hash, seq);
+    nh = rcu_dereference_check(fti->rehash, lockdep_is_held(&fti->lock));
+    if (ino == kNoRecord && nh) {
+      ino = chain_find_rcu(fti, nh, name, hash, seq);
+    }
+  } while (read_seqcount_retry(&fti->seq, seq));
+  return ino;
+}
+
+
+/*! Снять согласованную копию записи файла. Вызывается под rcu_read_lock:
+отдельно выделенные тэги и кусок со строками снимка действительны, пока
+блокировка не снята
+\param snap снимок записи. Заполняется, только если файл есть в таблице
+\return true - файл есть в таблице */
+bool snapshot_record_rcu(struct FileTableInternal* fti, size_t ino,
+    struct RecordSnapshot* snap) {
+  const struct FileRecord* rec;
+  unsigned int seq;
+  bool active;
+
+  do {
+    seq = read_seqcount_begin(&fti->seq);
+    rec = ino < kNoRecord ? record_at(fti, ino) : NULL;
+    active = rec && (READ_ONCE(rec->flags) & kRecordActive);
+    if (active) {
+      memcpy(&snap->rec, rec, sizeof(snap->rec));
+      snap->chunk = arena_chunk(fti, snap->rec.name_pos,
+          snap->rec.name_len + snap->rec.target_len);
+    }
+  } while (read_seqcount_retry(&fti->seq, seq));
+  return active && snap->chunk;
+}
+
+
+/*! Добавить запись в цепочку хэша имён. Во время перестроения записи
+добавляются в новую таблицу. Вызывается в секции записи */
+void link_name_wo_lock(struct FileTableInternal* fti, u32 ino) {
+  struct NameHash* nh = fti->rehash ? fti->rehash : fti->names;
+  struct FileRecord* rec = record_at(fti, ino);
+  u32* bucket = name_bucket(nh, rec->name_hash);
+
+  rec->hash_next = *bucket;
+  WRITE_ONCE(*bucket, ino);
+}
+
+
+/*! Убрать запись из цепочки одной таблицы хэша. Вызывается в секции записи
+\return признак, что запись была найдена и убрана */
+bool chain_unlink_wo_lock(struct FileTableInternal* fti, struct NameHash* nh,
+    u32 ino) {
+  struct FileRecord* rec = record_at(fti, ino);
+  u32* link = name_bucket(nh, rec->name_hash);
+
+  while (*link != kNoRecord) {
+    if (*link == ino) {
+      WRITE_ONCE(*link, rec->hash_next);
+      rec->hash_next = kNoRecord;
+      return true;
+    }
+    link = &record_at(fti, *link)->hash_next;
+  }
+  return false;
+}
+
+
+/*! Убрать запись из хэша имён. Вызывается в секции записи */
+void unlink_name_wo_lock(struct FileTableInternal* fti, u32 ino) {
+  if (chain_unlink_wo_lock(fti, fti->names, ino)) { return; }
+  if (fti->rehash) {
+    chain_unlink_wo_lock(fti, fti->rehash, ino);
+  }
+}
+
+
+/*! Перенести очередные kRehashStep корзин в новую таблицу хэша. После переноса
+последней корзины новая таблица становится основной. Вызывается в секции записи */
+void rehash_step_wo_lock(struct FileTableInternal* fti) {
+  struct NameHash* old = fti->names;
+  size_t old_size = (size_t)1 << old->bits;
+  size_t step;
+
+  if (!fti->rehash) { return; }
+
+  for (step = 0; step < kRehashStep && fti->rehash_pos < old_size; ++step) {
+    u32* bucket = &old->buckets[fti->rehash_pos++];
+
+    while (*bucket != kNoRecord) {
+      struct FileRecord* rec = record_at(fti, *bucket);
+      u32* dst = name_bucket(fti->rehash, rec->name_hash);
+      u32 ino = *bucket;
+
+      WRITE_ONCE(*bucket, rec->hash_next);
+      rec->hash_next = *dst;
+      WRITE_ONCE(*dst, ino);
+    }
+  }
+
+  if (fti->rehash_pos >= old_size) {
+    rcu_assign_pointer(fti->names, fti->rehash);
+    rcu_assign_pointer(fti->rehash, NULL);
+    fti->rehash_pos = 0;
+    kvfree_rcu(old, rcu);
+  }
+}
+
+
+/*! Вычислить размер хэша имён, подходящий под текущее количество файлов.
+Блокировка должна быть уже поставлена
+\return количество битов нового хэша или 0, если размер менять не нужно */
+unsigned int name_hash_wanted_bits_wo_lock(struct FileTableInternal* fti) {
+  size_t size = (size_t)1 << fti->names->bits;
+
+  if (fti->rehash) { return 0; }
+  if (fti->files_amount > size * kNameHashMaxLoad && fti->names->bits < 31) {
+    return fti->names->bits + 1;
+  }
+  if (fti->names->bits > fti->min_hash_bits &&
+      fti->files_amount < size / kNameHashMinLoadDiv) {
+    return fti->names->bits - 1;
+  }
+  return 0;
+}
+
+
+/*! Начать перестроение хэша имён под размер 2^bits. Память под новую таблицу
+выделяется без блокировки, чтобы не задерживать другие изменения. Ошибки не
+критичны: хэш просто останется прежнего размера
+\param bits требуемый размер (см. name_hash_wanted_bits_wo_lock). 0 - ничего не делается */
+void name_hash_start_resize(struct FileTableInternal* fti, unsigned int bits) {
+  struct NameHash* nh;
+
+  if (!bits) { return; }
+  nh = name_hash_alloc(bits);
+  if (!nh) { return; }
+
+  mutex_lock(&fti->lock);
+  if (name_hash_wanted_bits_wo_lock(fti) == bits) {
+    rcu_assign_pointer(fti->rehash, nh);
+    fti->rehash_pos = 0;
+    nh = NULL;
+  }
+  mutex_unlock(&fti->lock);
+
+  kvfree(nh);
+}
+
+
+/*! Подготовить тэги записи по маске. Если маска меньше размера таблицы, то
+остаток обнуляется, тэги за пределами таблицы отбрасываются. Способ хранения
+тэгов выбирается по их количеству: при небольшом количестве тэгов хранится
+разреженный набор номеров. Память под отдельные тэги выделяется здесь, чтобы
+в секции записи только заменить тэги (см. tags_apply_wo_lock)
+\param tags заполняемые тэги: флаги способа хранения и объединение с данными
+\return отрицательный код ошибки. 0 - ошибок нет */
+int tags_prepare(struct FileTableInternal* fti, const struct TagMask mask,
+    struct FileRecord* tags) {
+  const void* src = tagmask_const_data(&mask);
+  size_t len = src ? min(mask.byte_len, fti->mask_byte_len) : 0;
+  size_t bits = min(mask.bit_len, fti->tags_amount);
+  size_t amount = 0;
+  size_t tag;
+  struct RecordExt* ext;
+  u8* dst;
+  u16* set;
+
+  memset(tags, 0, sizeof(*tags));
+  if (fti->mask_byte_len <= kInlineMaskSize) {
+    if (len) { memcpy(tags->mask, src, len); }
+    return 0;
+  }
+
+  for (tag = tagmask_next_tag(mask, 0); tag < bits; tag = tagmask_next_tag(mask, tag + 1)) {
+    ++amount;
+  }
+
+  if (amount <= kInlineTagsMax) {
+    set = tags->tags;
+    tags->flags = kRecordSparse | (amount << kRecordTagsShift);
+  } else if ((amount + 1) * sizeof(u16) < fti->mask_byte_len) {
+    ext = kmalloc(struct_size(ext, data, (amount + 1) * sizeof(u16)), GFP_KERNEL);
+    if (!ext) { return -ENOMEM; }
+    tags->ext = ext;
+    tags->flags = kRecordSparse | kRecordExt;
+    set = (u16*)(ext->data);
+    *set++ = amount;
+  } else {
+    ext = kmalloc(struct_size(ext, data, fti->mask_byte_len), GFP_KERNEL);
+    if (!ext) { return -ENOMEM; }
+    tags->ext = ext;
+    tags->flags = kRecordExt;
+    dst = ext->data;
+    if (len) { memcpy(dst, src, len); }
+    memset(dst + len, 0, fti->mask_byte_len - len);
+    if (mask.bit_len > fti->tags_amount) {
+      // Тэги за пределами таблицы в маске не сохраняются
+      for (tag = fti->tags_amount; tag < len * 8; ++tag) {
+        dst[tag / 8] &= ~(1 << (tag % 8));
+      }
+    }
+    return 0;
+  }
+
+  amount = 0;
+  for (tag = tagmask_next_tag(mask, 0); tag < bits; tag = tagmask_next_tag(mask, tag + 1)) {
+    set[amount++] = tag;
+  }
+  return 0;
+}
+
+
+/*! Заменить тэги записи подготовленными (см. tags_prepare). Прежние отдельные
+тэги удаляются после окончания текущих чтений. Вызывается в секции записи */
+void tags_apply_wo_lock(struct FileRecord* rec, const struct FileRecord* tags) {
+  const u16 tag_flags = kRecordSparse | kRecordExt | kRecordTagsMask;
+
+  if (rec->flags & kRecordExt) {
+    kfree_rcu(rec->ext, rcu);
+  }
+  rec->flags = (rec->flags & ~tag_flags) | tags->flags;
+  memcpy(rec->mask, tags->mask, sizeof(rec->mask));
+}
+
+
+// Описание в хедере
+int tagfs_init_file_table(FileTable* table, size_t tags_amount,
+    unsigned int name_hash_bits) {
+  struct FileTableInternal* fti;
+
+  if (table == NULL || (*table) != NULL) { return -EINVAL; }
+
+  fti = kzalloc(sizeof(struct FileTableInternal), GFP_KERNEL);
+  if (!fti) { return -ENOMEM; }
+
+  fti->names = name_hash_alloc(name_hash_bits);
+  if (!fti->names) {
+    kfree(fti);
+    return -ENOMEM;
+  }
+
+  mutex_init(&fti->lock);
+  seqcount_mutex_init(&fti->seq, &fti->lock);
+  fti->arena_cur = kNoChunk;
+  fti->tags_amount = tags_amount;
+  fti->mask_byte_len = tagmask_get_byte_len(tags_amount);
+  fti->min_hash_bits = name_hash_bits;
+  *table = fti;
+  return 0;
+}
+
+
+// Описание в хедере
+void tagfs_release_file_table(FileTable* table) {
+  struct FileTableInternal* fti;
+  size_t ino;
+  size_t i;
+
+  if (table == NULL || (*table) == NULL) { return; }
+
+  fti = (struct FileTableInternal*)(*table);
+  for (ino = 0; ino < table_capacity(fti); ++ino) {
+    struct FileRecord* rec = record_at(fti, ino);
+
+    if (rec->flags & kRecordExt) {
+      kfree(rec->ext);
+    }
+  }
+  for (i = 0; fti->segments && i < fti->segments->amount; ++i) {
+    kvfree(fti->segments->segments[i]);
+  }
+  kvfree(fti->segments);
+  for (i = 0; fti->arena && i < fti->arena->capacity; ++i) {
+    kvfree(fti->arena->chunks[i]);
+  }
+  kvfree(fti->arena);
+  kvfree(fti->names);
+  kvfree(fti->rehash);
+  kfree(fti);
+  *table = NULL;
+}
+
+
+// Описание в хедере
+int tagfs_file_table_reserve(FileTable table, size_t amount) {
+  struct FileTableInternal* fti = (struct FileTableInternal*)(table);
+  int res;
+
+  if (unlikely(!fti)) { return -EINVAL; }
+  if (amount == 0) { return 0; }
+  if (amount > kNoRecord) { return -ERANGE; }
+
+  mutex_lock(&fti->lock);
+  res = table_reserve_wo_lock(fti, amount - 1);
+  mutex_unlock(&fti->lock);
+  return res;
+}
+
+
+// Описание в хедере
+int tagfs_file_table_insert(FileTable table, size_t ino, const struct qstr name,
+    const struct qstr target, const struct TagMask mask) {
+  struct FileTableInternal* fti = (struct FileTableInternal*)(table);
+  struct FileRecord* rec;
+  struct FileRecord tags;
+  unsigned int resize_bits = 0;
+  u32 pos;
+  int res;
+
+  if (unlikely(!fti)) { return -EINVAL; }
+  if (!name.name || !name.len || name.len > U16_MAX) { return -EINVAL; }
+  if (ino >= kNoRecord ||
+      arena_entry_size(name.len + target.len) > kArenaChunkMax) {
+    return -ERANGE;
+  }
+
+  mutex_lock(&fti->lock);
+  if (record_active(fti, ino) || find_by_name_rcu(fti, name) != kNoRecord) {
+    res = -EEXIST;
+    goto ex;
+  }
+
+  res = table_reserve_wo_lock(fti, ino);
+  if (res) { goto ex; }
+  res = arena_reserve_wo_lock(fti, name.len + target.len);
+  if (res) { goto ex; }
+  res = tags_prepare(fti, mask, &tags);
+  if (res) { goto ex; }
+
+  rec = record_at(fti, ino);
+  pos = arena_put_wo_lock(fti, ino, name, target);
+
+  write_seqcount_begin(&fti->seq);
+  tags_apply_wo_lock(rec, &tags);
+  rec->name_pos = pos;
+  rec->name_len = name.len;
+  rec->target_pos = pos + name.len;
+  rec->target_len = target.len;
+  rec->name_hash = full_name_hash(NULL, name.name, name.len);
+  link_name_wo_lock(fti, ino);
+  rec->flags |= kRecordActive;
+  rehash_step_wo_lock(fti);
+  write_seqcount_end(&fti->seq);
+
+  ++fti->files_amount;
+  resize_bits = name_hash_wanted_bits_wo_lock(fti);
+
+ex:
+  mutex_unlock(&fti->lock);
+  name_hash_start_resize(fti, resize_bits);
+  return res;
+}
+
+
+// Описание в хедере
+int tagfs_file_table_delete(FileTable table, size_t ino, struct TagMask* old_mask) {
+  struct FileTableInternal* fti = (struct FileTableInternal*)(table);
+  struct FileRecord* rec;
+  unsigned int resize_bits;
+  u32 name_pos;
+  size_t len;
+
+  if (unlikely(!fti)) { return -EINVAL; }
+
+  mutex_lock(&fti->lock);
+  if (!record_active(fti, ino)) {
+    mutex_unlock(&fti->lock);
+    return -ENOENT;
+  }
+
+  rec = record_at(fti, ino);
+  if (old_mask) {
+    *old_mask = record_copy_mask(fti, rec);
+  }
+  name_pos = rec->name_pos;
+  len = rec->name_len + rec->target_len;
+
+  write_seqcount_begin(&fti->seq);
+  unlink_name_wo_lock(fti, ino);
+  if (rec->flags & kRecordExt) {
+    kfree_rcu(rec->ext, rcu);
+  }
+  memset(rec, 0, sizeof(struct FileRecord));
+  rehash_step_wo_lock(fti);
+  write_seqcount_end(&fti->seq);
+
+  --fti->files_amount;
+  arena_release_wo_lock(fti, name_pos, len);
+  resize_bits = name_hash_wanted_bits_wo_lock(fti);
+  mutex_unlock(&fti->lock);
+
+  name_hash_start_resize(fti, resize_bits);
+  return 0;
+}
+
+
+/*! Записать маску в запись файла. Блокировка не ставится
+\return отрицательный код ошибки. При ошибке запись не меняется. 0 - ошибок нет */
+int store_mask_wo_lock(struct FileTableInternal* fti, struct FileRecord* rec,
+    const struct TagMask mask) {
+  struct FileRecord tags;
+  int res;
+
+  res = tags_prepare(fti, mask, &tags);
+  if (res) { return res; }
+
+  write_seqcount_begin(&fti->seq);
+  tags_apply_wo_lock(rec, &tags);
+  write_seqcount_end(&fti->seq);
+  return 0;
+}
+
+
+// Описание в хедере
+int tagfs_file_table_set_mask(FileTable table, size_t ino,
+    const struct TagMask mask, struct TagMask* old_mask) {
+  struct FileTableInternal* fti = (struct FileTableInternal*)(table);
+  int res = -ENOENT;
+
+  if (unlikely(!fti)) { return -EINVAL; }
+
+  mutex_lock(&fti->lock);
+  if (record_active(fti, ino)) {
+    struct TagMask prev = tagmask_empty();
+
+    if (old_mask) {
+      prev = record_copy_mask(fti, record_at(fti, ino));
+    }
+    res = store_mask_wo_lock(fti, record_at(fti, ino), mask);
+    if (res) {
+      tagmask_release(&prev);
+    } else if (old_mask) {
+      *old_mask = prev;
+    }
+  }
+  mutex_unlock(&fti->lock);
+  return res;
+}
+
+
+// Описание в хедере
+int tagfs_file_table_clear_tag(FileTable table, size_t ino, size_t tag,
+    struct TagMask* new_mask) {
+  struct FileTableInternal* fti = (struct FileTableInternal*)(table);
+  struct TagMask mask;
+  int res = -ENOENT;
+
+  if (unlikely(!fti)) { return -EINVAL; }
+
+  mutex_lock(&fti->lock);
+  if (!record_active(fti, ino)) { goto ex; }
+  mask = record_copy_mask(fti, record_at(fti, ino));
+  if (tagmask_is_empty(mask)) {
+    res = -ENOMEM;
+    goto ex;
+  }
+  if (!tagmask_check_tag(mask, tag)) {
+    tagmask_release(&mask);
+    res = -ENODATA;
+    goto ex;
+  }
+  tagmask_set_tag(&mask, tag, false);
+  res = store_mask_wo_lock(fti, record_at(fti, ino), mask);
+  if (res) {
+    tagmask_release(&mask);
+  } else {
+    *new_mask = mask;
+  }
+ex:
+  mutex_unlock(&fti->lock);
+  return res;
+}
+
+
+// Описание в хедере
+bool tagfs_file_table_is_active(FileTable table, size_t ino) {
+  struct FileTableInternal* fti = (struct FileTableInternal*)(table);
+  struct RecordSnapshot snap;
+  bool res;
+
+  if (unlikely(!fti)) { return false; }
+
+  rcu_read_lock();
+  res = snapshot_record_rcu(fti, ino, &snap);
+  rcu_read_unlock();
+  return res;
+}
+
+
+// Описание в хедере
+int tagfs_file_table_visit(FileTable table, size_t ino, FileTableVisitor visitor,
+    void* ctx) {
+  struct FileTableInternal* fti = (struct FileTableInternal*)(table);
+  struct RecordSnapshot snap;
+  struct qstr name, target;
+  struct TagMask sparse = tagmask_empty();
+  struct TagMask mask;
+  int res = 0;
+
+  if (unlikely(!fti)) { return -EINVAL; }
+
+retry:
+  rcu_read_lock();
+  if (!snapshot_record_rcu(fti, ino, &snap)) {
+    res = -ENOENT;
+    goto ex;
+  }
+
+  if (visitor) {
+    name.name = (const unsigned char*)(snap.chunk->data + arena_offset(snap.rec.name_pos));
+    name.len = snap.rec.name_len;
+    target.name = (const unsigned char*)(snap.chunk->data + arena_offset(snap.rec.target_pos));
+    target.len = snap.rec.target_len;
+    if (snap.rec.flags & kRecordSparse) {
+      // Для разреженного набора маска собирается на время вызова. Память
+      // выделяется вне rcu_read_lock, после чего запись читается заново
+      if (tagmask_is_empty(sparse)) {
+        rcu_read_unlock();
+        sparse = tagmask_init_zero(fti->tags_amount);
+        if (tagmask_is_empty(sparse)) { return -ENOMEM; }
+        goto retry;
+      }
+      record_fill_mask(fti, &snap.rec, &sparse);
+      mask = tagmask_borrow(tagmask_data(&sparse), sparse.byte_len);
+    } else {
+      mask = tagmask_borrow(record_mask(&snap.rec), fti->mask_byte_len);
+    }
+    res = visitor(ctx, ino, name, mask, target);
+  }
+ex:
+  rcu_read_unlock();
+  tagmask_release(&sparse);
+  return res;
+}
+
+
+// Описание в хедере
+bool tagfs_file_table_check_filter(FileTable table, size_t ino,
+    const struct TagMask on_mask, const struct TagMask off_mask) {
+  struct FileTableInternal* fti = (struct FileTableInternal*)(table);
+  struct RecordSnapshot snap;
+  const u16* tags;
+  size_t amount;
+  bool res = false;
+
+  if (unlikely(!fti)) { return false; }
+
+  rcu_read_lock();
+  if (snapshot_record_rcu(fti, ino, &snap)) {
+    tags = record_tags(&snap.rec, &amount);
+    if (tags) {
+      res = tagmask_check_filter_tags(tags, amount, on_mask, off_mask);
+    } else {
+      res = tagmask_check_filter(tagmask_borrow(record_mask(&snap.rec),
+          fti->mask_byte_len), on_mask, off_mask);
+    }
+  }
+  rcu_read_unlock();
+  return res;
+}
+
+
+/*! Выделить буфер под строку, если прежний буфер мал
+\param buf буфер (может быть NULL), len его размер
+\param need требуемый размер
+\return отрицательный код ошибки. 0 - ошибок нет */
+int grow_string_buffer(char** buf, size_t* len, size_t need) {
+  if (need <= *len) { return 0; }
+  kfree(*buf);
+  *len = 0;
+  *buf = kmalloc(need, GFP_KERNEL);
+  if (!(*buf)) { return -ENOMEM; }
+  *len = need;
+  return 0;
+}
+
+
+/*! Выдать строку из буфера как qstr. Буфер переходит в строку
+\return строка или пустая строка для нулевой длины (буфер тогда удаляется) */
+struct qstr take_string_buffer(char** buf, size_t len) {
+  struct qstr res = get_null_qstr();
+
+  if (len) {
+    res.name = *buf;
+    res.len = len;
+  } else {
+    kfree(*buf);
+  }
+  *buf = NULL;
+  return res;
+}
+
+
+// Описание в хедере
+int tagfs_file_table_get(FileTable table, size_t ino, const struct qstr name,
+    size_t* found_ino, struct qstr* found_name, struct TagMask* mask,
+    struct qstr* target) {
+  struct FileTableInternal* fti = (struct FileTableInternal*)(table);
+  struct RecordSnapshot snap;
+  char* name_buf = NULL;
+  char* target_buf = NULL;
+  size_t name_cap = 0;
+  size_t target_cap = 0;
+  size_t cur_ino;
+  int res = 0;
+
+  if (unlikely(!fti)) { return -EINVAL; }
+
+  if (mask) {
+    *mask = tagmask_init_zero(fti->tags_amount);
+  }
+  // Строки копируются под rcu_read_lock, а память под них выделяется вне
+  // его. Если строки файла успели вырасти, то память выделяется заново
+  for (;;) {
+    rcu_read_lock();
+    cur_ino = ino;
+    if (cur_ino == kNotFoundIno) {
+      cur_ino = name.name && name.len ? find_by_name_rcu(fti, name) : kNoRecord;
+    }
+    if (!snapshot_record_rcu(fti, cur_ino, &snap)) {
+      rcu_read_unlock();
+      res = -ENOENT;
+      break;
+    }
+    if ((found_name && snap.rec.name_len > name_cap) ||
+        (target && snap.rec.target_len > target_cap)) {
+      rcu_read_unlock();
+      res = found_name ? grow_string_buffer(&name_buf, &name_cap, snap.rec.name_len) : 0;
+      if (!res && target) {
+        res = grow_string_buffer(&target_buf, &target_cap, snap.rec.target_len);
+      }
+      if (res) { break; }
+      continue;
+    }
+
+    if (found_name) {
+      memcpy(name_buf, snap.chunk->data + arena_offset(snap.rec.name_pos),
+          snap.rec.name_len);
+    }
+    if (target && snap.rec.target_len) {
+      memcpy(target_buf, snap.chunk->data + arena_offset(snap.rec.target_pos),
+          snap.rec.target_len);
+    }
+    if (mask && !tagmask_is_empty(*mask)) {
+      record_fill_mask(fti, &snap.rec, mask);
+    }
+    rcu_read_unlock();
+    break;
+  }
+
+  if (res) {
+    if (mask) {
+      tagmask_release(mask);
+    }
+    kfree(name_buf);
+    kfree(target_buf);
+    return res;
+  }
+
+  if (found_ino) {
+    *found_ino = cur_ino;
+  }
+  if (found_name) {
+    *found_name = take_string_buffer(&name_buf, snap.rec.name_len);
+  }
+  if (target) {
+    *target = take_string_buffer(&target_buf, snap.rec.target_len);
+  }
+  return 0;
+}
@@ -0,0 +1,137 @@
+// This file is part of tagvfs
+// Copyright (C) 2023 Evgeny Kislov
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef TAG_FILE_TABLE_H
+#define TAG_FILE_TABLE_H
+
+#include <linux/dcache.h>
+#include <linux/kernel.h>
+
+#include "tag_tag_mask.h"
+
+/*! Таблица файлов в памяти. Записи о файлах хранятся в плотном массиве,
+индексом в котором является номер файла (ino). Массив разбит на сегменты
+фиксированного размера: при росте таблицы записи не переносятся. Маска тэгов
+хранится прямо в записи (если тэгов не больше 128). При большем количестве
+тэгов у каждого файла хранится либо разреженный набор номеров его тэгов, либо
+маска - что меньше. Имена и целевые ссылки хранятся в общем строковом буфере
+из кусков, которые уплотняются по отдельности. Поиск по имени выполняется через
+хэш-таблицу номеров, размер которой следует за количеством файлов.
+Изменения таблицы выполняются под блокировкой, а чтение - без неё (под
+rcu_read_lock со счётчиком изменений записей), поэтому читатели не ждут писателей. */
+typedef void* FileTable;
+
+/*! Колбэк для доступа к данным файла без копирования. Данные действительны
+только во время вызова. Колбэк вызывается под rcu_read_lock, поэтому он не
+должен засыпать (выделять память с GFP_KERNEL, ждать блокировок) и обращаться
+к изменению таблицы
+\param ctx контекст, переданный вызывающим
+\param ino номер файла
+\param name, mask, target имя, маска тэгов и целевая ссылка файла
+\return код, который возвращается вызывающему. Не должен быть -ENOENT */
+typedef int (*FileTableVisitor)(void* ctx, size_t ino, const struct qstr name,
+    const struct TagMask mask, const struct qstr target);
+
+
+/*! Создать и инициализировать пустую таблицу файлов
+\param table указатель на переменную для таблицы. Изначально в переменной должен быть NULL
+\param tags_amount количество тэгов (размер маски тэгов) в хранилище
+\param name_hash_bits начальное (и минимальное) количество битов в ключе хэша
+имён. Дальше хэш меняет размер вместе с количеством файлов
+\return отрицательный код ошибки. Если ошибок нет - возвращается 0 */
+int tagfs_init_file_table(FileTable* table, size_t tags_amount,
+    unsigned int name_hash_bits);
+
+/*! Удалить таблицу, освободить все ресурсы
+\param table указатель на переменную с удаляемой таблицей */
+void tagfs_release_file_table(FileTable* table);
+
+/*! Заранее выделить память под записи файлов с номерами от 0 до amount - 1
+(например, при открытии хранилища, когда количество файловых блоков известно)
+\param amount количество записей
+\return отрицательный код ошибки. 0 - ошибок нет */
+int tagfs_file_table_reserve(FileTable table, size_t amount);
+
+/*! Добавить файл в таблицу. Файла с таким же номером или именем быть не должно
+\param ino номер файла
+\param name имя файла (символьной ссылки). Не может быть пустым
+\param target целевая ссылка файла. Может быть пустой
+\param mask маска тэгов файла. Может быть пустой (файл без тэгов)
+\return отрицательный код ошибки (-EEXIST - дубликат номера или имени,
+-EINVAL - пустое имя, -ERANGE - номер вне допустимого диапазона или строки
+файла длиннее куска строкового буфера). 0 - ошибок нет */
+int tagfs_file_table_insert(FileTable table, size_t ino, const struct qstr name,
+    const struct qstr target, const struct TagMask mask);
+
+/*! Удалить файл из таблицы
+\param ino номер удаляемого файла
+\param old_mask указатель на заполняемое поле маски, которая была у файла.
+Может быть NULL. Маску нужно потом удалить (при нехватке памяти она пустая)
+\return отрицательный код ошибки (-ENOENT - файла нет). 0 - ошибок нет */
+int tagfs_file_table_delete(FileTable table, size_t ino, struct TagMask* old_mask);
+
+/*! Заменить маску тэгов у файла
+\param ino номер файла
+\param mask новая маска тэгов
+\param old_mask указатель на заполняемое поле прежней маски файла. Может быть
+NULL. Маску нужно потом удалить (при нехватке памяти она пустая)
+\return отрицательный код ошибки (-ENOENT - файла нет). 0 - ошибок нет */
+int tagfs_file_table_set_mask(FileTable table, size_t ino,
+    const struct TagMask mask, struct TagMask* old_mask);
+
+/*! Снять тэг у файла. Бит снимается прямо в таблице (одновременные
+изменения других тэгов файла не теряются)
+\param ino номер файла
+\param tag номер снимаемого тэга
+\param new_mask указатель на заполняемое поле новой маски файла. Маску нужно потом удалить
+\return отрицательный код ошибки (-ENOENT - файла нет, -ENODATA - у файла нет
+такого тэга, маска не заполняется). 0 - ошибок нет */
+int tagfs_file_table_clear_tag(FileTable table, size_t ino, size_t tag,
+    struct TagMask* new_mask);
+
+/*! Проверить, что файл с номером ino есть в таблице */
+bool tagfs_file_table_is_active(FileTable table, size_t ino);
+
+/*! Проверить маску тэгов файла фильтром (см. tagmask_check_filter). Проверка
+выполняется прямо по маске в таблице, без копирования
+\param ino номер файла
+\return true - файл есть в таблице и подходит под фильтр */
+bool tagfs_file_table_check_filter(FileTable table, size_t ino,
+    const struct TagMask on_mask, const struct TagMask off_mask);
+
+/*! Вызвать колбэк с данными файла прямо из таблицы, без копирования
+\param ino номер файла
+\param visitor колбэк. Может быть NULL - тогда только проверяется наличие файла
+\param ctx контекст для колбэка
+\return -ENOENT - файла нет. Иначе - результат колбэка (или 0, если колбэка нет) */
+int tagfs_file_table_visit(FileTable table, size_t ino, FileTableVisitor visitor,
+    void* ctx);
+
+/*! Вычитать информацию о файле по номеру или по имени (если номер kNotFoundIno).
+Выдаются копии данных, которые затем нужно удалить
+\param ino номер файла (может быть равен kNotFoundIno - тогда поиск по имени)
+\param name название файла (может быть пустым, если ino содержит валидное значение)
+\param found_ino возвращает номер найденного файла. Может быть NULL.
+\param found_name указатель на заполняемое поле имени. Может быть NULL.
+\param mask указатель на заполняемое поле маски. Может быть NULL.
+\param target указатель на заполняемое поле целевой ссылки. Может быть NULL.
+\return отрицательный код ошибки (-ENOENT - файла нет, -ENOMEM - нет памяти
+под копии строк). Нет ошибок - 0 */
+int tagfs_file_table_get(FileTable table, size_t ino, const struct qstr name,
+    size_t* found_ino, struct qstr* found_name, struct TagMask* mask,
+    struct qstr* target);
+
+#endif // TAG_FILE_TABLE_H
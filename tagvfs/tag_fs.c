@@ -219,9 +219,15 @@ struct inode_operations tagfs_root_inode_ops = {
 };
 
 
+static int tagfs_sync_fs(struct super_block* sb, int wait) {
+  return tagfs_sync_storage(super_block_storage(sb));
+}
+
+
 static const struct super_operations tagfs_ops = {
   .alloc_inode = tagfs_inode_alloc,
-  .free_inode = tagfs_inode_free
+  .free_inode = tagfs_inode_free,
+  .sync_fs = tagfs_sync_fs
 };
 
 
@@ -254,12 +260,45 @@ static int fs_fill_superblock(struct super_block* sb, void* data, int silent) {
 }
 
 
+/*! Разобрать опции монтирования. Поддерживаемые опции:
+lazy - загружать файлы в фоне, не задерживая монтирование
+upgrade - обновить хранилище старого формата до текущего и создать журнал
+Неизвестные опции пропускаются с предупреждением (как до появления опций)
+\param options строка опций через запятую. Может быть NULL. Строка меняется
+\param opts возвращает параметры открытия хранилища
+\return отрицательный код ошибки. 0 - ошибок нет */
+int parse_mount_options(char* options, struct StorageOptions* opts) {
+  char* opt;
+
+  opts->lazy_load = false;
+  opts->upgrade = false;
+  opts->read_only = false;
+  while ((opt = strsep(&options, ",")) != NULL) {
+    if (!*opt) { continue; }
+    if (strcmp(opt, "lazy") == 0) {
+      opts->lazy_load = true;
+      continue;
+    }
+    if (strcmp(opt, "upgrade") == 0) {
+      opts->upgrade = true;
+      continue;
+    }
+    pr_warn(kModuleLogName "Unknown mount option '%s' is ignored\n", opt);
+  }
+  return 0;
+}
+
+
 struct dentry* fs_mount(struct file_system_type* fstype, int flags,
     const char* dev_name, void* data) {
   Storage stor = NULL;
+  struct StorageOptions opts;
   int res;
 
-  res = tagfs_init_storage(&stor, dev_name);
+  res = parse_mount_options(data, &opts);
+  if (res) { return ERR_PTR(res); }
+  opts.read_only = (flags & SB_RDONLY) != 0;
+  res = tagfs_init_storage(&stor, dev_name, &opts);
   if (res) { return ERR_PTR(res); }
   return mount_nodev(fstype, flags, stor, fs_fill_superblock);
 }
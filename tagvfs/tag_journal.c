@@ -0,0 +1,829 @@
+// This file is part of tagvfs
+// Copyright (C) 2023 Evgeny Kislov
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "tag_journal.h"
+
+#include <linux/crc32.h>
+#include <linux/list.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/rwsem.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#include "tag_storage.h"
+
+const u32 kExtJournal = 1;
+const u64 kJournalBlockMark = (u64)(-5);
+const size_t kJournalSize = 1 << 20; //!< Размер данных журнала (без первого блока области)
+const size_t kJournalFreedMax = 4096; //!< Количество освобождённых блоков, при котором журнал сбрасывается
+const u32 kJournalMagic = 0x4a564754; //!< Метка заголовка журнала
+const u32 kJournalRecordMagic = 0x52564754; //!< Метка транзакции журнала
+const unsigned long kJournalSyncDelay = HZ; //!< Задержка сброса журнала после фиксации транзакции
+const size_t kJournalPendingMax = 1 << 18; //!< Размер неприменённых транзакций, при котором журнал сбрасывается без задержки
+
+
+/*! Заголовок журнала. Лежит в начале данных первого блока области журнала,
+сразу за ним - таблица расширений хедера */
+struct JournalHeader {
+  __le32 magic;
+  __le32 reserved; //!< Заполняется нулями
+  __le64 gen; //!< Поколение журнала. Транзакции других поколений недействительны
+};
+
+/*! Заголовок транзакции журнала. Транзакция начинается с начала блока
+журнала, за заголовком идут записи (JournalExtentHeader и данные) */
+struct JournalRecord {
+  __le32 magic;
+  __le32 crc; //!< crc32 транзакции после этого поля (начальное значение 0xffffffff)
+  __le64 gen;
+  __le32 extents_amount;
+  __le32 size; //!< Размер транзакции вместе с заголовком
+};
+
+/*! Описатель записи транзакции. За ним идут записываемые данные */
+struct JournalExtentHeader {
+  __le64 pos; //!< Позиция (абсолютная) записи в хранилище
+  __le32 len;
+  __le32 reserved; //!< Заполняется нулями
+};
+
+/*! Транзакция, добавленная в журнал, но ещё не применённая на месте */
+struct JournalPending {
+  struct list_head node;
+  void* data; //!< Записи транзакции (как в JournalTx)
+  size_t size;
+  size_t extents_amount;
+  loff_t begin; //!< Позиция начала первой записи в хранилище
+  loff_t end; //!< Позиция конца последней записи в хранилище
+};
+
+struct JournalInternal {
+  struct file* storage_file;
+  u64 fileblock_table_pos;
+  u16 fileblock_size;
+  BlockMap free_blocks;
+  struct mutex* alloc_lock;
+
+  struct mutex lock; //!< Добавление транзакций и смена поколения
+  struct mutex sync_lock; //!< Сброс журнала на диск и применение транзакций
+  u64 block; //!< Первый блок области журнала
+  u64 blocks; //!< Количество блоков области. 0 - области нет
+  u64 gen; //!< Текущее поколение журнала
+  size_t used; //!< Количество занятых блоков данных журнала
+  /*! Транзакции, добавленные в журнал и ещё не применённые на месте (по
+  порядку фиксации). Они применяются после сброса журнала на диск (см.
+  journal_flush), а до этого накладываются на читаемые данные хранилища.
+  Блокировка pending_lock ставится после lock и sync_lock */
+  struct list_head pending;
+  struct rw_semaphore pending_lock;
+  size_t pending_size; //!< Размер данных неприменённых транзакций
+  struct delayed_work sync_work; //!< Отложенный сброс журнала
+  size_t* freed; //!< Блоки, освобождённые в текущем поколении журнала
+  size_t freed_amount;
+  size_t freed_capacity;
+};
+
+
+/*! Позиция (абсолютная) блока в хранилище */
+loff_t journal_block_pos(struct JournalInternal* ji, u64 block) {
+  return ji->fileblock_table_pos + block * ji->fileblock_size;
+}
+
+
+/*! Количество блоков данных журнала (первый блок области - заголовок) */
+size_t journal_capacity(struct JournalInternal* ji) {
+  return ji->blocks ? ji->blocks - 1 : 0;
+}
+
+
+/*! Вернуть блоки в карту свободных блоков */
+void journal_release_blocks(struct JournalInternal* ji, const size_t* blocks,
+    size_t amount) {
+  size_t i;
+
+  mutex_lock(ji->alloc_lock);
+  for (i = 0; i < amount; ++i) {
+    tagfs_block_map_set_free(ji->free_blocks, blocks[i]);
+  }
+  mutex_unlock(ji->alloc_lock);
+}
+
+
+/*! Увеличить буфер до нужного размера (с запасом). Содержимое сохраняется
+\return отрицательный код ошибки. 0 - ошибок нет */
+int journal_grow_buffer(void** buf, size_t* capacity, size_t used, size_t need) {
+  size_t new_cap;
+  void* nb;
+
+  if (need <= *capacity) { return 0; }
+  new_cap = max(need, *capacity * 2);
+  nb = kvmalloc(new_cap, GFP_KERNEL);
+  if (!nb) { return -ENOMEM; }
+  if (used) { memcpy(nb, *buf, used); }
+  kvfree(*buf);
+  *buf = nb;
+  *capacity = new_cap;
+  return 0;
+}
+
+
+/*! Записать первый блок области журнала: заголовок журнала текущего поколения
+и таблицу расширений хедера (с записью о журнале)
+\return отрицательный код ошибки. 0 - ошибок нет */
+int journal_write_head_wo_lock(struct JournalInternal* ji) {
+  const size_t bs = ji->fileblock_size;
+  struct FileBlockHeader* bh;
+  struct JournalHeader* jh;
+  struct FSExtTableHeader* th;
+  struct FSExtEntry* e;
+  void* block;
+  loff_t pos;
+  int res = 0;
+
+  block = kzalloc(bs, GFP_KERNEL);
+  if (!block) { return -ENOMEM; }
+  bh = block;
+  bh->prev_block_index = cpu_to_le64(kJournalBlockMark);
+  bh->next_block_index = cpu_to_le64(kJournalBlockMark);
+  jh = (void*)(bh + 1);
+  jh->magic = cpu_to_le32(kJournalMagic);
+  jh->gen = cpu_to_le64(ji->gen);
+  th = (void*)(jh + 1);
+  th->entries_amount = cpu_to_le32(1);
+  th->entry_size = cpu_to_le32(sizeof(struct FSExtEntry));
+  e = (void*)(th + 1);
+  e->type = cpu_to_le32(kExtJournal);
+  e->pos = cpu_to_le64(journal_block_pos(ji, ji->block));
+  e->size = cpu_to_le64(ji->blocks * bs);
+
+  pos = journal_block_pos(ji, ji->block);
+  if (kernel_write(ji->storage_file, block, bs, &pos) != bs) { res = -EFAULT; }
+  kfree(block);
+  return res;
+}
+
+
+/*! Применить записи транзакции на месте
+\param data, size записи транзакции (JournalExtentHeader и данные)
+\param extents_amount количество записей
+\param table_end конец таблицы файловых блоков. 0 - не проверять, что записи
+не выходят за таблицу
+\return отрицательный код ошибки. 0 - ошибок нет */
+int journal_apply_extents(struct JournalInternal* ji, const void* data, size_t size,
+    size_t extents_amount, u64 table_end) {
+  size_t off = 0;
+  size_t i;
+
+  for (i = 0; i < extents_amount; ++i) {
+    const struct JournalExtentHeader* eh = data + off;
+    loff_t pos;
+    size_t len;
+
+    if (off + sizeof(*eh) > size) { return -EINVAL; }
+    pos = le64_to_cpu(eh->pos);
+    len = le32_to_cpu(eh->len);
+    off += sizeof(*eh);
+    if (off + len > size) { return -EINVAL; }
+    if (table_end && (pos < ji->fileblock_table_pos || pos + len > table_end)) {
+      return -EINVAL;
+    }
+    if (kernel_write(ji->storage_file, data + off, len, &pos) != len) {
+      return -EFAULT;
+    }
+    off += len;
+  }
+  return 0;
+}
+
+
+/*! Сбросить журнал на диск и применить на месте все транзакции, добавленные
+к этому моменту. Один сброс покрывает все такие транзакции (групповая
+фиксация). Транзакция накладывается на читаемые данные, пока не применится
+\return отрицательный код ошибки. 0 - ошибок нет */
+int journal_flush(struct JournalInternal* ji) {
+  struct JournalPending* p;
+  struct JournalPending* last;
+  size_t amount = 0;
+  int res = 0;
+
+  mutex_lock(&ji->sync_lock);
+  down_read(&ji->pending_lock);
+  last = list_empty(&ji->pending) ? NULL :
+      list_last_entry(&ji->pending, struct JournalPending, node);
+  up_read(&ji->pending_lock);
+  if (!last) { goto ex; }
+
+  // Транзакции записываются в журнал до постановки в список
+  res = vfs_fsync_range(ji->storage_file, journal_block_pos(ji, ji->block),
+      journal_block_pos(ji, ji->block + ji->blocks) - 1, 1);
+  if (res) { goto ex; }
+
+  down_read(&ji->pending_lock);
+  list_for_each_entry(p, &ji->pending, node) {
+    res = journal_apply_extents(ji, p->data, p->size, p->extents_amount, 0);
+    if (res) { break; }
+    ++amount;
+    if (p == last) { break; }
+  }
+  up_read(&ji->pending_lock);
+
+  // Применённые транзакции больше не накладываются на читаемые данные
+  down_write(&ji->pending_lock);
+  while (amount--) {
+    p = list_first_entry(&ji->pending, struct JournalPending, node);
+    list_del(&p->node);
+    ji->pending_size -= p->size;
+    kvfree(p->data);
+    kfree(p);
+  }
+  up_write(&ji->pending_lock);
+
+ex:
+  mutex_unlock(&ji->sync_lock);
+  return res;
+}
+
+
+/*! Отложенный сброс журнала */
+void journal_sync_work(struct work_struct* work) {
+  struct JournalInternal* ji = container_of(to_delayed_work(work),
+      struct JournalInternal, sync_work);
+  int res = journal_flush(ji);
+
+  if (res) { pr_warn("tagvfs: ERROR %d in syncing journal\n", res); }
+}
+
+
+/*! Начать новое поколение журнала (см. tagfs_journal_checkpoint). Вызывается
+под блокировкой журнала
+\return отрицательный код ошибки. 0 - ошибок нет */
+int journal_checkpoint_wo_lock(struct JournalInternal* ji) {
+  int res;
+
+  // Транзакции, которые уже в журнале, должны примениться
+  res = journal_flush(ji);
+  if (res) { return res; }
+  res = vfs_fsync(ji->storage_file, 0);
+  if (res) { return res; }
+  ++ji->gen;
+  res = journal_write_head_wo_lock(ji);
+  if (!res) {
+    res = vfs_fsync_range(ji->storage_file, journal_block_pos(ji, ji->block),
+        journal_block_pos(ji, ji->block + 1) - 1, 1);
+  }
+  if (res) { return res; }
+  ji->used = 0;
+
+  journal_release_blocks(ji, ji->freed, ji->freed_amount);
+  ji->freed_amount = 0;
+  return 0;
+}
+
+
+/*! Добавить транзакцию в журнал (без сброса на диск). Вызывается под
+блокировкой журнала
+\param blocks количество блоков журнала под транзакцию
+\return отрицательный код ошибки. 0 - ошибок нет */
+int journal_write_record_wo_lock(struct JournalInternal* ji, const struct JournalTx* tx,
+    size_t blocks) {
+  const size_t bs = ji->fileblock_size;
+  const size_t payload = bs - sizeof(struct FileBlockHeader);
+  struct JournalRecord rec;
+  void* region;
+  size_t i;
+  loff_t pos;
+  int res = 0;
+
+  rec.magic = cpu_to_le32(kJournalRecordMagic);
+  rec.gen = cpu_to_le64(ji->gen);
+  rec.extents_amount = cpu_to_le32(tx->extents_amount);
+  rec.size = cpu_to_le32(sizeof(rec) + tx->size);
+  rec.crc = cpu_to_le32(crc32_le(crc32_le(~0, (const void*)(&rec) +
+      offsetof(struct JournalRecord, gen), sizeof(rec) -
+      offsetof(struct JournalRecord, gen)), tx->data, tx->size));
+
+  region = kvzalloc(blocks * bs, GFP_KERNEL);
+  if (!region) { return -ENOMEM; }
+  for (i = 0; i < blocks; ++i) {
+    struct FileBlockHeader* bh = region + i * bs;
+    size_t from = i * payload;
+    size_t j;
+
+    bh->prev_block_index = cpu_to_le64(kJournalBlockMark);
+    bh->next_block_index = cpu_to_le64(kJournalBlockMark);
+    for (j = 0; j < payload && from + j < sizeof(rec); ++j) {
+      ((u8*)(bh + 1))[j] = ((u8*)(&rec))[from + j];
+    }
+    if (from + j < sizeof(rec) + tx->size) {
+      memcpy((void*)(bh + 1) + j, tx->data + from + j - sizeof(rec),
+          min(payload - j, sizeof(rec) + tx->size - from - j));
+    }
+  }
+
+  pos = journal_block_pos(ji, ji->block + 1 + ji->used);
+  if (kernel_write(ji->storage_file, region, blocks * bs, &pos) != blocks * bs) {
+    res = -EFAULT;
+  }
+  kvfree(region);
+  return res;
+}
+
+
+/*! Забыть в карте блоков связи блоков, заголовки которых записывает
+транзакция (начиная с записи по смещению from). Используется, когда записи
+транзакции отбрасываются: связи затем читаются из заголовков блоков
+\param from смещение записи в данных транзакции (граница записи) */
+void journal_drop_tx_links(struct JournalInternal* ji, const struct JournalTx* tx,
+    size_t from) {
+  const size_t bs = ji->fileblock_size;
+  size_t off = from;
+
+  mutex_lock(ji->alloc_lock);
+  while (off + sizeof(struct JournalExtentHeader) <= tx->size) {
+    const struct JournalExtentHeader* eh = tx->data + off;
+    u64 pos = le64_to_cpu(eh->pos);
+    u64 end = pos + le32_to_cpu(eh->len);
+
+    off += sizeof(*eh) + le32_to_cpu(eh->len);
+    if (end <= ji->fileblock_table_pos) { continue; }
+    pos = max_t(u64, pos, ji->fileblock_table_pos);
+    // Заголовки блоков, которые начинаются внутри записи
+    for (pos = ji->fileblock_table_pos +
+        roundup(pos - ji->fileblock_table_pos, bs); pos < end; pos += bs) {
+      tagfs_block_map_set_link(ji->free_blocks,
+          div_u64(pos - ji->fileblock_table_pos, bs), kNotFoundIno, kNotFoundIno);
+    }
+  }
+  mutex_unlock(ji->alloc_lock);
+}
+
+
+// Описание в хедере
+int tagfs_init_journal(Journal* journal, struct file* storage_file,
+    u64 fileblock_table_pos, u16 fileblock_size, BlockMap free_blocks,
+    struct mutex* alloc_lock) {
+  struct JournalInternal* ji;
+
+  if (journal == NULL || (*journal) != NULL) { return -EINVAL; }
+
+  ji = kzalloc(sizeof(struct JournalInternal), GFP_KERNEL);
+  if (!ji) { return -ENOMEM; }
+
+  ji->storage_file = storage_file;
+  ji->fileblock_table_pos = fileblock_table_pos;
+  ji->fileblock_size = fileblock_size;
+  ji->free_blocks = free_blocks;
+  ji->alloc_lock = alloc_lock;
+  mutex_init(&ji->lock);
+  mutex_init(&ji->sync_lock);
+  INIT_LIST_HEAD(&ji->pending);
+  init_rwsem(&ji->pending_lock);
+  INIT_DELAYED_WORK(&ji->sync_work, journal_sync_work);
+
+  *journal = ji;
+  return 0;
+}
+
+
+// Описание в хедере
+void tagfs_release_journal(Journal* journal) {
+  struct JournalInternal* ji;
+
+  if (journal == NULL || (*journal) == NULL) { return; }
+  ji = (struct JournalInternal*)(*journal);
+  cancel_delayed_work_sync(&ji->sync_work);
+  // Неприменённые транзакции повторятся при следующем открытии хранилища, а
+  // блоки без сброса журнала остаются занятыми до него же
+  while (!list_empty(&ji->pending)) {
+    struct JournalPending* p = list_first_entry(&ji->pending, struct JournalPending, node);
+
+    list_del(&p->node);
+    kvfree(p->data);
+    kfree(p);
+  }
+  kvfree(ji->freed);
+  kfree(ji);
+  *journal = NULL;
+}
+
+
+// Описание в хедере
+int tagfs_journal_open(Journal journal, u64 region_pos, u64 region_size,
+    u64 fileblock_amount) {
+  struct JournalInternal* ji = (struct JournalInternal*)(journal);
+  struct JournalHeader jh;
+  loff_t pos;
+  u64 block;
+  u32 rem;
+
+  // Область журнала - последовательность файловых блоков
+  if (region_pos < ji->fileblock_table_pos) { return -EINVAL; }
+  block = div_u64_rem(region_pos - ji->fileblock_table_pos, ji->fileblock_size, &rem);
+  if (rem || region_size % ji->fileblock_size ||
+      region_size < 2 * (u64)ji->fileblock_size ||
+      block + div_u64(region_size, ji->fileblock_size) > fileblock_amount) {
+    return -EINVAL;
+  }
+  pos = region_pos + sizeof(struct FileBlockHeader);
+  if (kernel_read(ji->storage_file, &jh, sizeof(jh), &pos) != sizeof(jh)) {
+    return -EFAULT;
+  }
+  if (le32_to_cpu(jh.magic) != kJournalMagic) { return -EINVAL; }
+  ji->block = block;
+  ji->blocks = div_u64(region_size, ji->fileblock_size);
+  ji->gen = le64_to_cpu(jh.gen);
+  return 0;
+}
+
+
+// Описание в хедере
+size_t tagfs_journal_region_blocks(u16 fileblock_size) {
+  const size_t payload = fileblock_size - sizeof(struct FileBlockHeader);
+
+  if (fileblock_size <= sizeof(struct FileBlockHeader) ||
+      payload < sizeof(struct JournalHeader) + sizeof(struct FSExtTableHeader) +
+      sizeof(struct FSExtEntry)) {
+    return 0;
+  }
+  return 1 + DIV_ROUND_UP(kJournalSize, payload);
+}
+
+
+// Описание в хедере
+int tagfs_journal_create(Journal journal, u64 block, u64 blocks, u64* ext_table_pos) {
+  struct JournalInternal* ji = (struct JournalInternal*)(journal);
+  const size_t bs = ji->fileblock_size;
+  size_t i;
+  void* region;
+  loff_t pos;
+  int res = 0;
+
+  region = kvzalloc(blocks * bs, GFP_KERNEL);
+  if (!region) { return -ENOMEM; }
+  for (i = 0; i < blocks; ++i) {
+    struct FileBlockHeader* bh = region + i * bs;
+
+    bh->prev_block_index = cpu_to_le64(kJournalBlockMark);
+    bh->next_block_index = cpu_to_le64(kJournalBlockMark);
+  }
+  pos = journal_block_pos(ji, block);
+  if (kernel_write(ji->storage_file, region, blocks * bs, &pos) != blocks * bs) {
+    res = -EFAULT;
+    goto ex;
+  }
+
+  ji->block = block;
+  ji->blocks = blocks;
+  ji->gen = 1;
+  res = journal_write_head_wo_lock(ji);
+  if (!res) { res = vfs_fsync(ji->storage_file, 0); }
+  if (res) {
+    ji->blocks = 0;
+    goto ex;
+  }
+  *ext_table_pos = journal_block_pos(ji, block) + sizeof(struct FileBlockHeader) +
+      sizeof(struct JournalHeader);
+
+ex:
+  kvfree(region);
+  return res;
+}
+
+
+// Описание в хедере
+bool tagfs_journal_enabled(Journal journal) {
+  return ((struct JournalInternal*)(journal))->blocks != 0;
+}
+
+
+// Описание в хедере
+bool tagfs_journal_owns_block(Journal journal, u64 block) {
+  struct JournalInternal* ji = (struct JournalInternal*)(journal);
+
+  return block >= ji->block && block < ji->block + ji->blocks;
+}
+
+
+// Описание в хедере
+int tagfs_journal_replay(Journal journal, u64 fileblock_amount, bool read_only) {
+  struct JournalInternal* ji = (struct JournalInternal*)(journal);
+  const size_t bs = ji->fileblock_size;
+  const size_t payload = bs - sizeof(struct FileBlockHeader);
+  const size_t capacity = journal_capacity(ji);
+  void* stream;
+  size_t stream_size = capacity * payload;
+  size_t off = 0;
+  size_t applied = 0;
+  size_t i;
+  loff_t pos;
+  int res = 0;
+
+  if (!ji->blocks) { return 0; }
+
+  stream = kvmalloc(capacity * bs, GFP_KERNEL);
+  if (!stream) { return -ENOMEM; }
+  pos = journal_block_pos(ji, ji->block + 1);
+  if (kernel_read(ji->storage_file, stream, capacity * bs, &pos) != capacity * bs) {
+    res = -EFAULT;
+    goto ex;
+  }
+  // Данные блоков журнала объединяются в поток
+  for (i = 0; i < capacity; ++i) {
+    memmove(stream + i * payload, stream + i * bs + sizeof(struct FileBlockHeader),
+        payload);
+  }
+
+  while (off + sizeof(struct JournalRecord) <= stream_size) {
+    const struct JournalRecord* rec = stream + off;
+    size_t size = le32_to_cpu(rec->size);
+
+    if (le32_to_cpu(rec->magic) != kJournalRecordMagic ||
+        le64_to_cpu(rec->gen) != ji->gen ||
+        size < sizeof(*rec) || size > stream_size - off) {
+      break;
+    }
+    if (crc32_le(~0, (const void*)(rec) + offsetof(struct JournalRecord, gen),
+        size - offsetof(struct JournalRecord, gen)) != le32_to_cpu(rec->crc)) {
+      break;
+    }
+    if (read_only) {
+      pr_err("tagvfs: storage journal needs replay, mount it read-write\n");
+      res = -EROFS;
+      goto ex;
+    }
+    res = journal_apply_extents(ji, (const void*)(rec + 1), size - sizeof(*rec),
+        le32_to_cpu(rec->extents_amount), journal_block_pos(ji, fileblock_amount));
+    if (res) {
+      pr_err("tagvfs: ERROR %d in replaying journal\n", res);
+      goto ex;
+    }
+    ++applied;
+    off += roundup(size, payload);
+  }
+  if (applied) {
+    pr_info("tagvfs: %u journal transactions are replayed\n", (unsigned int)applied);
+  }
+
+  if (!read_only) {
+    mutex_lock(&ji->lock);
+    res = journal_checkpoint_wo_lock(ji);
+    mutex_unlock(&ji->lock);
+  }
+
+ex:
+  kvfree(stream);
+  return res;
+}
+
+
+// Описание в хедере
+int tagfs_journal_checkpoint(Journal journal) {
+  struct JournalInternal* ji = (struct JournalInternal*)(journal);
+  int res;
+
+  if (!ji->blocks) { return 0; }
+  mutex_lock(&ji->lock);
+  res = journal_checkpoint_wo_lock(ji);
+  mutex_unlock(&ji->lock);
+  return res;
+}
+
+
+/*! Добавить блоки к освобождённым в текущем поколении журнала. Вызывается
+под блокировкой журнала */
+void journal_defer_free_wo_lock(struct JournalInternal* ji, const size_t* blocks,
+    size_t amount) {
+  size_t capacity = ji->freed_capacity * sizeof(size_t);
+
+  if (!amount) { return; }
+  if (!journal_grow_buffer((void**)(&ji->freed), &capacity,
+      ji->freed_amount * sizeof(size_t), (ji->freed_amount + amount) * sizeof(size_t))) {
+    ji->freed_capacity = capacity / sizeof(size_t);
+    memcpy(ji->freed + ji->freed_amount, blocks, amount * sizeof(size_t));
+    ji->freed_amount += amount;
+  }
+  // Без памяти блоки остаются занятыми до следующего открытия хранилища
+}
+
+
+// Описание в хедере
+void tagfs_journal_defer_free(Journal journal, const size_t* blocks, size_t amount) {
+  struct JournalInternal* ji = (struct JournalInternal*)(journal);
+
+  if (!ji->blocks) {
+    journal_release_blocks(ji, blocks, amount);
+    return;
+  }
+  mutex_lock(&ji->lock);
+  journal_defer_free_wo_lock(ji, blocks, amount);
+  mutex_unlock(&ji->lock);
+}
+
+
+// Описание в хедере
+void tagfs_journal_read_begin(Journal journal) {
+  down_read(&((struct JournalInternal*)(journal))->pending_lock);
+}
+
+
+// Описание в хедере
+void tagfs_journal_read_end(Journal journal, loff_t pos, void* buf, size_t len) {
+  struct JournalInternal* ji = (struct JournalInternal*)(journal);
+  struct JournalPending* p;
+
+  // Более поздние транзакции накладываются поверх более ранних
+  list_for_each_entry(p, &ji->pending, node) {
+    size_t off = 0;
+    size_t i;
+
+    if (p->end <= pos || p->begin >= pos + (loff_t)(len)) { continue; }
+    for (i = 0; i < p->extents_amount; ++i) {
+      const struct JournalExtentHeader* eh = p->data + off;
+      loff_t epos = le64_to_cpu(eh->pos);
+      size_t elen = le32_to_cpu(eh->len);
+      loff_t from = max_t(loff_t, epos, pos);
+      loff_t to = min_t(loff_t, epos + elen, pos + len);
+
+      if (from < to) {
+        memcpy(buf + (from - pos), (const void*)(eh + 1) + (from - epos), to - from);
+      }
+      off += sizeof(*eh) + elen;
+    }
+  }
+  up_read(&ji->pending_lock);
+}
+
+
+// Описание в хедере
+void tagfs_journal_tx_init(struct JournalTx* tx) {
+  memset(tx, 0, sizeof(*tx));
+}
+
+
+// Описание в хедере
+int tagfs_journal_tx_write(struct JournalTx* tx, loff_t pos, const void* data, size_t len) {
+  struct JournalExtentHeader* eh;
+  int res;
+
+  res = journal_grow_buffer(&tx->data, &tx->capacity, tx->size,
+      tx->size + sizeof(*eh) + len);
+  if (res) { return res; }
+  eh = tx->data + tx->size;
+  eh->pos = cpu_to_le64(pos);
+  eh->len = cpu_to_le32(len);
+  eh->reserved = 0;
+  memcpy(tx->data + tx->size + sizeof(*eh), data, len);
+  tx->size += sizeof(*eh) + len;
+  ++tx->extents_amount;
+  return 0;
+}
+
+
+// Описание в хедере
+int tagfs_journal_tx_free(struct JournalTx* tx, size_t block) {
+  size_t capacity = tx->freed_capacity * sizeof(size_t);
+  int res;
+
+  res = journal_grow_buffer((void**)(&tx->freed), &capacity,
+      tx->freed_amount * sizeof(size_t), (tx->freed_amount + 1) * sizeof(size_t));
+  if (res) { return res; }
+  tx->freed_capacity = capacity / sizeof(size_t);
+  tx->freed[tx->freed_amount++] = block;
+  return 0;
+}
+
+
+// Описание в хедере
+struct JournalTxPoint tagfs_journal_tx_save(const struct JournalTx* tx) {
+  struct JournalTxPoint p = { tx->size, tx->extents_amount, tx->freed_amount };
+  return p;
+}
+
+
+// Описание в хедере
+void tagfs_journal_tx_restore(Journal journal, struct JournalTx* tx,
+    const struct JournalTxPoint p) {
+  journal_drop_tx_links((struct JournalInternal*)(journal), tx, p.size);
+  tx->size = p.size;
+  tx->extents_amount = p.extents_amount;
+  tx->freed_amount = p.freed_amount;
+}
+
+
+// Описание в хедере
+void tagfs_journal_tx_release(Journal journal, struct JournalTx* tx) {
+  if (tx->extents_amount) {
+    journal_drop_tx_links((struct JournalInternal*)(journal), tx, 0);
+  }
+  kvfree(tx->data);
+  kvfree(tx->freed);
+  tagfs_journal_tx_init(tx);
+}
+
+
+// Описание в хедере
+int tagfs_journal_tx_commit(Journal journal, struct JournalTx* tx) {
+  struct JournalInternal* ji = (struct JournalInternal*)(journal);
+  const size_t payload = ji->fileblock_size - sizeof(struct FileBlockHeader);
+  size_t blocks = DIV_ROUND_UP(sizeof(struct JournalRecord) + tx->size, payload);
+  struct JournalPending* p;
+  size_t off = 0;
+  size_t i;
+  bool flush = false;
+  int res = 0;
+
+  if (!tx->extents_amount) { goto ex_freed; }
+
+  if (!ji->blocks) {
+    res = journal_apply_extents(ji, tx->data, tx->size, tx->extents_amount, 0);
+    if (res) { goto ex; }
+    goto ex_freed;
+  }
+
+  // Транзакция применяется целиком или не применяется совсем
+  if (blocks > journal_capacity(ji)) {
+    res = -EFBIG;
+    goto ex;
+  }
+  p = kmalloc(sizeof(struct JournalPending), GFP_KERNEL);
+  if (!p) {
+    res = -ENOMEM;
+    goto ex;
+  }
+  p->data = tx->data;
+  p->size = tx->size;
+  p->extents_amount = tx->extents_amount;
+  p->begin = LLONG_MAX;
+  p->end = 0;
+  for (i = 0; i < tx->extents_amount; ++i) {
+    const struct JournalExtentHeader* eh = tx->data + off;
+
+    p->begin = min_t(loff_t, p->begin, le64_to_cpu(eh->pos));
+    p->end = max_t(loff_t, p->end, le64_to_cpu(eh->pos) + le32_to_cpu(eh->len));
+    off += sizeof(*eh) + le32_to_cpu(eh->len);
+  }
+
+  mutex_lock(&ji->lock);
+  if (ji->used + blocks > journal_capacity(ji) || ji->freed_amount >= kJournalFreedMax) {
+    res = journal_checkpoint_wo_lock(ji);
+  }
+  if (!res) { res = journal_write_record_wo_lock(ji, tx, blocks); }
+  if (!res) {
+    ji->used += blocks;
+    // Транзакция в журнале может быть повторена при открытии хранилища,
+    // поэтому освобождённые ею блоки возвращаются в карту только при смене
+    // поколения журнала
+    journal_defer_free_wo_lock(ji, tx->freed, tx->freed_amount);
+    down_write(&ji->pending_lock);
+    list_add_tail(&p->node, &ji->pending);
+    ji->pending_size += p->size;
+    flush = ji->pending_size >= kJournalPendingMax;
+    up_write(&ji->pending_lock);
+  }
+  mutex_unlock(&ji->lock);
+  if (res) {
+    kfree(p);
+    goto ex;
+  }
+
+  // Данные транзакции теперь в списке неприменённых. Связи блоков в карте
+  // совпадают с тем, что видят читатели
+  tx->data = NULL;
+  tx->capacity = 0;
+  tx->size = 0;
+  tx->extents_amount = 0;
+  tx->freed_amount = 0;
+  if (flush) {
+    // Транзакция уже зафиксирована: ошибка сброса не отменяет её
+    int fres = journal_flush(ji);
+
+    if (fres) { pr_warn("tagvfs: ERROR %d in syncing journal\n", fres); }
+  } else {
+    schedule_delayed_work(&ji->sync_work, kJournalSyncDelay);
+  }
+  goto ex;
+
+ex_freed:
+  journal_release_blocks(ji, tx->freed, tx->freed_amount);
+  // Записи применены: связи блоков в карте совпадают с хранилищем
+  tx->size = 0;
+  tx->extents_amount = 0;
+
+ex:
+  tagfs_journal_tx_release(journal, tx);
+  return res;
+}
@@ -0,0 +1,196 @@
+// This file is part of tagvfs
+// Copyright (C) 2023 Evgeny Kislov
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef TAG_JOURNAL_H
+#define TAG_JOURNAL_H
+
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/mutex.h>
+
+#include "tag_block_map.h"
+
+/*! Журнал записи файловых блоков. Транзакция сначала добавляется в журнал, а
+применяется на месте только после сброса журнала на диск. Журнал сбрасывается
+по таймеру, при синхронизации хранилища или когда неприменённых транзакций
+накопилось много, и один сброс покрывает все транзакции (групповая фиксация).
+До применения записи транзакций накладываются на читаемые данные (см.
+tagfs_journal_read_begin). При открытии хранилища транзакции журнала повторяются. Блоки,
+освобождённые транзакциями, возвращаются в карту только после сброса журнала
+(иначе повтор старой транзакции испортил бы новые данные блока).
+Область журнала - непрерывная последовательность файловых блоков. Пока
+область не подключена (см. tagfs_journal_open, tagfs_journal_create), записи
+транзакций применяются сразу. Блокировка журнала ставится после блокировок
+файловых записей и раньше блокировки распределения блоков (alloc_lock) */
+typedef void* Journal;
+
+extern const u32 kExtJournal; //!< Тип расширения хедера: журнал записи файловых блоков
+extern const u64 kJournalBlockMark; //!< Значение полей заголовка блока журнала
+
+/*! Заголовок файлового блока. Блоки области журнала размечены kJournalBlockMark */
+struct FileBlockHeader {
+  __le64 prev_block_index;
+  __le64 next_block_index;
+  /* file data after header */
+};
+
+/*! Заголовок таблицы расширений хедера. За ним идут записи расширений.
+Таблица лежит в первом блоке области журнала, сразу за заголовком журнала */
+struct FSExtTableHeader {
+  __le32 entries_amount;
+  __le32 entry_size; //!< Размер записи. Не меньше sizeof(struct FSExtEntry), новые поля добавляются в конец записи
+};
+
+/*! Запись таблицы расширений: область хранилища с дополнительными данными.
+Назначение области определяется типом, а обязательность - флагами возможностей */
+struct FSExtEntry {
+  __le32 type;
+  __le32 reserved; //!< Заполняется нулями
+  __le64 pos; //!< Позиция (абсолютная) области
+  __le64 size; //!< Размер области
+};
+
+/*! Транзакция записи в файловые блоки. Записи накапливаются в памяти в
+формате журнала и применяются вместе (см. tagfs_journal_tx_commit) */
+struct JournalTx {
+  void* data; //!< Записи подряд: заголовок записи и данные
+  size_t size;
+  size_t capacity;
+  size_t extents_amount;
+  size_t* freed; //!< Блоки, освобождённые транзакцией. Возвращаются в карту после применения
+  size_t freed_amount;
+  size_t freed_capacity;
+};
+
+/*! Точка отката транзакции (см. tagfs_journal_tx_save) */
+struct JournalTxPoint {
+  size_t size;
+  size_t extents_amount;
+  size_t freed_amount;
+};
+
+
+/*! Создать журнал без области
+\param journal указатель на переменную для журнала. Изначально в переменной должен быть NULL
+\param storage_file файл хранилища
+\param fileblock_table_pos, fileblock_size позиция таблицы файловых блоков и размер блока
+\param free_blocks карта свободных блоков хранилища (освобождённые блоки
+возвращаются в неё, связи блоков отменённых транзакций забываются). NULL -
+журнал нужен только для создания области (см. tagfs_journal_create)
+\param alloc_lock блокировка карты свободных блоков
+\return отрицательный код ошибки. Если ошибок нет - возвращается 0 */
+int tagfs_init_journal(Journal* journal, struct file* storage_file,
+    u64 fileblock_table_pos, u16 fileblock_size, BlockMap free_blocks,
+    struct mutex* alloc_lock);
+
+/*! Удалить журнал, освободить все ресурсы. Блоки, ожидающие сброса журнала,
+остаются занятыми
+\param journal указатель на переменную с удаляемым журналом */
+void tagfs_release_journal(Journal* journal);
+
+/*! Подключить существующую область журнала (из таблицы расширений хедера)
+\param region_pos, region_size позиция (абсолютная) и размер области
+\param fileblock_amount количество блоков в хранилище
+\return отрицательный код ошибки (-EINVAL - область испорчена). 0 - ошибок нет */
+int tagfs_journal_open(Journal journal, u64 region_pos, u64 region_size,
+    u64 fileblock_amount);
+
+/*! Количество блоков области нового журнала
+\return количество блоков. 0 - блок слишком мал для журнала */
+size_t tagfs_journal_region_blocks(u16 fileblock_size);
+
+/*! Записать область нового журнала (первое поколение) и сбросить её на диск.
+Область может лежать за концом файла хранилища
+\param block, blocks первый блок и количество блоков области (см. tagfs_journal_region_blocks)
+\param ext_table_pos возвращает позицию (абсолютную) таблицы расширений для хедера
+\return отрицательный код ошибки. 0 - ошибок нет */
+int tagfs_journal_create(Journal journal, u64 block, u64 blocks, u64* ext_table_pos);
+
+/*! Область журнала подключена
+\return true - транзакции проходят через журнал */
+bool tagfs_journal_enabled(Journal journal);
+
+/*! Блок принадлежит области журнала */
+bool tagfs_journal_owns_block(Journal journal, u64 block);
+
+/*! Повторить транзакции журнала текущего поколения при открытии хранилища.
+Транзакции читаются до первой неполной (или испорченной), затем журнал
+сбрасывается. Хранилище только для чтения с неповторёнными транзакциями не
+открывается
+\param fileblock_amount количество блоков в хранилище (транзакции не пишут за таблицу блоков)
+\param read_only хранилище открыто только для чтения
+\return отрицательный код ошибки (-EROFS - журнал нужно повторить, а
+хранилище только для чтения). 0 - ошибок нет */
+int tagfs_journal_replay(Journal journal, u64 fileblock_amount, bool read_only);
+
+/*! Начать новое поколение журнала: все транзакции текущего поколения
+становятся недействительными. Журнал сначала сбрасывается, транзакции
+применяются, а файл хранилища сбрасывается на диск. Блоки, освобождённые в текущем поколении, возвращаются в карту.
+Используется при синхронизации и закрытии хранилища. Без области журнала ничего не делает
+\return отрицательный код ошибки. 0 - ошибок нет */
+int tagfs_journal_checkpoint(Journal journal);
+
+/*! Вернуть блоки в карту свободных блоков после сброса журнала. Используется
+для блоков, которые могли быть записаны транзакциями текущего поколения
+журнала (при повторе журнала они будут записаны снова). Без области журнала
+блоки возвращаются сразу
+\param blocks, amount номера блоков */
+void tagfs_journal_defer_free(Journal journal, const size_t* blocks, size_t amount);
+
+/*! Начать чтение из таблицы файловых блоков. До tagfs_journal_read_end
+транзакции не применяются на месте и не убираются из журнала */
+void tagfs_journal_read_begin(Journal journal);
+
+/*! Закончить чтение из таблицы файловых блоков: наложить на прочитанные
+данные записи транзакций, которые ещё не применены на месте
+\param pos позиция (абсолютная) прочитанных данных
+\param buf, len прочитанные данные */
+void tagfs_journal_read_end(Journal journal, loff_t pos, void* buf, size_t len);
+
+
+/*! Инициализировать пустую транзакцию */
+void tagfs_journal_tx_init(struct JournalTx* tx);
+
+/*! Добавить запись в транзакцию. Данные копируются
+\param pos позиция (абсолютная) записи в хранилище
+\param data, len записываемые данные
+\return отрицательный код ошибки. 0 - ошибок нет */
+int tagfs_journal_tx_write(struct JournalTx* tx, loff_t pos, const void* data, size_t len);
+
+/*! Отметить блок освобождённым транзакцией. В карту свободных блоков он
+вернётся после применения транзакции (и сброса журнала)
+\return отрицательный код ошибки. 0 - ошибок нет */
+int tagfs_journal_tx_free(struct JournalTx* tx, size_t block);
+
+/*! Запомнить состояние транзакции для отката (см. tagfs_journal_tx_restore) */
+struct JournalTxPoint tagfs_journal_tx_save(const struct JournalTx* tx);
+
+/*! Откатить транзакцию до запомненного состояния. Связи блоков, заголовки
+которых писали отброшенные записи, в карте забываются */
+void tagfs_journal_tx_restore(Journal journal, struct JournalTx* tx,
+    const struct JournalTxPoint p);
+
+/*! Освободить память транзакции. Транзакция становится пустой. Записи
+незафиксированной транзакции отбрасываются (см. tagfs_journal_tx_restore) */
+void tagfs_journal_tx_release(Journal journal, struct JournalTx* tx);
+
+/*! Зафиксировать транзакцию: добавить её в журнал (без сброса на диск).
+Записи применятся на месте после сброса журнала, а читатели видят их сразу.
+Без области журнала записи применяются сразу. Транзакция после вызова пустая
+\return отрицательный код ошибки (-EFBIG - транзакция больше журнала). 0 - ошибок нет */
+int tagfs_journal_tx_commit(Journal journal, struct JournalTx* tx);
+
+#endif // TAG_JOURNAL_H
@@ -16,16 +16,43 @@
 
 #include "tag_storage.h"
 
+#include <linux/completion.h>
+#include <linux/cpumask.h>
 #include <linux/fs.h>
+#include <linux/hash.h>
+#include <linux/hashtable.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/mutex.h>
+#include <linux/pagemap.h>
+#include <linux/rwsem.h>
 #include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
 #include "common.h"
+#include "tag_block_map.h"
 #include "tag_storage_cache.h"
-
-#define kTagHashBits 8
-#define kFileHashBits 14
-
-const u32 kMagicWord = 0x34562343;
+#include "tag_file_table.h"
+#include "tag_journal.h"
+#include "tag_storage_index.h"
+
+#define kTagHashBits 8 //!< Минимальное количество битов хэша тэгов. Хэш тэгов рассчитывается по ёмкости таблицы тэгов
+#define kFileHashBits 10 //!< Начальное количество битов хэша имён файлов. Хэш растёт вместе с количеством файлов
+#define kDirtyHashBits 10 //!< Количество битов хэша отложенных записей полей тэгов
+#define kRecordLockBits 6 //!< Количество битов в номере блокировки файловых записей
+#define kTagLockBits 4 //!< Количество битов в номере блокировки записей тэгов
+
+const u32 kMagicWord = 0x34562343; //!< Метка хранилища версии 1
+const u32 kMagicWordV2 = 0x37562343; //!< Метка хранилища версии 2 и выше (версия указана в хедере)
+const u32 kFormatVersion = 2; //!< Текущая версия формата хранения
+const u32 kCompatNameIndex = 1 << 0; //!< Устаревшее: в хранилище мог быть индекс имён файлов. Снимается при открытии на запись
+const u32 kIncompatPostings = 1 << 0; //!< Устаревшее: в хранилище мог быть сохранённый индекс тэгов. Снимается при открытии на запись
+const u32 kIncompatSparseTags = 1 << 1; //!< Тэги файлов могут храниться разреженным набором (kTagsFieldSparse)
+const u32 kIncompatJournal = 1 << 2; //!< В журнале могут быть неприменённые транзакции (хранилище открыто или не закрыто после сбоя)
+const u32 kIncompatOpen = 1 << 3; //!< Хранилище открыто драйвером на запись (или не закрыто после сбоя)
+const u32 kIncompatSupported = (1 << 0) | (1 << 1) | (1 << 2) | (1 << 3); //!< Несовместимые возможности, которые поддерживает драйвер
 const u64 kTablesAlignment = 256;
 
 const u16 kDefaultTagRecordSize = 256;
@@ -33,10 +60,27 @@ const u16 kDefaultTagRecordMaxAmount = 64;
 const u16 kDefaultFileBlockSize = 256;
 
 const size_t kMaxFileBlocks = 1000; //!< Предельное ограничение на очень длинное описание файла (в блоках)
-
+const size_t kReadBufferMax = 1 << 16; //!< Предельный размер общего буфера чтения. Более длинные записи читаются в отдельный буфер
+const size_t kLoadChunkSize = 1 << 20; //!< Размер порции чтения таблицы файловых блоков при открытии хранилища
+const size_t kLoadWorkersMax = 8; //!< Максимальное количество потоков загрузки файловых блоков
+const u64 kLoadPartitionMin = 16384; //!< Минимальное количество блоков на поток загрузки. Кратно BITS_PER_LONG * BITS_PER_LONG
+const size_t kFileBlockGrowMin = 16; //!< Минимальное количество блоков, на которое расширяется хранилище
+const size_t kFileBlockGrowMax = 1024; //!< Максимальное количество блоков, на которое расширяется хранилище за раз
+const unsigned long kHeaderFlushDelay = 5 * HZ; //!< Задержка отложенной записи хедера хранилища
+const u64 kServiceBlockMark = (u64)(-3); //!< Значение полей заголовка блока устаревшего индекса имён (такие блоки свободны)
+const u64 kPostingsBlockMark = (u64)(-4); //!< Значение полей заголовка блока устаревшего сохранённого индекса тэгов (такие блоки свободны)
+const u16 kTagsFieldSparse = 0x8000; //!< Флаг в FileHeader::tags_field_size: поле тэгов - набор номеров тэгов
+const u16 kTagsFieldSizeMask = 0x7fff; //!< Размер поля тэгов в FileHeader::tags_field_size
+const u16 kSparseTagsMaskMin = 16; //!< Разреженные поля тэгов пишутся, если маска тэгов больше (больше 128 тэгов)
+const unsigned long kDirtyFlushDelay = 5 * HZ; //!< Задержка отложенной записи полей тэгов файлов
+const size_t kDirtyRecordsMax = 4096; //!< Количество отложенных записей, при котором запись начинается без задержки
+const size_t kJournalTxMax = 1 << 18; //!< Размер пакетной транзакции, при котором она фиксируется
+
+/*! Хедер хранилища. В версии 1 (kMagicWord) используются поля до
+fileblock_amount включительно. В версии 2 (kMagicWordV2) - все поля */
 struct FSHeader {
   __le32 magic_word;
-  __le32 padding1; //!< Выравнивание. Заполняется нулями
+  __le32 version; //!< Версия формата. В версии 1 - выравнивание, заполняется нулями
   __le64 tag_table_pos; //!< Позиция (абсолютная) начала таблицы с тэгами. Может быть больше размера файла
   /*0x10*/
   __le64 fileblock_table_pos; //!< Позиция (абсолютная) начала таблицы с файловыми блоками. Может быть больше размера файла.
@@ -46,23 +90,27 @@ struct FSHeader {
   __le16 fileblock_size; //!< Размер файлового блока
   /*0x20*/
   __le64 fileblock_amount; //!< Общее количество записанных файловых блоков (т.е. тех, что можно прочитать). Фактически определяет размер файла
+  __le64 reserved1[4]; // Бывшие ссылки на индекс имён файлов (0x28) и сохранённый индекс тэгов (0x38). Обнуляются вместе с kCompatNameIndex и kIncompatPostings
+  /*0x48*/
+  __le32 compat_features; //!< Возможности, которые драйвер может не знать (хранилище всё равно открывается)
+  __le32 incompat_features; //!< Возможности, без знания которых хранилище открывать нельзя
+  /*0x50*/
+  __le64 ext_table_pos; //!< Позиция (абсолютная) таблицы расширений хедера. 0 - таблицы нет
 };
 
 
+const size_t kHeaderV1Size = offsetof(struct FSHeader, reserved1); //!< Размер хедера версии 1
+const u32 kExtEntriesMax = 1024; //!< Предельное количество записей в таблице расширений
+
+
 struct TagHeader {
   __le16 tag_flags;
   __le16 tag_name_size;
   /* name after header */
 };
 
-struct FileBlockHeader {
-  __le64 prev_block_index;
-  __le64 next_block_index;
-  /* file data after header */
-};
-
 struct FileHeader {
-  __le16 tags_field_size;
+  __le16 tags_field_size; //!< Размер поля тэгов. С флагом kTagsFieldSparse поле - отсортированные номера тэгов (__le16), иначе маска
   __le16 link_name_size; //!< Это название символьной ссылки
   __le32 link_target_size; //!< Это содержимое символьной ссылки (путь к внешнему файлу)
   /* tag field */
@@ -70,8 +118,26 @@ struct FileHeader {
   /* link target field */
 };
 
+/*! Прочитанная файловая запись (см. AllocateReadFileDataWOLock) */
+struct FileData {
+  void* data; //!< Данные записи без заголовков блоков
+  size_t size; //!< Размер данных
+  bool shared; //!< Данные в общем буфере хранилища, удерживается read_buffer_lock
+};
+
+/*! Отложенная запись поля тэгов файла */
+struct DirtyRecord {
+  struct hlist_node node;
+  size_t ino;
+  void* field; //!< Новое поле тэгов (см. ComposeTagField)
+  size_t field_len;
+  u16 field_size;
+};
+
 struct StorageRaw {
   struct FSHeader header_mem; //!< Копия хедера в памяти для изменения и записи
+  u32 version; //!< Версия формата хранилища
+  size_t header_size; //!< Размер хедера в хранилище (зависит от версии)
 
   u64 tag_table_pos;
   u16 tag_record_size;
@@ -82,35 +148,75 @@ struct StorageRaw {
   u16 fileblock_size;
   u64 fileblock_amount; // Переменная лочится fileblock_amount_lock
 
-  size_t min_fileblock_for_seek_empty; // Номер блока, с которого можно начинать поиск свободного блока (для ускорения файловых операций)
+  /*! Хедер хранилища записывается отложенно (при синхронизации, закрытии
+  или по таймеру). Признак изменения лочится fileblock_amount_lock */
+  bool header_dirty;
+  struct mutex header_flush_lock; //!< Блокировка записи хедера (чтобы более старый хедер не перезаписал новый)
+  struct delayed_work header_flush_work;
+
+  void* read_buffer; //!< Общий буфер для чтения файловых записей. Переиспользуется между чтениями
+  size_t read_buffer_size;
+  struct mutex read_buffer_lock; //!< Блокировка использования read_buffer
+
   u16 last_added_tag_ino; // Номер тэга, который был добавлен последним (используется для поиска следующего места для добавления) TODO ATOMIC?
 
   struct qstr no_prefix;
 
   struct file* storage_file;
   rwlock_t fileblock_amount_lock; //!< Блокировка при расширении количества файловых блоков. Почему не на весь header - а остальное не меняется
-  rwlock_t fileblock_lock; //!< Блокировка при изменении содержимого файловых блоков
-  rwlock_t tag_lock; //!< Блокировка при изменении содержимого записей тэгов
-
-  Cache file_cache; //!< Кэш файловых записей. Если запись неактивна, то имя пустое. Для активной записи пользовательские данные - FileData
-  Cache tag_cache; //!< Кэш тегов. Если тэг неактивный, то имя пустое. Пользовательские данные всегда NULL.
-};
 
+  /*! Блокировки файловых записей. Запись (вся цепочка её блоков) блокируется
+  по номеру файла, несколько записей делят одну блокировку (см. RecordLock).
+  Распределение блоков (карта свободных блоков и расширение хранилища)
+  выполняется под отдельной блокировкой alloc_lock, которая ставится после
+  блокировки записи. Блоки области журнала принадлежат журналу */
+  struct rw_semaphore record_locks[1 << kRecordLockBits];
+  struct mutex alloc_lock;
+  struct rw_semaphore tag_locks[1 << kTagLockBits]; //!< Блокировки записей тэгов (см. TagLock)
 
-struct FileData {
-  struct TagMask tag_mask;
-  struct qstr link_target;
+  FileTable file_table; //!< Таблица файловых записей. Содержит только активные файлы
+  Cache tag_cache; //!< Кэш тегов. Если тэг неактивный, то имя пустое. Пользовательские данные всегда NULL.
+  TagIndex file_index; //!< Индекс файлов по тэгам. Содержит только активные файлы
+  BlockMap free_blocks; //!< Карта свободных файловых блоков. Меняется под блокировкой alloc_lock
+
+  /*! Отложенная запись полей тэгов файлов. Изменения одного файла
+  объединяются (записывается последнее), записи выполняются по возрастанию
+  номеров файлов из рабочего потока или при синхронизации. Блокировка
+  dirty_flush_lock ставится раньше dirty_lock, обе - раньше блокировок
+  файловых записей. Маска файла в таблице и индексе меняется под dirty_lock
+  вместе с постановкой поля в очередь */
+  struct mutex dirty_lock;
+  struct mutex dirty_flush_lock; //!< Запись выполняется только одним потоком
+  DECLARE_HASHTABLE(dirty_records, kDirtyHashBits);
+  size_t dirty_amount;
+  struct delayed_work dirty_flush_work;
+
+  /*! Удаляемые тэги. Тэг сразу блокируется (и скрывается), а его биты у
+  файлов снимаются в фоне (перебираются только файлы тэга из индекса) или при
+  следующем изменении маски файла. После этого тэг освобождается. Если
+  удаление прервано, то оно продолжается при следующем открытии хранилища */
+  struct mutex blocked_lock;
+  struct TagMask blocked_tags; //!< Заблокированные тэги, ожидающие очистки
+  size_t blocked_amount; //!< Количество заблокированных тэгов
+  struct work_struct tag_sweep_work;
+
+  Journal journal; //!< Журнал записи файловых блоков (см. tag_journal.h)
+
+  /*! Загрузка файловых блоков (таблицы файлов, индекса и карты блоков). При
+  отложенной загрузке выполняется в фоне после монтирования */
+  struct work_struct files_load_work;
+  struct completion files_loaded; //!< Загрузка файловых блоков завершена
+  int files_load_res; //!< Результат загрузки. Валиден после files_loaded
+  bool files_load_stop; //!< Признак прерывания фоновой загрузки и очистки тэгов (при закрытии хранилища)
+
+  /*! Разреженные поля тэгов можно записывать: флаг kIncompatSparseTags уже
+  на диске. Флаг ставится при первой записи такого поля (см. UseSparseTags) */
+  bool sparse_tags;
+  struct mutex sparse_tags_lock;
+
+  bool read_only; //!< Хранилище смонтировано только для чтения: служебные данные не записываются
 };
 
-void FileDataRemover(void* data) {
-  struct FileData* fd = (struct FileData*)data;
-
-  if (!fd) { return; }
-  tagmask_release(&(fd->tag_mask));
-  free_qstr(&(fd->link_target));
-  kfree(fd);
-}
-
 
 const u16 kTagFlagFree = 0;
 const u16 kTagFlagActive = 1;
@@ -122,18 +228,172 @@ extern int TagFlagUpdate(struct StorageRaw* sr, size_t tagino, u16 expect_state,
     u16 new_state, const char* new_name, size_t new_name_len);
 
 extern void ReadAllTagsToCache(struct StorageRaw* sr);
-extern void ReadAllFilesToCache(struct StorageRaw* sr);
+extern int LoadAllFileBlocks(struct StorageRaw* sr);
+extern void FilesLoadWork(struct work_struct* work);
+extern int FlushStorageHeader(struct StorageRaw* sr);
+extern void HeaderFlushWork(struct work_struct* work);
+extern bool FilesLoaded(struct StorageRaw* sr);
+extern int FlushDirtyRecords(struct StorageRaw* sr);
+extern void DirtyFlushWork(struct work_struct* work);
+extern void TagSweepWork(struct work_struct* work);
+extern void ResumeTagSweep(struct StorageRaw* sr);
+extern u64 GetFileBlockAmount(struct StorageRaw* sr);
+extern int ClearFileBlockWOLock(struct StorageRaw* sr, struct JournalTx* tx,
+    size_t fb_index, size_t prev_fb_index, size_t* next_fb);
+
+
+/*! Разобрать хедер, прочитанный из хранилища: определить версию формата и
+проверить, что драйвер поддерживает все несовместимые возможности хранилища.
+Поля, которых нет в версии хранилища, обнуляются
+\param read_size сколько байтов хедера удалось прочитать
+\return отрицательный код ошибки. 0 - ошибок нет */
+int ParseStorageHeader(struct StorageRaw* sr, size_t read_size) {
+  u32 magic = le32_to_cpu(sr->header_mem.magic_word);
+  u32 incompat;
+
+  if (magic == kMagicWord) {
+    sr->version = 1;
+    sr->header_size = kHeaderV1Size;
+    memset((void*)(&sr->header_mem) + kHeaderV1Size, 0,
+        sizeof(struct FSHeader) - kHeaderV1Size);
+    return 0;
+  }
+  if (magic != kMagicWordV2) { return -EINVAL; }
+
+  sr->version = le32_to_cpu(sr->header_mem.version);
+  if (sr->version < 2 || read_size < sizeof(struct FSHeader)) { return -EINVAL; }
+  if (sr->tag_table_pos < sizeof(struct FSHeader) ||
+      sr->fileblock_table_pos < sizeof(struct FSHeader)) {
+    return -EINVAL;
+  }
+
+  incompat = le32_to_cpu(sr->header_mem.incompat_features);
+  if (incompat & ~kIncompatSupported) {
+    pr_err("tagvfs: storage has unsupported features 0x%x\n",
+        incompat & ~kIncompatSupported);
+    return -EINVAL;
+  }
+
+  // У более новых версий хедер может быть длиннее. Драйвер пишет только
+  // известную ему часть, остальное не трогается
+  sr->header_size = sizeof(struct FSHeader);
+  return 0;
+}
+
+
+/*! Обновить хранилище версии 1 до текущей версии: меняется только хедер
+(метка, версия, возможности). Индексы строятся и записываются после загрузки
+файлов. Для новых полей хедера нужно место перед таблицами
+\param f файл хранилища
+\return отрицательный код ошибки. 0 - ошибок нет */
+int UpgradeStorageHeader(struct StorageRaw* sr, struct file* f) {
+  struct FSHeader h = sr->header_mem;
+  loff_t pos = 0;
+
+  if (sr->tag_table_pos < sizeof(struct FSHeader) ||
+      sr->fileblock_table_pos < sizeof(struct FSHeader)) {
+    pr_err("tagvfs: storage header has no room for upgrade\n");
+    return -ENOSPC;
+  }
+
+  h.magic_word = cpu_to_le32(kMagicWordV2);
+  h.version = cpu_to_le32(kFormatVersion);
+  memset(h.reserved1, 0, sizeof(h.reserved1));
+  h.compat_features = cpu_to_le32(0);
+  h.incompat_features = cpu_to_le32(0);
+  h.ext_table_pos = cpu_to_le64(0);
+  if (kernel_write(f, &h, sizeof(h), &pos) != sizeof(h)) { return -EFAULT; }
+
+  sr->header_mem = h;
+  sr->version = kFormatVersion;
+  sr->header_size = sizeof(struct FSHeader);
+  pr_info("tagvfs: storage is upgraded to format version %u\n", kFormatVersion);
+  return 0;
+}
+
+
+/*! Прочитать таблицу расширений хедера. Из известных расширений читается
+журнал (kExtJournal), неизвестные расширения пропускаются
+\return отрицательный код ошибки. 0 - ошибок нет */
+int ReadExtTable(struct StorageRaw* sr) {
+  u64 table_pos = le64_to_cpu(sr->header_mem.ext_table_pos);
+  struct FSExtTableHeader th;
+  u32 amount, entry_size, i;
+  loff_t pos = table_pos;
+
+  if (sr->version < 2 || table_pos == 0) { return 0; }
+
+  if (kernel_read(sr->storage_file, &th, sizeof(th), &pos) != sizeof(th)) {
+    return -EFAULT;
+  }
+  amount = le32_to_cpu(th.entries_amount);
+  entry_size = le32_to_cpu(th.entry_size);
+  if (amount > kExtEntriesMax || entry_size < sizeof(struct FSExtEntry)) {
+    return -EINVAL;
+  }
+
+  for (i = 0; i < amount; ++i) {
+    struct FSExtEntry e;
+
+    pos = table_pos + sizeof(th) + (u64)i * entry_size;
+    if (kernel_read(sr->storage_file, &e, sizeof(e), &pos) != sizeof(e)) {
+      return -EFAULT;
+    }
+    if (le32_to_cpu(e.type) == kExtJournal) {
+      int res = tagfs_journal_open(sr->journal, le64_to_cpu(e.pos),
+          le64_to_cpu(e.size), GetFileBlockAmount(sr));
+
+      if (res) { return res; }
+      continue;
+    }
+    pr_info("tagvfs: unknown header extension %u is skipped\n",
+        (unsigned int)le32_to_cpu(e.type));
+  }
+  return 0;
+}
+
+
+/*! Создать журнал при открытии хранилища с опцией upgrade (если его нет:
+хранилище обновлено или создано старым драйвером).
+Область журнала (около 1 МБ) дописывается в хвост таблицы файловых блоков,
+затем ссылка на неё записывается в хедер. Журнал не создаётся для хранилища версии 1, для
+хранилища с неизвестной таблицей расширений и для слишком маленьких блоков
+\return отрицательный код ошибки. 0 - ошибок нет (журнал мог не создаться) */
+int CreateJournal(struct StorageRaw* sr) {
+  u64 fba = GetFileBlockAmount(sr);
+  size_t blocks = tagfs_journal_region_blocks(sr->fileblock_size);
+  u64 ext_table_pos;
+  int res;
+
+  if (sr->version < 2 || le64_to_cpu(sr->header_mem.ext_table_pos) != 0) { return 0; }
+  if (!blocks) { return 0; }
+
+  res = tagfs_journal_create(sr->journal, fba, blocks, &ext_table_pos);
+  if (res) { return res; }
+
+  write_lock(&sr->fileblock_amount_lock);
+  sr->fileblock_amount = fba + blocks;
+  sr->header_mem.ext_table_pos = cpu_to_le64(ext_table_pos);
+  sr->header_dirty = true;
+  write_unlock(&sr->fileblock_amount_lock);
+  return FlushStorageHeader(sr);
+}
 
 
 /*! Открывает файл-хранилище и инициализирует экземпляр stor
 \param stor инициализируемое хранилище
 \param file_storage имя файла-хранилища
+\param opts параметры открытия: отложенная загрузка файловых блоков (после
+чтения хедера и тэгов хранилище сразу готово к работе, а файлы загружаются в
+фоне), обновление формата хранилища
 \return 0 - открытие успешно. Или отрицательный код ошибки */
-int OpenTagFS(Storage* stor, const char* file_storage) {
+int OpenTagFS(Storage* stor, const char* file_storage,
+    const struct StorageOptions* opts) {
   struct file* f = NULL;
   loff_t rpos;
   ssize_t rs;
   struct StorageRaw* sr;
+  size_t i;
   int res = 0;
 
   if (!stor || (*stor)) { return -EINVAL; }
@@ -143,16 +403,23 @@ int OpenTagFS(Storage* stor, const char* file_storage) {
     return -ENOMEM;
   }
   sr = (struct StorageRaw*)(*stor);
-  sr->file_cache = NULL;
+  sr->file_table = NULL;
   sr->tag_cache = NULL;
-
-  if ((res = tagfs_init_cache(&(sr->file_cache), kFileHashBits)) != 0) {
-    goto err_aa;
-  }
-
-  if ((res = tagfs_init_cache(&(sr->tag_cache), kTagHashBits)) != 0) {
-    goto err_aa;
-  }
+  sr->file_index = NULL;
+  sr->free_blocks = NULL;
+  mutex_init(&sr->header_flush_lock);
+  mutex_init(&sr->read_buffer_lock);
+  mutex_init(&sr->dirty_lock);
+  mutex_init(&sr->dirty_flush_lock);
+  hash_init(sr->dirty_records);
+  INIT_DELAYED_WORK(&sr->header_flush_work, HeaderFlushWork);
+  INIT_DELAYED_WORK(&sr->dirty_flush_work, DirtyFlushWork);
+  mutex_init(&sr->blocked_lock);
+  INIT_WORK(&sr->tag_sweep_work, TagSweepWork);
+  INIT_WORK(&sr->files_load_work, FilesLoadWork);
+  init_completion(&sr->files_loaded);
+  mutex_init(&sr->sparse_tags_lock);
+  sr->read_only = opts->read_only;
 
   f = filp_open(file_storage, O_RDWR, 0);
   if (IS_ERR(f)) {
@@ -162,46 +429,172 @@ int OpenTagFS(Storage* stor, const char* file_storage) {
 
   rpos = 0;
   rs = kernel_read(f, &(sr->header_mem), sizeof(struct FSHeader), &rpos);
-  if (rs != sizeof(struct FSHeader)) {
+  if (rs < (ssize_t)kHeaderV1Size) {
     res = -EFAULT;
     goto err_ao;
   }
 
   sr->tag_table_pos = le64_to_cpu(sr->header_mem.tag_table_pos);
+  sr->fileblock_table_pos = le64_to_cpu(sr->header_mem.fileblock_table_pos);
+  if ((res = ParseStorageHeader(sr, rs)) != 0) {
+    goto err_ao;
+  }
+  if (opts->upgrade && sr->read_only) {
+    pr_warn("tagvfs: upgrade is skipped for read-only mount\n");
+  }
+  if (opts->upgrade && !sr->read_only && sr->version < kFormatVersion &&
+      (res = UpgradeStorageHeader(sr, f)) != 0) {
+    goto err_ao;
+  }
+  sr->sparse_tags = (le32_to_cpu(sr->header_mem.incompat_features) &
+      kIncompatSparseTags) != 0;
   sr->tag_record_size = le16_to_cpu(sr->header_mem.tag_record_size);
   sr->tag_record_max_amount = le16_to_cpu(sr->header_mem.tag_record_max_amount);
   sr->last_added_tag_ino = 0;
   sr->tag_mask_byte_size = tagmask_get_byte_len(sr->tag_record_max_amount);
 
-  sr->fileblock_table_pos = le64_to_cpu(sr->header_mem.fileblock_table_pos);
   sr->fileblock_size = le16_to_cpu(sr->header_mem.fileblock_size);
   sr->fileblock_amount = le64_to_cpu(sr->header_mem.fileblock_amount);
 
-  sr->min_fileblock_for_seek_empty = 0;
-
-  if (sr->tag_record_max_amount == 0) {
+  if (sr->tag_record_max_amount == 0 || sr->fileblock_size == 0) {
     res = -EINVAL;
     goto err_ao;
   }
 
+  // Количество блоков в хедере обновляется отложенно, поэтому после сбоя оно
+  // может отставать от реального. Новые блоки всегда сначала дописываются в
+  // файл (уже размеченными свободными), и только потом используются. Поэтому
+  // количество блоков определяется размером файла: в расчёт берутся только
+  // полностью записанные блоки
+  {
+    loff_t fsize = i_size_read(file_inode(f));
+    u64 real_amount = 0;
+
+    if (fsize > sr->fileblock_table_pos) {
+      real_amount = div_u64(fsize - sr->fileblock_table_pos, sr->fileblock_size);
+    }
+    if (real_amount < sr->fileblock_amount) {
+      pr_warn("tagvfs: storage is shorter than header declares (%llu blocks vs %llu)\n",
+          (unsigned long long)real_amount, (unsigned long long)sr->fileblock_amount);
+    }
+    if (real_amount != sr->fileblock_amount) {
+      sr->fileblock_amount = real_amount;
+      sr->header_dirty = true;
+    }
+  }
+
+  // Количество тэгов ограничено ёмкостью таблицы тэгов, поэтому хэш тэгов
+  // сразу создаётся нужного размера
+  if ((res = tagfs_init_cache(&(sr->tag_cache), max_t(unsigned int, kTagHashBits,
+      order_base_2(sr->tag_record_max_amount)))) != 0) {
+    goto err_ao;
+  }
+
+  sr->blocked_tags = tagmask_init_zero(sr->tag_record_max_amount);
+  if (tagmask_is_empty(sr->blocked_tags)) {
+    res = -ENOMEM;
+    goto err_ao;
+  }
+
+  if ((res = tagfs_init_file_table(&(sr->file_table), sr->tag_record_max_amount,
+      kFileHashBits)) != 0) {
+    goto err_ao;
+  }
+
+  if ((res = tagfs_init_index(&(sr->file_index), sr->tag_record_max_amount)) != 0) {
+    goto err_ao;
+  }
+
+  if ((res = tagfs_init_block_map(&(sr->free_blocks))) != 0) {
+    goto err_ao;
+  }
+
 
   sr->storage_file = f;
   rwlock_init(&sr->fileblock_amount_lock);
-  rwlock_init(&sr->fileblock_lock);
-  rwlock_init(&sr->tag_lock);
+  for (i = 0; i < ARRAY_SIZE(sr->record_locks); ++i) {
+    init_rwsem(&sr->record_locks[i]);
+  }
+  mutex_init(&sr->alloc_lock);
+  for (i = 0; i < ARRAY_SIZE(sr->tag_locks); ++i) {
+    init_rwsem(&sr->tag_locks[i]);
+  }
 
   sr->no_prefix = alloc_qstr_from_str("no-", 3);
 
+  if ((res = tagfs_init_journal(&(sr->journal), f, sr->fileblock_table_pos,
+      sr->fileblock_size, sr->free_blocks, &sr->alloc_lock)) != 0) {
+    goto err_ao;
+  }
+
+  if ((res = ReadExtTable(sr)) != 0) {
+    goto err_ao;
+  }
+
+  if (!sr->read_only &&
+      ((sr->header_mem.compat_features & cpu_to_le32(kCompatNameIndex)) ||
+      (sr->header_mem.incompat_features & cpu_to_le32(kIncompatPostings)))) {
+    // Индексы имён и тэгов больше не хранятся: хедер на них не ссылается, а
+    // их блоки освобождаются при загрузке файловых блоков
+    write_lock(&sr->fileblock_amount_lock);
+    sr->header_mem.compat_features &= ~cpu_to_le32(kCompatNameIndex);
+    sr->header_mem.incompat_features &= ~cpu_to_le32(kIncompatPostings);
+    memset(sr->header_mem.reserved1, 0, sizeof(sr->header_mem.reserved1));
+    sr->header_dirty = true;
+    write_unlock(&sr->fileblock_amount_lock);
+  }
+
+  // Повторим транзакции журнала до чтения индексов и файлов. В существующее
+  // хранилище журнал добавляется только по опции upgrade: он увеличивает
+  // хранилище и делает его несовместимым со старыми драйверами, пока оно открыто
+  if (tagfs_journal_enabled(sr->journal)) {
+    res = tagfs_journal_replay(sr->journal, GetFileBlockAmount(sr), sr->read_only);
+  } else if (opts->upgrade && !sr->read_only) {
+    res = CreateJournal(sr);
+  }
+  if (res) { goto err_ao; }
+  if (sr->version >= 2 && !sr->read_only) {
+    // Пока хранилище открыто на запись, его не открывают другие программы
+    // (tagpack) и драйверы без журнала. Бит открытия не зависит от журнала
+    write_lock(&sr->fileblock_amount_lock);
+    sr->header_mem.incompat_features |= cpu_to_le32(kIncompatOpen);
+    if (tagfs_journal_enabled(sr->journal)) {
+      sr->header_mem.incompat_features |= cpu_to_le32(kIncompatJournal);
+    }
+    sr->header_dirty = true;
+    write_unlock(&sr->fileblock_amount_lock);
+    if ((res = FlushStorageHeader(sr)) != 0) { goto err_ao; }
+    if ((res = vfs_fsync(sr->storage_file, 0)) != 0) { goto err_ao; }
+  }
+
   ReadAllTagsToCache(sr);
-  ReadAllFilesToCache(sr);
+  if (opts->lazy_load) {
+    queue_work(system_unbound_wq, &sr->files_load_work);
+    return 0;
+  }
+
+  if ((res = LoadAllFileBlocks(sr)) != 0) {
+    goto err_ao;
+  }
+  complete_all(&sr->files_loaded);
+  ResumeTagSweep(sr);
 
   return 0;
   // --------------
 err_ao:
+  // Отложенные записи могли быть запланированы при открытии (хедер, индексы)
+  cancel_delayed_work_sync(&sr->header_flush_work);
+  cancel_delayed_work_sync(&sr->dirty_flush_work);
+  tagfs_release_journal(&sr->journal);
   filp_close(f, NULL);
 err_aa:
+  kvfree(sr->read_buffer);
+  free_qstr(&sr->no_prefix);
+  tagfs_release_block_map(&sr->free_blocks);
+  tagfs_release_index(&sr->file_index);
   tagfs_release_cache(&sr->tag_cache);
-  tagfs_release_cache(&sr->file_cache);
+  tagfs_release_file_table(&sr->file_table);
+  tagmask_release(&sr->blocked_tags);
   kfree(*stor);
   *stor = NULL;
 
@@ -214,15 +607,53 @@ err_aa:
 \return 0 - закрытие без ошибок; Иначе - отрицательный код ошибки */
 int CloseTagFS(Storage* stor) {
   struct StorageRaw* sr;
+  bool clean;
 
   if (!stor || !(*stor)) { return -EINVAL; }
   sr = (struct StorageRaw*)(*stor);
+  WRITE_ONCE(sr->files_load_stop, true);
+  flush_work(&sr->files_load_work);
+  cancel_work_sync(&sr->tag_sweep_work);
+  cancel_delayed_work_sync(&sr->dirty_flush_work);
+  clean = true;
+  if (FlushDirtyRecords(sr)) {
+    pr_warn("tagvfs: ERROR can't write file tags\n");
+    clean = false;
+  }
+  if (tagfs_journal_enabled(sr->journal) && !sr->read_only) {
+    if (tagfs_journal_checkpoint(sr->journal)) {
+      pr_warn("tagvfs: ERROR can't reset journal\n");
+      clean = false;
+    } else {
+      write_lock(&sr->fileblock_amount_lock);
+      sr->header_mem.incompat_features &= ~cpu_to_le32(kIncompatJournal);
+      sr->header_dirty = true;
+      write_unlock(&sr->fileblock_amount_lock);
+    }
+  }
+  tagfs_release_journal(&sr->journal);
+  cancel_delayed_work_sync(&sr->header_flush_work);
+  if (sr->version >= 2 && !sr->read_only && clean &&
+      !vfs_fsync(sr->storage_file, 0)) {
+    // Бит открытия снимается, только когда все записи уже на диске
+    write_lock(&sr->fileblock_amount_lock);
+    sr->header_mem.incompat_features &= ~cpu_to_le32(kIncompatOpen);
+    sr->header_dirty = true;
+    write_unlock(&sr->fileblock_amount_lock);
+  }
+  if (!FlushStorageHeader(sr) && !sr->read_only) {
+    vfs_fsync(sr->storage_file, 0);
+  }
   filp_close(sr->storage_file, NULL);
 
+  tagfs_release_block_map(&sr->free_blocks);
+  tagfs_release_index(&sr->file_index);
   tagfs_release_cache(&sr->tag_cache);
-  tagfs_release_cache(&sr->file_cache);
+  tagfs_release_file_table(&sr->file_table);
+  tagmask_release(&sr->blocked_tags);
 
   free_qstr(&sr->no_prefix);
+  kvfree(sr->read_buffer);
 
   kfree(sr);
   *stor = NULL;
@@ -232,7 +663,8 @@ int CloseTagFS(Storage* stor) {
 
 /*! Создать файл-хранилище с дефалтовыми настройками. Функция
 создаёт новый файл (если файл уже существует, то вернётся ошибка),
-заполняет форматки в файле и закрывает заполненный файл.
+заполняет форматки в файле и закрывает заполненный файл. Журнал записи
+занимает начало таблицы файловых блоков
 \param file_storage имя создаваемого файла
 \return 0 - создание успешно, Или отрицательный код ошибки */
 int CreateDefaultStorageFile(const char* file_storage) {
@@ -242,9 +674,13 @@ int CreateDefaultStorageFile(const char* file_storage) {
   u64 file_pos = 0;
   ssize_t ws;
   loff_t wpos = 0;
-  int res;
+  int res = 0;
+  int cres;
   void* tag_mem;
   u16 ti;
+  Journal journal = NULL;
+  size_t journal_blocks = tagfs_journal_region_blocks(kDefaultFileBlockSize);
+  u64 ext_table_pos = 0;
 
 
   f = filp_open(file_storage, O_RDWR | O_CREAT | O_EXCL, 0666 /* TODO CHANGE RIGHTS S_IRUSR | S_IWUSR */);
@@ -255,15 +691,27 @@ int CreateDefaultStorageFile(const char* file_storage) {
   // Fill and write header
   tag_pos = (sizeof(struct FSHeader) + kTablesAlignment - 1) / kTablesAlignment * kTablesAlignment;
   file_pos = (tag_pos + kDefaultTagRecordSize * kDefaultTagRecordMaxAmount + kTablesAlignment - 1) / kTablesAlignment * kTablesAlignment;
-  h.magic_word = cpu_to_le32(kMagicWord);
-  h.padding1 = 0;
+  h.magic_word = cpu_to_le32(kMagicWordV2);
+  h.version = cpu_to_le32(kFormatVersion);
   h.tag_table_pos = cpu_to_le64(tag_pos);
   h.fileblock_table_pos = cpu_to_le64(file_pos);
   h.tag_record_size = cpu_to_le16(kDefaultTagRecordSize); // TODO check value is dived by alignment
   h.tag_record_max_amount = cpu_to_le16(kDefaultTagRecordMaxAmount);
   h.reserved0 = cpu_to_le16(0);
   h.fileblock_size = cpu_to_le16(kDefaultFileBlockSize);
-  h.fileblock_amount = cpu_to_le64(0);
+  memset(h.reserved1, 0, sizeof(h.reserved1));
+  h.compat_features = cpu_to_le32(0);
+  h.incompat_features = cpu_to_le32(0);
+
+  // Журнал записывается (и сбрасывается на диск) раньше хедера, который на него ссылается
+  if (journal_blocks) {
+    res = tagfs_init_journal(&journal, f, file_pos, kDefaultFileBlockSize, NULL, NULL);
+    if (!res) { res = tagfs_journal_create(journal, 0, journal_blocks, &ext_table_pos); }
+    tagfs_release_journal(&journal);
+    if (res) { goto ex; }
+  }
+  h.fileblock_amount = cpu_to_le64(ext_table_pos ? journal_blocks : 0);
+  h.ext_table_pos = cpu_to_le64(ext_table_pos);
   ws = kernel_write(f, &h, sizeof(h), &wpos);
 
   // Инициализируем место под тэги
@@ -284,8 +732,8 @@ int CreateDefaultStorageFile(const char* file_storage) {
 ex_mem:
   kfree(tag_mem);
 ex:
-  res = filp_close(f, NULL);
-  return res;
+  cres = filp_close(f, NULL);
+  return res ? res : cres;
 }
 
 
@@ -310,38 +758,198 @@ u64 GetFileBlockAmount(struct StorageRaw* sr) {
   return v;
 }
 
-/*! Увеличиваем общее количество файловых блоков и возвращаем новое значение
-количества файловых блоков. Блокировка на файловую область не ставится.
-Добавление делается в хвост файла, поэтому новый блок имеет номер (кол-во - 1)
-\return обновлённое количество файловых блоков. Или отрицательный код ошибки */
-u64 IncFileBlockAmountWOLock(struct StorageRaw* sr) {
-  u64 v = -EFAULT;
-  bool fba_failed = true;
-  u64 fba = -EFAULT;
+/*! Выдать блокировку файловой записи
+\param ino номер файла (первый блок записи)
+\return блокировка, общая для нескольких записей */
+struct rw_semaphore* RecordLock(struct StorageRaw* sr, size_t ino) {
+  return &sr->record_locks[hash_long(ino, kRecordLockBits)];
+}
+
+
+/*! Выдать блокировку записи тэга
+\param tag номер тэга
+\return блокировка, общая для нескольких тэгов */
+struct rw_semaphore* TagLock(struct StorageRaw* sr, size_t tag) {
+  return &sr->tag_locks[hash_long(tag, kTagLockBits)];
+}
+
+
+/*! Прочитать небольшой фрагмент хранилища (заголовки блоков, записи тэгов)
+прямо из страничного кэша файла-хранилища, без прохода через kernel_read.
+Запись в хранилище идёт через kernel_write (тот же страничный кэш), а записи
+транзакций, ещё не применённые на месте, накладываются из журнала, поэтому
+прочитанные данные всегда актуальны
+\param pos позиция (абсолютная) фрагмента
+\param buf, len буфер и размер фрагмента
+\return отрицательный код ошибки (-EFAULT - фрагмент за концом файла). 0 - ошибок нет */
+int ReadStorageCached(struct StorageRaw* sr, loff_t pos, void* buf, size_t len) {
+  struct address_space* mapping = sr->storage_file->f_mapping;
+  size_t done = 0;
+  int res = 0;
+
+  if (pos < 0 || pos + len > i_size_read(mapping->host)) { return -EFAULT; }
+  tagfs_journal_read_begin(sr->journal);
+  while (done < len) {
+    struct page* page;
+    size_t offset = offset_in_page(pos + done);
+    size_t part = min_t(size_t, len - done, PAGE_SIZE - offset);
+    void* addr;
+
+    page = read_mapping_page(mapping, (pos + done) >> PAGE_SHIFT, sr->storage_file);
+    if (IS_ERR(page)) {
+      res = -EFAULT;
+      break;
+    }
+    addr = kmap_local_page(page);
+    memcpy(buf + done, addr + offset, part);
+    kunmap_local(addr);
+    put_page(page);
+    done += part;
+  }
+  tagfs_journal_read_end(sr->journal, pos, buf, done);
+  return res;
+}
+
+
+/*! Записать хедер хранилища, если он изменился
+\return отрицательный код ошибки. 0 - ошибок нет */
+int FlushStorageHeader(struct StorageRaw* sr) {
+  struct FSHeader h;
   loff_t pos = 0;
-  struct FileBlockHeader bh;
+  bool dirty;
+  int res = 0;
 
+  if (sr->read_only) { return 0; }
+  mutex_lock(&sr->header_flush_lock);
   write_lock(&sr->fileblock_amount_lock);
-  ++sr->fileblock_amount;
+  dirty = sr->header_dirty;
   sr->header_mem.fileblock_amount = cpu_to_le64(sr->fileblock_amount);
-  pos = 0;
-  if (kernel_write(sr->storage_file, &sr->header_mem, sizeof(struct FSHeader),
-      &pos) == sizeof(struct FSHeader)) {
-    fba = sr->fileblock_amount;
-    fba_failed = false;
+  h = sr->header_mem;
+  sr->header_dirty = false;
+  write_unlock(&sr->fileblock_amount_lock);
+
+  if (dirty && kernel_write(sr->storage_file, &h, sr->header_size, &pos) !=
+      sr->header_size) {
+    write_lock(&sr->fileblock_amount_lock);
+    sr->header_dirty = true;
+    write_unlock(&sr->fileblock_amount_lock);
+    res = -EFAULT;
+  }
+  mutex_unlock(&sr->header_flush_lock);
+  return res;
+}
+
+
+/*! Отложенная запись хедера хранилища */
+void HeaderFlushWork(struct work_struct* work) {
+  struct StorageRaw* sr = container_of(to_delayed_work(work), struct StorageRaw,
+      header_flush_work);
+
+  if (FlushStorageHeader(sr)) {
+    pr_warn("tagvfs: ERROR can't write storage header\n");
+  }
+}
+
+
+/*! Расширяем хранилище на группу новых файловых блоков. Блоки дописываются в
+хвост файла одной записью, уже размеченные свободными, и отмечаются свободными
+в карте блоков. Количество блоков в хедере записывается отложенно (см.
+правило восстановления в OpenTagFS). Вызывается под блокировкой alloc_lock
+\param min_amount минимальное количество добавляемых блоков
+\return отрицательный код ошибки. 0 - ошибок нет */
+int GrowFileBlocksWOLock(struct StorageRaw* sr, size_t min_amount) {
+  u64 fba = GetFileBlockAmount(sr);
+  size_t amount;
+  size_t i;
+  void* extent;
+  loff_t pos;
+  int res = 0;
+
+  amount = clamp_t(size_t, div_u64(fba, 8), kFileBlockGrowMin, kFileBlockGrowMax);
+  amount = max(amount, min_amount);
+
+  res = tagfs_block_map_resize(sr->free_blocks, fba + amount);
+  if (res) { return res; }
+
+  extent = kvzalloc(amount * sr->fileblock_size, GFP_KERNEL);
+  if (!extent) { return -ENOMEM; }
+  for (i = 0; i < amount; ++i) {
+    struct FileBlockHeader* bh = extent + i * sr->fileblock_size;
+
+    bh->prev_block_index = cpu_to_le64((u64)(-1));
+    bh->next_block_index = cpu_to_le64((u64)(-1));
   }
+
+  pos = sr->fileblock_table_pos + fba * sr->fileblock_size;
+  if (kernel_write(sr->storage_file, extent, amount * sr->fileblock_size, &pos) !=
+      amount * sr->fileblock_size) {
+    res = -EFAULT;
+    goto ex;
+  }
+
+  write_lock(&sr->fileblock_amount_lock);
+  sr->fileblock_amount = fba + amount;
+  sr->header_dirty = true;
   write_unlock(&sr->fileblock_amount_lock);
-  if (fba_failed) { return kNotFoundIno; }
 
-  // Инициализируем новый блок
-  pos = sr->fileblock_table_pos + (fba - 1) * sr->fileblock_size;
-  bh.prev_block_index = -2;
-  bh.prev_block_index = -1;
-  if (kernel_write(sr->storage_file, &bh, sizeof(bh), &pos) == sizeof(bh)) {
-    v = fba;
+  for (i = 0; i < amount; ++i) {
+    tagfs_block_map_set_free(sr->free_blocks, fba + i);
   }
+  schedule_delayed_work(&sr->header_flush_work, kHeaderFlushDelay);
 
-  return v;
+ex:
+  kvfree(extent);
+  return res;
+}
+
+
+/*! Резервирует файловый блок: объявляет его занятым, но не в составе файла.
+Используется блокировка alloc_lock
+\return номер зарезервированного блока или -1 (kNotFoundIno) в случае ошибки */
+size_t ReserveFileBlock(struct StorageRaw* sr) {
+  size_t ino;
+
+  mutex_lock(&sr->alloc_lock);
+  // Возьмём существующий незанятый файловый блок
+  ino = tagfs_block_map_take_free(sr->free_blocks);
+  if (ino == kNotFoundIno && GrowFileBlocksWOLock(sr, 1) == 0) {
+    // Свободных блоков нет - расширили хранилище
+    ino = tagfs_block_map_take_free(sr->free_blocks);
+  }
+  mutex_unlock(&sr->alloc_lock);
+  return ino;
+}
+
+
+/*! Резервирует непрерывную последовательность файловых блоков. Если такой
+последовательности нет, то хранилище расширяется (новая группа блоков в хвосте
+хранилища непрерывна). Используется блокировка alloc_lock
+\param amount количество блоков
+\return номер первого блока или kNotFoundIno в случае ошибки */
+size_t ReserveFileBlockRun(struct StorageRaw* sr, size_t amount) {
+  size_t start;
+
+  mutex_lock(&sr->alloc_lock);
+  start = tagfs_block_map_take_run(sr->free_blocks, amount);
+  if (start == kNotFoundIno && GrowFileBlocksWOLock(sr, amount) == 0) {
+    start = tagfs_block_map_take_run(sr->free_blocks, amount);
+  }
+  mutex_unlock(&sr->alloc_lock);
+  return start;
+}
+
+
+/*! Вернуть зарезервированные блоки в карту свободных блоков (блоки в
+хранилище уже размечены свободными или не менялись). Используется блокировка alloc_lock
+\param start, amount первый блок и количество блоков */
+void ReleaseFileBlockRun(struct StorageRaw* sr, size_t start, size_t amount) {
+  size_t i;
+
+  mutex_lock(&sr->alloc_lock);
+  for (i = 0; i < amount; ++i) {
+    tagfs_block_map_set_free(sr->free_blocks, start + i);
+  }
+  mutex_unlock(&sr->alloc_lock);
 }
 
 
@@ -354,7 +962,6 @@ int ReadTagNameFromStorage(struct StorageRaw* sr, size_t tag, struct qstr* name)
   struct TagHeader* th;
   loff_t pos;
   int res = 0;
-  size_t rs;
 
   if (unlikely(!name)) { return -EINVAL; }
   if (unlikely(name->name || name->len)) { return -EINVAL; }
@@ -365,14 +972,11 @@ int ReadTagNameFromStorage(struct StorageRaw* sr, size_t tag, struct qstr* name)
   tag_info = kzalloc(sr->tag_record_size, GFP_KERNEL);
   if (!tag_info) { return -ENOMEM; }
 
-  read_lock(&sr->tag_lock);
+  down_read(TagLock(sr, tag));
 
   pos = sr->tag_table_pos + tag * sr->tag_record_size;
-  rs = kernel_read(sr->storage_file, tag_info, sr->tag_record_size, &pos);
-  if (rs != sr->tag_record_size) {
-    res = -EFAULT;
-    goto err;
-  }
+  res = ReadStorageCached(sr, pos, tag_info, sr->tag_record_size);
+  if (res) { goto err; }
   th = (struct TagHeader*)(tag_info);
   if ((th->tag_name_size + sizeof(struct TagHeader)) > sr->tag_record_size) {
     res = -EFAULT;
@@ -381,6 +985,15 @@ int ReadTagNameFromStorage(struct StorageRaw* sr, size_t tag, struct qstr* name)
 
   if (th->tag_flags != kTagFlagActive) {
     tagfs_insert_item(sr->tag_cache, tag, get_null_qstr(), NULL, NULL); // Результат не проверяется, т.к. смысла нет
+    if (th->tag_flags == kTagFlagBlocked) {
+      // Удаление тэга было прервано
+      mutex_lock(&sr->blocked_lock);
+      if (!tagmask_check_tag(sr->blocked_tags, tag)) {
+        tagmask_set_tag(&sr->blocked_tags, tag, true);
+        ++sr->blocked_amount;
+      }
+      mutex_unlock(&sr->blocked_lock);
+    }
     res = -ENOENT;
     goto err;
   }
@@ -390,7 +1003,7 @@ int ReadTagNameFromStorage(struct StorageRaw* sr, size_t tag, struct qstr* name)
 
   // -----------------
 err:
-  read_unlock(&sr->tag_lock);
+  up_read(TagLock(sr, tag));
   kfree(tag_info);
   return res;
 }
@@ -450,121 +1063,299 @@ int ReadTagName(struct StorageRaw* sr, size_t tag, struct qstr* name) {
 }
 
 
-/*! Вычитывает информацию о файле по номеру (ino). Для данных выделяется блок
- памяти. Здесь кэш не используется. Блокировка на файловую область не ставится.
-\param stor описатель хранилища
-\param ino номер файла
-\param data указатель на возвращаемый буфер с данными. Должно быть *data == NULL
-\param data_size указатель на размер данных
-\return 0 - если всё хорошо. Иначе отрицательный код ошибки (-ENOENT - файл не существует) */
-int AllocateReadFileDataWOLock(struct StorageRaw* sr, size_t ino, void** data,
-                         size_t* data_size) {
-  struct FileBlockHeader* block = NULL;
-  loff_t pos;
-  size_t rs;
-  int res = 0;
-  size_t cur_nod;
-  size_t prev_nod;
-  size_t block_counter;
-
-  if (!sr || !sr->storage_file) { return -EINVAL; }
-  if (!data || *data) { return -EINVAL; }
-  if (!data_size) { return -EINVAL; }
-  if (ino >= GetFileBlockAmount(sr)) { return -EINVAL; }
-  if (sr->fileblock_size <= sizeof(struct FileBlockHeader)) { return -EINVAL; }
-
-  *data_size = 0;
-
-  block = kmalloc(sr->fileblock_size, GFP_KERNEL);
-  if (!block) { return -ENOMEM; }
-
-  prev_nod = ino;
-  cur_nod = ino;
-  block_counter = 0;
-  while (block_counter < kMaxFileBlocks) {
-    size_t new_size;
-    size_t add_size;
-    size_t next_block;
-
-    pos = sr->fileblock_table_pos + cur_nod * sr->fileblock_size;
-    rs = kernel_read(sr->storage_file, block, sr->fileblock_size, &pos);
-    if (rs != sr->fileblock_size) {
-      res = -EFAULT;
-      goto err_allmem;
+/*! Увеличить буфер чтения файловой записи до размера не меньше need.
+Начало буфера (keep байт) сохраняется. Общий буфер хранилища растёт только до
+kReadBufferMax: для большей записи выделяется отдельный буфер, а общий
+освобождается для других чтений
+\param shared признак, что используется общий буфер хранилища. Сбрасывается
+при переходе на отдельный буфер
+\param buf, buf_size буфер и его текущий размер
+\return отрицательный код ошибки. 0 - ошибок нет */
+int EnsureReadBuffer(struct StorageRaw* sr, bool* shared, void** buf,
+    size_t* buf_size, size_t keep, size_t need) {
+  void* nb;
+
+  if (need <= *buf_size) { return 0; }
+
+  nb = kvmalloc(need, GFP_KERNEL);
+  if (!nb) { return -ENOMEM; }
+  if (keep) {
+    memcpy(nb, *buf, keep);
+  }
+  if (*shared && need > kReadBufferMax) {
+    mutex_unlock(&sr->read_buffer_lock);
+    *shared = false;
+  } else {
+    kvfree(*buf);
+    if (*shared) {
+      sr->read_buffer = nb;
+      sr->read_buffer_size = need;
     }
+  }
+  *buf = nb;
+  *buf_size = need;
+  return 0;
+}
 
-    if (block_counter == 0 &&
-        (block->prev_block_index == -1 || block->prev_block_index == -2)) {
-      // Этот файл не существует или занят
-      return -ENOENT;
-      goto err_allmem;
-    }
-    if (block->prev_block_index != prev_nod) {
-      res = -ESPIPE;
-      goto err_allmem;
-    }
 
-    add_size = sr->fileblock_size - sizeof(struct FileBlockHeader);
-    new_size = *data_size + add_size;
-    *data = krealloc(*data, new_size, GFP_KERNEL);
-    if (!*data) {
-      res = -ENOMEM;
-      goto err_allmem;
-    }
+/*! Проверить заголовок очередного блока цепочки
+\param bh заголовок проверяемого блока
+\param block номер проверяемого блока
+\param prev номер предыдущего блока (для первого блока - номер самого блока)
+\return отрицательный код ошибки. 0 - блок правильный */
+int CheckChainBlock(const struct FileBlockHeader* bh, size_t block, size_t prev) {
+  if (block == prev && le64_to_cpu(bh->prev_block_index) != block) {
+    // Блок свободен, занят или это не первый блок цепочки - такого файла нет
+    return -ENOENT;
+  }
+  if (le64_to_cpu(bh->prev_block_index) != prev) { return -ESPIPE; }
+  return 0;
+}
 
-    memcpy(*data + *data_size, ((u8*)block) + sizeof(struct FileBlockHeader),
-        add_size);
-    *data_size = new_size;
 
-    // Найдём следующий блок
-    next_block = block->next_block_index;
-    if (next_block == cur_nod) {
-      // Это был последний блок
-      break;
-    }
-    if (next_block == (size_t)(-1)) {
-      res = -ESPIPE;
-      goto err_allmem;
-    }
+/*! Выдать связи блока цепочки. Связи берутся из карты блоков, а если их там
+нет - читаются из заголовка блока (и запоминаются в карте, если это блок
+цепочки). Вызывается под блокировкой записи, которой принадлежит блок
+\param block номер блока
+\param link возвращает связи блока (для свободных и служебных блоков - метки
+из заголовка)
+\return отрицательный код ошибки. 0 - ошибок нет */
+int GetBlockLinkWOLock(struct StorageRaw* sr, size_t block, struct BlockLink* link) {
+  struct FileBlockHeader h;
+  u64 fba = GetFileBlockAmount(sr);
+  bool known;
+  int res;
 
-    prev_nod = cur_nod;
-    cur_nod = next_block;
-  }
+  mutex_lock(&sr->alloc_lock);
+  known = tagfs_block_map_get_link(sr->free_blocks, block, link);
+  mutex_unlock(&sr->alloc_lock);
+  if (known) { return 0; }
 
-  if (block_counter >= kMaxFileBlocks) {
-    res = -EFBIG;
-    goto err_allmem;
+  res = ReadStorageCached(sr, sr->fileblock_table_pos + block * sr->fileblock_size,
+      &h, sizeof(h));
+  if (res) { return res; }
+  link->prev = le64_to_cpu(h.prev_block_index);
+  link->next = le64_to_cpu(h.next_block_index);
+  if (link->prev < fba && link->next < fba) {
+    mutex_lock(&sr->alloc_lock);
+    tagfs_block_map_set_link(sr->free_blocks, block, link->prev, link->next);
+    mutex_unlock(&sr->alloc_lock);
   }
-
-  kfree(block);
   return 0;
+}
 
-  // ----------
-err_allmem:
-  if (*data) {
-    kfree(*data);
-    *data = NULL;
-    *data_size = 0;
+
+/*! Запомнить в карте блоков связи цепочки (после записи её заголовков)
+\param blocks, amount блоки цепочки по порядку. Первый блок - номер файла */
+void SetChainLinks(struct StorageRaw* sr, const size_t* blocks, size_t amount) {
+  size_t i;
+
+  mutex_lock(&sr->alloc_lock);
+  for (i = 0; i < amount; ++i) {
+    tagfs_block_map_set_link(sr->free_blocks, blocks[i], i ? blocks[i - 1] : blocks[0],
+        i + 1 < amount ? blocks[i + 1] : blocks[i]);
   }
-  kfree(block);
-  return res;
+  mutex_unlock(&sr->alloc_lock);
 }
 
 
-/*! Освобождаем блок памяти с данными о файле, выделенный функцией
-AllocateReadFileDataWOLock */
-void FreeFileData(void** data, size_t* data_size) {
-  if (data) {
-    kfree(*data);
-    *data = NULL;
-  }
-  if (data_size) {
-    *data_size = 0;
-  }
+/*! Выдать размер поля тэгов файловой записи в байтах
+\param field_size значение поля FileHeader::tags_field_size
+\return размер поля тэгов */
+size_t TagFieldLen(__le16 field_size) {
+  return le16_to_cpu(field_size) & kTagsFieldSizeMask;
 }
 
 
-/*! Вычитываем информацию о файле из хранилища. Ставит блокировку на файловый блок
+/*! Вычитывает информацию о файле по номеру (ino). Здесь кэш не используется.
+Блокировка на файловую область не ставится.
+Размер записи определяется по полям FileHeader первого блока, поэтому буфер
+выделяется один раз. Если блоки записи идут в хранилище подряд, то все они
+читаются одним обращением. Для чтения используется общий буфер хранилища
+(если он не занят другим чтением и запись в нём помещается), иначе буфер
+выделяется. После использования данные нужно освободить через FreeFileData
+\param ino номер файла
+\param fd возвращаемые данные записи. Должно быть fd->data == NULL
+\return 0 - если всё хорошо. Иначе отрицательный код ошибки (-ENOENT - файл не существует) */
+int AllocateReadFileDataWOLock(struct StorageRaw* sr, size_t ino,
+    struct FileData* fd) {
+  const size_t hsize = sizeof(struct FileBlockHeader);
+  size_t bs;
+  size_t payload;
+  struct FileBlockHeader* bh;
+  const struct FileHeader* fh;
+  void* buf = NULL;
+  size_t buf_size = 0;
+  bool shared;
+  size_t record_size;
+  size_t blocks;
+  size_t cur_nod;
+  size_t i;
+  loff_t pos;
+  int res = 0;
+
+  if (!sr || !sr->storage_file) { return -EINVAL; }
+  if (!fd || fd->data) { return -EINVAL; }
+  if (ino >= GetFileBlockAmount(sr)) { return -EINVAL; }
+  if (sr->fileblock_size < hsize + sizeof(struct FileHeader)) { return -EINVAL; }
+
+  bs = sr->fileblock_size;
+  payload = bs - hsize;
+  fd->size = 0;
+
+  shared = mutex_trylock(&sr->read_buffer_lock);
+  if (shared) {
+    buf = sr->read_buffer;
+    buf_size = sr->read_buffer_size;
+  }
+
+  // Первый блок: по нему определяется размер всей записи
+  res = EnsureReadBuffer(sr, &shared, &buf, &buf_size, 0, bs);
+  if (res) { goto err; }
+  res = ReadStorageCached(sr, sr->fileblock_table_pos + ino * bs, buf, bs);
+  if (res) { goto err; }
+  res = CheckChainBlock(buf, ino, ino);
+  if (res) { goto err; }
+
+  fh = buf + hsize;
+  record_size = sizeof(struct FileHeader) + TagFieldLen(fh->tags_field_size) +
+      le16_to_cpu(fh->link_name_size) + le32_to_cpu(fh->link_target_size);
+  blocks = DIV_ROUND_UP(record_size, payload);
+  if (blocks > kMaxFileBlocks) {
+    res = -EFBIG;
+    goto err;
+  }
+
+  res = EnsureReadBuffer(sr, &shared, &buf, &buf_size, bs, blocks * bs);
+  if (res) { goto err; }
+
+  // Остальные блоки. Сначала пробуем прочитать их одним куском, считая, что
+  // они идут подряд за первым. Если цепочка где-то отклоняется, то с этого
+  // места блоки дочитываются по одному
+  i = 1;
+  cur_nod = ino;
+  bh = buf;
+  if (blocks > 1 && le64_to_cpu(bh->next_block_index) == ino + 1 &&
+      ino + blocks <= GetFileBlockAmount(sr)) {
+    size_t len = (blocks - 1) * bs;
+
+    pos = sr->fileblock_table_pos + (ino + 1) * bs;
+    tagfs_journal_read_begin(sr->journal);
+    if (kernel_read(sr->storage_file, buf + bs, len, &pos) != len) { len = 0; }
+    tagfs_journal_read_end(sr->journal, pos - len, buf + bs, len);
+    if (len) {
+      for (; i < blocks; ++i) {
+        struct FileBlockHeader* prev_bh = buf + (i - 1) * bs;
+
+        if (le64_to_cpu(prev_bh->next_block_index) != cur_nod + 1) { break; }
+        if (CheckChainBlock(buf + i * bs, cur_nod + 1, cur_nod)) { break; }
+        ++cur_nod;
+      }
+    }
+  }
+
+  for (; i < blocks; ++i) {
+    size_t next_block = le64_to_cpu(((struct FileBlockHeader*)(buf + (i - 1) * bs))->next_block_index);
+
+    if (next_block == cur_nod || next_block == (size_t)(-1) ||
+        next_block >= GetFileBlockAmount(sr)) {
+      // Цепочка закончилась раньше, чем указано в заголовке записи
+      res = -ESPIPE;
+      goto err;
+    }
+
+    res = ReadStorageCached(sr, sr->fileblock_table_pos + next_block * bs,
+        buf + i * bs, bs);
+    if (res) { goto err; }
+    res = CheckChainBlock(buf + i * bs, next_block, cur_nod);
+    if (res) { goto err; }
+    cur_nod = next_block;
+  }
+
+  // Уберём заголовки блоков: данные записи собираются в начале буфера
+  for (i = 0; i < blocks; ++i) {
+    memmove(buf + i * payload, buf + i * bs + hsize, payload);
+  }
+
+  fd->data = buf;
+  fd->size = blocks * payload;
+  fd->shared = shared;
+  return 0;
+
+  // ----------
+err:
+  if (shared) {
+    mutex_unlock(&sr->read_buffer_lock);
+  } else {
+    kvfree(buf);
+  }
+  return res;
+}
+
+
+/*! Освобождаем блок памяти с данными о файле, выделенный функцией
+AllocateReadFileDataWOLock */
+void FreeFileData(struct StorageRaw* sr, struct FileData* fd) {
+  if (fd->data) {
+    if (fd->shared) {
+      // Общий буфер хранилища не удаляется, а освобождается для других чтений
+      mutex_unlock(&sr->read_buffer_lock);
+    } else {
+      kvfree(fd->data);
+    }
+    fd->data = NULL;
+  }
+  fd->size = 0;
+  fd->shared = false;
+}
+
+
+/*! Разобрать данные файловой записи. Имя и целевая ссылка указывают на данные
+записи (копии не создаются). Маска тэгов заимствует данные записи, если поле
+тэгов хранится маской, или собирается из разреженного набора тэгов
+\param data, data_size данные записи (объединённые данные цепочки блоков)
+\param tags_amount количество тэгов хранилища (размер собираемой маски)
+\param tag_mask возвращает маску тэгов записи. Маску нужно удалить
+\param link_name, link_target возвращают имя и целевую ссылку файла
+\return отрицательный код ошибки (-EFAULT - записи не хватает данных). Нет ошибок - 0 */
+int ParseFileRecord(void* data, size_t data_size, size_t tags_amount,
+    struct TagMask* tag_mask, struct qstr* link_name, struct qstr* link_target) {
+  struct FileHeader* fh;
+  size_t tagpos, namepos, targetpos;
+  size_t taglen, namelen, targetlen;
+
+  fh = (struct FileHeader*)(data);
+  tagpos = sizeof(struct FileHeader);
+  if (tagpos > data_size) { return -EFAULT; }
+
+  taglen = TagFieldLen(fh->tags_field_size);
+  namepos = tagpos + taglen;
+  namelen = le16_to_cpu(fh->link_name_size);
+  targetpos = namepos + namelen;
+  targetlen = le32_to_cpu(fh->link_target_size);
+  if ((targetpos + targetlen) > data_size) { return -EFAULT; }
+
+  if (le16_to_cpu(fh->tags_field_size) & kTagsFieldSparse) {
+    const __le16* tags = data + tagpos;
+    size_t i;
+
+    *tag_mask = tagmask_init_zero(tags_amount);
+    if (tagmask_is_empty(*tag_mask) && tags_amount) { return -ENOMEM; }
+    for (i = 0; i < taglen / sizeof(__le16); ++i) {
+      tagmask_set_tag(tag_mask, le16_to_cpu(tags[i]), true);
+    }
+  } else {
+    *tag_mask = tagmask_borrow(data + tagpos, taglen);
+  }
+  link_name->name = data + namepos;
+  link_name->len = namelen;
+  link_target->name = data + targetpos;
+  link_target->len = targetlen;
+  return 0;
+}
+
+
+/*! Вычитываем информацию о файле из хранилища. Ставит блокировку на файловый блок
 \param ino номер файла
 \param tag_mask указатель на заполняемое поле маски (на вход должна быть пустая). Может быть NULL.
 \param link_name указатель на заполняемое поле имени (на вход должно быть пустое). Может быть NULL.
@@ -572,21 +1363,19 @@ void FreeFileData(void** data, size_t* data_size) {
 \return отрицательный код ошибки (-ENOENT - файл не существует). Нет ошибок - 0 */
 int ReadFileInfoFromStorage(struct StorageRaw* sr, size_t ino,
     struct TagMask* tag_mask, struct qstr* link_name, struct qstr* link_target) {
-  void* data = NULL;
-  size_t data_size = 0;
+  struct FileData fd = { NULL, 0, false };
   int res;
-  struct FileHeader* fh;
-  size_t tagpos, namepos, targetpos;
-  size_t taglen, namelen, targetlen;
+  struct TagMask mask;
+  struct qstr name, target;
 
   BUG_ON(!sr);
   BUG_ON(tag_mask && !tagmask_is_empty(*tag_mask));
   BUG_ON(link_name && !qstr_is_empty(*link_name));
   BUG_ON(link_target && !qstr_is_empty(*link_target));
 
-  read_lock(&sr->fileblock_lock);
-  res = AllocateReadFileDataWOLock(sr, ino, &data, &data_size);
-  read_unlock(&sr->fileblock_lock);
+  down_read(RecordLock(sr, ino));
+  res = AllocateReadFileDataWOLock(sr, ino, &fd);
+  up_read(RecordLock(sr, ino));
   if (res) {
     if (res != -ENOENT) {
       pr_info("debug Can't read file %u and got error %d\n", (unsigned int)ino, res);
@@ -594,77 +1383,267 @@ int ReadFileInfoFromStorage(struct StorageRaw* sr, size_t ino,
     return res;
   }
 
-  fh = (struct FileHeader*)(data);
-  tagpos = sizeof(struct FileHeader);
-  if (tagpos > data_size) {
-    res = -EFAULT;
-    goto err;
-  }
-
-  taglen = le16_to_cpu(fh->tags_field_size);
-  namepos = tagpos + taglen;
-  namelen = le16_to_cpu(fh->link_name_size);
-  targetpos = namepos + namelen;
-  targetlen = le32_to_cpu(fh->link_target_size);
-  if ((targetpos + targetlen) > data_size) {
-    res = -EFAULT;
-    goto err;
-  }
+  res = ParseFileRecord(fd.data, fd.size, sr->tag_record_max_amount, &mask,
+      &name, &target);
+  if (res) { goto err; }
 
   if (tag_mask) {
     *tag_mask = tagmask_init_zero(sr->tag_record_max_amount);
-    tagmask_fill_from_buffer(*tag_mask, data + tagpos, taglen);
+    tagmask_fill_from_buffer(tag_mask, tagmask_const_data(&mask), mask.byte_len);
   }
+  tagmask_release(&mask);
 
   if (link_name) {
-    *link_name = alloc_qstr_from_str(data + namepos, namelen);
+    *link_name = alloc_qstr_from_qstr(name);
   }
 
   if (link_target) {
-    *link_target = alloc_qstr_from_str(data + targetpos, targetlen);
+    *link_target = alloc_qstr_from_qstr(target);
   }
 
   // -----------------
 err:
-  FreeFileData(&data, &data_size);
+  FreeFileData(sr, &fd);
   return res;
 }
 
 
-/*! Вычитаем информацию о всех файлах в кэш */
-void ReadAllFilesToCache(struct StorageRaw* sr) {
-  size_t ino;
-  size_t max_ino = GetFileBlockAmount(sr);
+/*! Загрузить файловую запись в таблицу файлов (без индекса тэгов). Если запись
+целиком помещается в первый блок, то она разбирается из уже прочитанных данных.
+Иначе вся цепочка блоков дочитывается из хранилища
+\param ino номер файла
+\param payload, payload_size данные первого блока (без заголовка блока). Если
+у файла несколько блоков, то payload_size равен 0
+\return отрицательный код ошибки. Нет ошибок - 0 */
+int LoadFileRecord(struct StorageRaw* sr, size_t ino, void* payload,
+    size_t payload_size) {
+  struct FileData fd = { NULL, 0, false };
+  struct TagMask mask;
+  struct qstr name, target;
+  int res;
 
-  for (ino = 0; ino < max_ino; ++ino) {
-    struct qstr name = get_null_qstr();
-    struct FileData* fd = kzalloc(sizeof(struct FileData), GFP_KERNEL);
-    int res;
+  res = ParseFileRecord(payload, payload_size, sr->tag_record_max_amount, &mask,
+      &name, &target);
+  if (res == -EFAULT) {
+    // Запись не помещается в один блок
+    down_read(RecordLock(sr, ino));
+    res = AllocateReadFileDataWOLock(sr, ino, &fd);
+    up_read(RecordLock(sr, ino));
+    if (res) { return res; }
+    res = ParseFileRecord(fd.data, fd.size, sr->tag_record_max_amount, &mask,
+        &name, &target);
+  }
 
-    if (!fd) {
-      pr_warn("tagvfs: ERROR no mem for file caching\n");
-      return;
-    }
+  if (!res) {
+    res = tagfs_file_table_insert(sr->file_table, ino, name, target, mask);
+    tagmask_release(&mask);
+  }
+  FreeFileData(sr, &fd);
+  return res;
+}
 
-    fd->tag_mask = tagmask_empty();
-    fd->link_target = get_null_qstr();
 
-    res = ReadFileInfoFromStorage(sr, ino, &fd->tag_mask, &name, &fd->link_target);
-    if (res) {
-      if (res != -ENOENT) {
-        pr_warn("tagvfs: ERROR Can't read file with ino %u\n", (unsigned int)ino);
+/*! Поток загрузки части таблицы файловых блоков */
+struct LoadWorker {
+  struct work_struct work;
+  struct StorageRaw* sr;
+  u64 from; //!< Первый блок части
+  u64 to; //!< Блок после последнего блока части
+  int res;
+};
+
+
+/*! Загрузить часть таблицы файловых блоков: блоки читаются крупными порциями,
+свободные блоки отмечаются в карте блоков, файловые записи загружаются в
+таблицу файлов. Блоки, зарезервированные, но не попавшие в файл (например,
+при сбое), тоже считаются свободными */
+void LoadFileBlocksPart(struct work_struct* work) {
+  struct LoadWorker* lw = container_of(work, struct LoadWorker, work);
+  struct StorageRaw* sr = lw->sr;
+  size_t bs = sr->fileblock_size;
+  size_t chunk_blocks = max_t(size_t, kLoadChunkSize / bs, 1);
+  u64 fba = GetFileBlockAmount(sr);
+  void* chunk;
+  u64 base;
+
+  lw->res = 0;
+  chunk = kvmalloc(chunk_blocks * bs, GFP_KERNEL);
+  if (!chunk) {
+    lw->res = -ENOMEM;
+    return;
+  }
+
+  for (base = lw->from; base < lw->to; base += chunk_blocks) {
+    size_t amount = min_t(u64, chunk_blocks, lw->to - base);
+    size_t i;
+    loff_t pos = sr->fileblock_table_pos + base * bs;
+
+    if (READ_ONCE(sr->files_load_stop)) {
+      lw->res = -EINTR;
+      break;
+    }
+    tagfs_journal_read_begin(sr->journal);
+    if (kernel_read(sr->storage_file, chunk, amount * bs, &pos) != amount * bs) {
+      tagfs_journal_read_end(sr->journal, pos, chunk, 0);
+      lw->res = -EFAULT;
+      break;
+    }
+    tagfs_journal_read_end(sr->journal, pos - amount * bs, chunk, amount * bs);
+
+    // Карту блоков заполняют все потоки, а при ленивом монтировании её меняют
+    // и выделения блоков - порция отмечается под alloc_lock
+    mutex_lock(&sr->alloc_lock);
+    for (i = 0; i < amount; ++i) {
+      struct FileBlockHeader* bh = chunk + i * bs;
+      u64 block = base + i;
+
+      if (bh->prev_block_index == -1 || bh->prev_block_index == -2) {
+        tagfs_block_map_set_free(sr->free_blocks, block);
+      } else if (le64_to_cpu(bh->prev_block_index) == kServiceBlockMark ||
+          le64_to_cpu(bh->prev_block_index) == kPostingsBlockMark) {
+        // Блок индекса имён или тэгов (индексы больше не хранятся)
+        tagfs_block_map_set_free(sr->free_blocks, block);
+      } else if (le64_to_cpu(bh->prev_block_index) == kJournalBlockMark &&
+          !tagfs_journal_owns_block(sr->journal, block)) {
+        tagfs_block_map_set_free(sr->free_blocks, block);
+      } else if (le64_to_cpu(bh->prev_block_index) < fba &&
+          le64_to_cpu(bh->next_block_index) < fba) {
+        // Блок цепочки: связи запоминаются, чтобы менять цепочку без чтения заголовков
+        tagfs_block_map_set_link(sr->free_blocks, block,
+            le64_to_cpu(bh->prev_block_index), le64_to_cpu(bh->next_block_index));
       }
+    }
+    mutex_unlock(&sr->alloc_lock);
 
-      kfree(fd);
-      continue;
+    for (i = 0; i < amount; ++i) {
+      struct FileBlockHeader* bh = chunk + i * bs;
+      size_t payload_size = 0;
+      int res;
+
+      if (le64_to_cpu(bh->prev_block_index) != base + i) { continue; } // Не первый блок файла
+      if (le64_to_cpu(bh->next_block_index) == base + i) {
+        // Файл из одного блока - запись разбирается из прочитанной порции
+        payload_size = bs - sizeof(struct FileBlockHeader);
+      }
+      res = LoadFileRecord(sr, base + i, chunk + i * bs + sizeof(struct FileBlockHeader),
+          payload_size);
+      if (res) {
+        pr_warn("tagvfs: ERROR %d in loading file with ino %u\n", res,
+            (unsigned int)(base + i));
+      }
     }
+  }
 
-    res = tagfs_insert_item(sr->file_cache, ino, name, fd, FileDataRemover);
-    free_qstr(&name);
+  kvfree(chunk);
+}
+
+
+/*! Загрузить таблицу файловых блоков при открытии хранилища: построить карту
+свободных блоков, таблицу файлов и индекс тэгов. Таблица блоков делится на
+части, которые загружаются параллельно (по потоку на часть). Индекс тэгов
+заполняется после загрузки, по возрастанию номеров файлов
+\return отрицательный код ошибки. 0 - ошибок нет */
+int LoadAllFileBlocks(struct StorageRaw* sr) {
+  u64 fba = GetFileBlockAmount(sr);
+  struct LoadWorker* workers;
+  size_t workers_amount;
+  u64 part;
+  size_t i;
+  size_t ino;
+  int res;
+
+  if (sr->fileblock_size < sizeof(struct FileBlockHeader) + sizeof(struct FileHeader)) {
+    return -EINVAL;
+  }
+
+  res = tagfs_block_map_resize(sr->free_blocks, fba);
+  if (res) { return res; }
+  res = tagfs_file_table_reserve(sr->file_table, fba);
+  if (res) { return res; }
+
+  // Части выравниваются так, чтобы потоки не делили слова карты свободных блоков
+  workers_amount = clamp_t(size_t, div64_u64(fba, kLoadPartitionMin), 1,
+      min_t(size_t, num_online_cpus(), kLoadWorkersMax));
+  part = roundup(DIV_ROUND_UP_ULL(fba, workers_amount), kLoadPartitionMin);
+
+  workers = kcalloc(workers_amount, sizeof(struct LoadWorker), GFP_KERNEL);
+  if (!workers) { return -ENOMEM; }
+  for (i = 0; i < workers_amount; ++i) {
+    workers[i].sr = sr;
+    workers[i].from = min_t(u64, i * part, fba);
+    workers[i].to = min_t(u64, (i + 1) * part, fba);
+    INIT_WORK(&workers[i].work, LoadFileBlocksPart);
+  }
+
+  // Первая часть загружается в текущем потоке, остальные - в рабочих
+  for (i = 1; i < workers_amount; ++i) {
+    queue_work(system_unbound_wq, &workers[i].work);
+  }
+  LoadFileBlocksPart(&workers[0].work);
+  for (i = 0; i < workers_amount; ++i) {
+    if (i) { flush_work(&workers[i].work); }
+    if (workers[i].res && !res) { res = workers[i].res; }
+  }
+  kfree(workers);
+  if (res) { return res; }
+
+  for (ino = 0; ino < fba; ++ino) {
+    struct TagMask mask = tagmask_empty();
+
+    if (tagfs_file_table_get(sr->file_table, ino, get_null_qstr(), NULL, NULL,
+        &mask, NULL)) { continue; }
+    res = tagfs_index_add_file(sr->file_index, ino, mask);
     if (res) {
-      pr_warn("tagvfs: ERROR can't caching file info for ino %u\n", (unsigned int)ino);
+      pr_warn("tagvfs: ERROR %d in indexing file with ino %u\n", res, (unsigned int)ino);
     }
+    tagmask_release(&mask);
+  }
+
+  return 0;
+}
+
+
+/*! Продолжить удаление тэгов, прерванное при прошлом закрытии хранилища
+(тэги с флагом kTagFlagBlocked найдены при чтении таблицы тэгов). Вызывается
+после успешной загрузки файловых блоков */
+void ResumeTagSweep(struct StorageRaw* sr) {
+  bool blocked;
+
+  if (sr->read_only) { return; }
+  mutex_lock(&sr->blocked_lock);
+  blocked = sr->blocked_amount != 0;
+  mutex_unlock(&sr->blocked_lock);
+  if (blocked) { queue_work(system_unbound_wq, &sr->tag_sweep_work); }
+}
+
+
+/*! Фоновая загрузка файловых блоков (отложенная загрузка при монтировании) */
+void FilesLoadWork(struct work_struct* work) {
+  struct StorageRaw* sr = container_of(work, struct StorageRaw, files_load_work);
+
+  sr->files_load_res = LoadAllFileBlocks(sr);
+  if (sr->files_load_res && sr->files_load_res != -EINTR) {
+    pr_warn("tagvfs: ERROR %d in background loading of files. Storage is read-only\n",
+        sr->files_load_res);
   }
+  complete_all(&sr->files_loaded);
+  if (!sr->files_load_res) { ResumeTagSweep(sr); }
+}
+
+
+/*! Проверить, что файловые блоки уже загружены (без ожидания) */
+bool FilesLoaded(struct StorageRaw* sr) {
+  return completion_done(&sr->files_loaded);
+}
+
+
+/*! Дождаться завершения загрузки файловых блоков. Вызывается перед
+операциями, которым нужны все файлы: поиск по имени, перебор файлов, изменения
+\return отрицательный код ошибки загрузки (изменять хранилище в этом случае
+нельзя: карта свободных блоков неполная). 0 - все файлы загружены */
+int WaitFilesLoaded(struct StorageRaw* sr) {
+  wait_for_completion(&sr->files_loaded);
+  return sr->files_load_res;
 }
 
 
@@ -680,360 +1659,648 @@ int GetFileInfo(struct StorageRaw* sr, size_t ino, const struct qstr name,
     size_t* found_ino, struct qstr* found_name, struct TagMask* tag_mask,
     struct qstr* link_target) {
   int res;
-  CacheIterator item = NULL;
 
   WARN_ON(!sr);
 
-  if (ino != kNotFoundIno) {
-    item = tagfs_get_item_by_ino(sr->file_cache, ino);
-  } else {
-    item = tagfs_get_item_by_name(sr->file_cache, name);
+  if (ino == kNotFoundIno) {
+    // Поиск по имени возможен только по загруженной таблице
+    WaitFilesLoaded(sr);
   }
-  if (!item) { return -ENOENT; }
+  res = tagfs_file_table_get(sr->file_table, ino, name, found_ino, found_name,
+      tag_mask, link_target);
+  if (res != -ENOENT || ino == kNotFoundIno || FilesLoaded(sr)) { return res; }
 
-  res = -ENOENT;
-  if (item->Name.name && item->Name.len && item->user_data) {
-    // Получили не пустой элемент
-    struct FileData* fd = item->user_data;
+  // Файл ещё не загружен в таблицу - прочитаем его напрямую из хранилища
+  res = ReadFileInfoFromStorage(sr, ino, tag_mask, found_name, link_target);
+  if (!res && found_ino) { *found_ino = ino; }
+  return res;
+}
 
-    if (found_ino) {
-      *found_ino = item->Ino;
-    }
-    if (found_name) {
-      *found_name = alloc_qstr_from_qstr(item->Name);
-    }
-    if (tag_mask) {
-      *tag_mask = tagmask_init_by_mask(fd->tag_mask);
-    }
-    if (link_target) {
-      *link_target = alloc_qstr_from_qstr(fd->link_target);
-    }
 
-    res = 0;
+/*! Записать файловую запись в цепочку блоков. Блоки собираются в одном буфере
+вместе с заголовками, подряд идущие блоки записываются одной записью. Запись
+идёт с конца цепочки, первый блок (номер файла) записывается последним.
+Блокировка не ставится
+\param tx транзакция, в которую добавляется запись
+\param blocks номера блоков цепочки. Первый блок - номер файла
+\param amount количество блоков. Блоки должны вмещать все данные
+\param data, size данные записи
+\return отрицательный код ошибки. 0 - ошибок нет */
+int WriteChainWOLock(struct StorageRaw* sr, struct JournalTx* tx,
+    const size_t* blocks, size_t amount, const void* data, size_t size) {
+  const size_t bs = sr->fileblock_size;
+  const size_t payload = bs - sizeof(struct FileBlockHeader);
+  void* buf;
+  size_t i, end;
+  int res = 0;
+
+  if (amount == 0 || amount * payload < size) { return -EINVAL; }
+  buf = kvmalloc_array(amount, bs, GFP_KERNEL);
+  if (!buf) { return -ENOMEM; }
+
+  for (i = 0; i < amount; ++i) {
+    struct FileBlockHeader* bh = buf + i * bs;
+    size_t offset = min(size, i * payload);
+    size_t len = min(payload, size - offset);
+
+    bh->prev_block_index = cpu_to_le64(i ? blocks[i - 1] : blocks[0]);
+    bh->next_block_index = cpu_to_le64(i + 1 < amount ? blocks[i + 1] : blocks[i]);
+    memcpy((void*)(bh) + sizeof(struct FileBlockHeader), data + offset, len);
+    memset((void*)(bh) + sizeof(struct FileBlockHeader) + len, 0, payload - len);
   }
 
-  tagfs_release_item(item);
+  for (end = amount; end > 0; end = i) {
+    loff_t pos;
+    size_t len;
+
+    for (i = end - 1; i > 0 && blocks[i - 1] + 1 == blocks[i]; --i) {}
+    pos = sr->fileblock_table_pos + blocks[i] * bs;
+    len = (end - i) * bs;
+    res = tagfs_journal_tx_write(tx, pos, buf + i * bs, len);
+    if (res) { break; }
+  }
+  if (!res) { SetChainLinks(sr, blocks, amount); }
+
+  kvfree(buf);
   return res;
 }
 
 
-/*! Резервирует файловый блок: объявляет его занятым, но не в составе файла. Блокировка не ставится
-\return номер зарезервированного блока или -1 (kNotFoundIno) в случае ошибки */
-size_t ReserveFileBlockWOLock(struct StorageRaw* sr) {
-  size_t ino;
+/*! Очищает файловый блок - маркирует как свободный. Также возвращает номер
+блока, который должен продолжать цепочку файловых блоков. Вызывается под
+блокировкой записи (или области), которой принадлежит блок. Связи блока
+берутся из карты блоков (см. GetBlockLinkWOLock), поэтому заголовок блока
+только записывается. Блок возвращается в карту свободных блоков только после
+записи разметки
+\param tx транзакция, в которую добавляется разметка. NULL - разметка
+записывается сразу (блоки служебных областей)
+\param fb_index индекс удаляемого файлового блока
+\param prev_fb_index индекс предыдущего файлового блока. Используется для контроля цепочек блоков.
+\param next_fb индекс файлового блока, который следующий в цепочке. Параметр может быть NULL
+\return отрицательный код ошибки (-EINVAL - несовпадение предыдущего блока). 0 - если ошибок нет */
+int ClearFileBlockWOLock(struct StorageRaw* sr, struct JournalTx* tx,
+    size_t fb_index, size_t prev_fb_index, size_t* next_fb) {
+  struct FileBlockHeader h;
+  struct BlockLink link;
+  loff_t block_pos;
   loff_t pos;
-  struct FileBlockHeader bh;
-  u64 fba = GetFileBlockAmount(sr);
+  size_t ws;
 
-  // Поищем существующий незанятый файловый блок
-  for (ino = sr->min_fileblock_for_seek_empty; ino < fba; ++ino) {
-    CacheIterator item;
-    bool item_active = false;
-    size_t rs;
+  if (GetBlockLinkWOLock(sr, fb_index, &link)) { return -EFAULT; }
+  if (link.prev != prev_fb_index) { return -EINVAL;  }
 
-    item = tagfs_get_item_by_ino(sr->file_cache, ino);
-    if (item) {
-      if (item->Name.name && item->Name.len && item->user_data) {
-        item_active = true;
-      }
-      tagfs_release_item(item);
-    }
-    if (item_active) { continue; }
+  if (next_fb) { *next_fb = link.next; }
 
-    pos = sr->fileblock_table_pos + ino * sr->fileblock_size;
-    rs = kernel_read(sr->storage_file, &bh, sizeof(bh), &pos);
-    if (rs != sizeof(struct FileBlockHeader)) {
-      break;
-    }
-
-    if (bh.prev_block_index == -1) {
-      sr->min_fileblock_for_seek_empty = ino;
-      bh.prev_block_index = -2;
-      if (kernel_write(sr->storage_file, &bh, sizeof(bh), &pos) == sizeof(bh)) {
-        return ino;
-      }
-      return -EFAULT;
-    }
-  }
+  block_pos = sr->fileblock_table_pos + sr->fileblock_size * fb_index;
+  h.prev_block_index = cpu_to_le64((u64)(-1));
+  h.next_block_index = cpu_to_le64((u64)(-1));
+  mutex_lock(&sr->alloc_lock);
+  tagfs_block_map_set_link(sr->free_blocks, fb_index, kNotFoundIno, kNotFoundIno);
+  mutex_unlock(&sr->alloc_lock);
+  if (tx) {
+    int res = tagfs_journal_tx_write(tx, block_pos, &h, sizeof(h));
 
-  // Попробуем добавить новый блок
-  fba = IncFileBlockAmountWOLock(sr);
-  if (IS_ERR_VALUE(fba) || !fba) {
-    WARN_ON(fba == 0);
-    return kNotFoundIno;
+    return res ? res : tagfs_journal_tx_free(tx, fb_index);
   }
+  pos = block_pos;
+  ws = kernel_write(sr->storage_file, &h, sizeof(h), &pos);
+  if (ws != sizeof(h)) { return -EFAULT; }
 
-  ino = fba - 1;
-  return ino;
+  ReleaseFileBlockRun(sr, fb_index, 1);
+  return 0;
 }
 
 
-/*! Записывает часть информации о файле в файловый блок. Блокировка не ставится.
-Если записались все данные (возвращаемое значение равно len), то блок закрывается
-(поле next_block_index выставляется равным самому блоку). Если записались не все
-данные, то индекс следующего блока выставляется в -1 и его нужно явно обновлять.
-\param fb_index индекс файлового блока, куда записываются данные
-\param prev_fb индекс предыдущего файлового блока, используется для построения цепочки блоков
+/*! Переписать (обновить) данные в файловом описателе. Другие данные остаются
+на месте, ничего не сдвигается. Если место записи выходит за границу существующей
+цепочки блоков, то запись прерывается. Функция может вызываться рекурсивно.
+Блокировка не ставится.
+\param tx транзакция, в которую добавляется запись
+\param blockino номер блока, в котором обновляются данные
 \param data данные для записи
-\param len длина данных для записи. Может быть больше, чем вмещается в блок
-\return количество записанных байтов или 0 в случае ошибки */
-size_t WriteFileBlockWOLock(struct StorageRaw* sr, size_t fb_index, size_t prev_fb,
-    void* data, size_t len) {
-  // TODO IMPROVE PERFORMANCE
-  size_t avail;
-  size_t zero_tail;
-  struct FileBlockHeader h;
-  loff_t pos;
+\param data_size размер данных для обновления
+\param data_pos позиция в файловом описателе, где обновлять данные
+\param nest_counter счётчик вложенности вызовов. В начальном вызове должен быть 0
+\return размер обновлённых данных */
+size_t UpdateDataIntoBlockChainWOLock(struct StorageRaw* sr, struct JournalTx* tx,
+    size_t blockino, const void* data, size_t data_size, size_t data_pos,
+    size_t nest_counter) {
+  struct BlockLink link;
+  loff_t block_pos;
   size_t ws;
+  size_t max_data = sr->fileblock_size - sizeof(struct FileBlockHeader);
 
-  if (sr->fileblock_size <= sizeof(struct FileBlockHeader)) {
-    pr_warn("Tagvfs: WARNING: file block size is less than header\n");
-    return 0;
+  if (nest_counter > kMaxFileBlocks) { return 0; }
+
+  block_pos = sr->fileblock_table_pos + sr->fileblock_size * blockino;
+  if (GetBlockLinkWOLock(sr, blockino, &link)) { return 0; }
+
+  if (data_pos < max_data) {
+    size_t tail = max_data - data_pos;
+    if (tail > data_size) {
+      tail = data_size;
+    }
+    if (tagfs_journal_tx_write(tx, block_pos + sizeof(struct FileBlockHeader) + data_pos,
+        data, tail)) {
+      return 0;
+    }
+    ws = tail;
+    if (ws == data_size) { return ws; }
+    if (link.next == blockino) {
+      return ws;
+    }
+
+    return ws + UpdateDataIntoBlockChainWOLock(sr, tx, link.next,
+        data + ws, data_size - ws, 0, nest_counter + 1);
   }
 
-  avail = sr->fileblock_size - sizeof(struct FileBlockHeader);
-  if (avail > len) {
-    avail = len;
+  // Нет записи в текущем блоке. Идём в следующий
+  if (link.next == blockino) { return 0; }
+  return UpdateDataIntoBlockChainWOLock(sr, tx, link.next, data,
+      data_size, data_pos - max_data, nest_counter + 1);
+}
+
+
+/*! Можно ли записывать поля тэгов разреженным набором. Такие поля пишутся в
+хранилища версии 2 с маской тэгов больше kSparseTagsMaskMin (или в хранилища,
+где они уже есть). Флаг kIncompatSparseTags ставится при первой записи
+разреженного поля и сбрасывается на диск раньше самого поля. Блокировки
+записей не должны быть поставлены
+\return true - разреженные поля можно записывать */
+bool UseSparseTags(struct StorageRaw* sr) {
+  bool res;
+
+  if (READ_ONCE(sr->sparse_tags)) { return true; }
+  if (sr->version < 2 || sr->tag_mask_byte_size <= kSparseTagsMaskMin) { return false; }
+
+  mutex_lock(&sr->sparse_tags_lock);
+  if (!sr->sparse_tags) {
+    write_lock(&sr->fileblock_amount_lock);
+    sr->header_mem.incompat_features |= cpu_to_le32(kIncompatSparseTags);
+    sr->header_dirty = true;
+    write_unlock(&sr->fileblock_amount_lock);
+    if (!FlushStorageHeader(sr) &&
+        !vfs_fsync_range(sr->storage_file, 0, sr->header_size - 1, 1)) {
+      WRITE_ONCE(sr->sparse_tags, true);
+    }
   }
-  zero_tail = sr->fileblock_size - sizeof(struct FileBlockHeader) - avail;
+  res = sr->sparse_tags;
+  mutex_unlock(&sr->sparse_tags_lock);
+  return res;
+}
 
-  h.prev_block_index = prev_fb;
-  h.next_block_index = avail == len ? fb_index : -1;
-  pos = sr->fileblock_table_pos + sr->fileblock_size * fb_index;
-  ws = kernel_write(sr->storage_file, &h, sizeof(h), &pos);
-  if (ws != sizeof(h)) {
-    // TODO EROIRO
+
+/*! Подготовить поле тэгов файловой записи. Если тэгов у файла мало и
+разреженные наборы тэгов можно записывать (см. UseSparseTags), то поле -
+отсортированные номера тэгов, иначе - маска тэгов
+\param mask маска тэгов файла
+\param field возвращает данные поля (удаляются через kfree). Для пустого поля NULL
+\param field_len возвращает размер данных поля
+\param field_size возвращает значение для FileHeader::tags_field_size
+\return отрицательный код ошибки. 0 - ошибок нет */
+int ComposeTagField(struct StorageRaw* sr, const struct TagMask mask,
+    void** field, size_t* field_len, u16* field_size) {
+  size_t amount = tagmask_get_tags(mask, NULL, 0);
+
+  *field = NULL;
+  *field_len = 0;
+  *field_size = 0;
+
+  if (amount * sizeof(__le16) < sr->tag_mask_byte_size && UseSparseTags(sr)) {
+    __le16* tags;
+    size_t tag;
+    size_t i = 0;
+
+    if (!amount) { return 0; }
+    tags = kmalloc_array(amount, sizeof(__le16), GFP_KERNEL);
+    if (!tags) { return -ENOMEM; }
+    for (tag = tagmask_next_tag(mask, 0); tag < mask.bit_len && i < amount;
+        tag = tagmask_next_tag(mask, tag + 1)) {
+      tags[i++] = cpu_to_le16(tag);
+    }
+    *field = tags;
+    *field_len = amount * sizeof(__le16);
+    *field_size = *field_len | kTagsFieldSparse;
     return 0;
   }
-  ws = kernel_write(sr->storage_file, data, avail, &pos);
-  if (ws != avail) {
-    // TODO EROIRO
-    return 0;
+
+  *field = kzalloc(sr->tag_mask_byte_size, GFP_KERNEL);
+  if (!*field) { return -ENOMEM; }
+  memcpy(*field, tagmask_const_data(&mask), min(mask.byte_len, sr->tag_mask_byte_size));
+  *field_len = sr->tag_mask_byte_size;
+  *field_size = sr->tag_mask_byte_size;
+  return 0;
+}
+
+
+/*! Переписать файловую запись целиком (например, если изменился размер поля
+тэгов). Номер файла (первый блок) не меняется, блоки прежней цепочки
+используются повторно. Недостающие блоки резервируются, лишние освобождаются.
+Вызывается под блокировкой записи на запись
+\param tx транзакция, в которую добавляется запись
+\param ino номер файла
+\param data, size новые данные записи
+\return отрицательный код ошибки. 0 - ошибок нет */
+int RewriteFileRecordWOLock(struct StorageRaw* sr, struct JournalTx* tx,
+    size_t ino, const void* data, size_t size) {
+  const size_t bs = sr->fileblock_size;
+  const size_t payload = bs - sizeof(struct FileBlockHeader);
+  const size_t need = DIV_ROUND_UP(size, payload);
+  struct BlockLink link;
+  size_t* blocks = NULL;
+  size_t old_amount = 0;
+  size_t amount;
+  size_t cur = ino;
+  size_t prev = ino;
+  size_t i;
+  int res = 0;
+
+  if (need == 0 || need > kMaxFileBlocks) { return -EFBIG; }
+  blocks = kmalloc_array(kMaxFileBlocks, sizeof(size_t), GFP_KERNEL);
+  if (!blocks) {
+    res = -ENOMEM;
+    goto ex;
   }
 
-  if (zero_tail > 0) {
-    void* zero_block = kzalloc(zero_tail, GFP_KERNEL);
-    ws = kernel_write(sr->storage_file, zero_block, zero_tail, &pos);
-    kfree(zero_block);
-    if (ws != zero_tail) {
-      // TODO EROROROOER
-      return 0;
+  // Блоки прежней цепочки (по связям из карты блоков)
+  while (true) {
+    size_t next;
+
+    res = GetBlockLinkWOLock(sr, cur, &link);
+    if (res) { goto ex; }
+    if (link.prev != prev) {
+      res = cur == prev ? -ENOENT : -ESPIPE;
+      goto ex;
     }
+    blocks[old_amount++] = cur;
+    next = link.next;
+    if (next == cur) { break; }
+    if (old_amount >= kMaxFileBlocks || next >= GetFileBlockAmount(sr)) {
+      res = -ESPIPE;
+      goto ex;
+    }
+    prev = cur;
+    cur = next;
+  }
 
+  for (amount = old_amount; amount < need; ++amount) {
+    blocks[amount] = ReserveFileBlock(sr);
+    if (blocks[amount] == kNotFoundIno) {
+      res = -ENOSPC;
+      goto ex_reserved;
+    }
   }
 
-  return avail;
+  res = WriteChainWOLock(sr, tx, blocks, need, data, size);
+  if (res) { goto ex_reserved; }
+
+  // Лишние блоки прежней цепочки ещё ссылаются друг на друга
+  for (i = need; i < old_amount; ++i) {
+    res = ClearFileBlockWOLock(sr, tx, blocks[i], blocks[i - 1], NULL);
+    if (res) { goto ex; }
+  }
+  goto ex;
+
+ex_reserved:
+  for (i = old_amount; i < amount; ++i) {
+    ReleaseFileBlockRun(sr, blocks[i], 1);
+  }
+ex:
+  kfree(blocks);
+  return res;
 }
 
 
-/*! Связать файловый блок со следующим. Блокировка на файловую область не ставится.
-\param fb_index номер файлового блока, который будет обновлён
-\param fb_next номер следующего файлового блока
-\return отрицательный код ошибки (0 - без ошибок) */
-int UpdateNextFileBlockWOLock(struct StorageRaw* sr, size_t fb_index, size_t fb_next) {
-  struct FileBlockHeader h;
-  loff_t block_pos;
-  loff_t pos;
-  size_t ws;
+/*! Заменить поле тэгов файловой записи. Если размер поля не изменился, то
+оно переписывается на месте, иначе переписывается вся запись. Вызывается под
+блокировкой записи на запись
+\param tx транзакция, в которую добавляется запись
+\param ino номер файла
+\param field, field_len, field_size новое поле тэгов (см. ComposeTagField)
+\return отрицательный код ошибки. 0 - ошибок нет */
+int UpdateTagFieldWOLock(struct StorageRaw* sr, struct JournalTx* tx, size_t ino,
+    const void* field, size_t field_len, u16 field_size) {
+  struct {
+    struct FileBlockHeader bh;
+    struct FileHeader fh;
+  } head;
+  struct FileHeader fh;
+  struct FileData fd = { NULL, 0, false };
+  void* record;
+  size_t old_len, tail_len;
+  int res;
 
-  block_pos = sr->fileblock_table_pos + sr->fileblock_size * fb_index;
-  pos = block_pos;
-  ws = kernel_read(sr->storage_file, &h, sizeof(h), &pos);  // TODO PERFORMANCE - обойтись без чтения, сразу записать несколько байт
-  if (ws != sizeof(h)) { return -EFAULT; }
-  h.next_block_index = fb_next;
-  pos = block_pos;
-  ws = kernel_write(sr->storage_file, &h, sizeof(h), &pos);
-  if (ws != sizeof(h)) { return -EFAULT; }
-  return 0;
-}
+  res = ReadStorageCached(sr, sr->fileblock_table_pos + ino * sr->fileblock_size,
+      &head, sizeof(head));
+  if (res) { return res; }
+  res = CheckChainBlock(&head.bh, ino, ino);
+  if (res) { return res; }
+  if (le16_to_cpu(head.fh.tags_field_size) == field_size) {
+    size_t updated = UpdateDataIntoBlockChainWOLock(sr, tx, ino, field, field_len,
+        sizeof(struct FileHeader), 0);
+    return updated == field_len ? 0 : -EFAULT;
+  }
+
+  res = AllocateReadFileDataWOLock(sr, ino, &fd);
+  if (res) { return res; }
+  fh = *(struct FileHeader*)(fd.data);
+  old_len = TagFieldLen(fh.tags_field_size);
+  tail_len = le16_to_cpu(fh.link_name_size) + le32_to_cpu(fh.link_target_size);
+  if (sizeof(fh) + old_len + tail_len > fd.size) {
+    res = -EFAULT;
+    goto ex;
+  }
 
+  record = kmalloc(sizeof(fh) + field_len + tail_len, GFP_KERNEL);
+  if (!record) {
+    res = -ENOMEM;
+    goto ex;
+  }
+  fh.tags_field_size = cpu_to_le16(field_size);
+  memcpy(record, &fh, sizeof(fh));
+  if (field_len) {
+    memcpy(record + sizeof(fh), field, field_len);
+  }
+  memcpy(record + sizeof(fh) + field_len, fd.data + sizeof(fh) + old_len, tail_len);
+  res = RewriteFileRecordWOLock(sr, tx, ino, record, sizeof(fh) + field_len + tail_len);
+  kfree(record);
 
-/*! Очищает файловый блок - маркирует как свободный. Также возвращает номер
-блока, который должен продолжать цепочку файловых блоков
-\param fb_index индекс удаляемого файлового блока
-\param prev_fb_index индекс предыдущего файлового блока. Используется для контроля цепочек блоков.
-\param next_fb индекс файлового блока, который следующий в цепочке. Параметр может быть NULL
-\return отрицательный код ошибки (-EINVAL - несовпадение предыдущего блока). 0 - если ошибок нет */
-int ClearFileBlockWOLock(struct StorageRaw* sr, size_t fb_index,
-    size_t prev_fb_index, size_t* next_fb) {
-  struct FileBlockHeader h;
-  loff_t block_pos;
-  loff_t pos;
-  size_t ws;
+ex:
+  FreeFileData(sr, &fd);
+  return res;
+}
 
-  block_pos = sr->fileblock_table_pos + sr->fileblock_size * fb_index;
-  pos = block_pos;
-  ws = kernel_read(sr->storage_file, &h, sizeof(h), &pos);
-  if (ws != sizeof(h)) { return -EFAULT; }
-  if (h.prev_block_index != prev_fb_index) { return -EINVAL;  }
 
-  if (next_fb) { *next_fb = h.next_block_index; }
+/*! Поставить поле тэгов файла в отложенную запись. Если у файла уже есть
+отложенная запись, то она заменяется новой. Вызывается под блокировкой
+dirty_lock вместе с изменением маски файла в таблице: тогда последнее поле в
+очереди соответствует маске в памяти
+\param ino номер файла
+\param field, field_len, field_size новое поле тэгов (см. ComposeTagField).
+Поле переходит во владение отложенной записи
+\param spare заготовка отложенной записи (для файла, у которого её ещё нет).
+Если заготовка использована, то указатель обнуляется
+\return true - отложенных записей много и их нужно записать без задержки */
+bool QueueTagFieldWOLock(struct StorageRaw* sr, size_t ino, void* field,
+    size_t field_len, u16 field_size, struct DirtyRecord** spare) {
+  struct DirtyRecord* dr;
+  bool found = false;
+
+  hash_for_each_possible(sr->dirty_records, dr, node, ino) {
+    if (dr->ino == ino) {
+      found = true;
+      break;
+    }
+  }
+  if (!found) {
+    dr = *spare;
+    *spare = NULL;
+    dr->ino = ino;
+    hash_add(sr->dirty_records, &dr->node, ino);
+    ++sr->dirty_amount;
+  } else {
+    kfree(dr->field);
+  }
+  dr->field = field;
+  dr->field_len = field_len;
+  dr->field_size = field_size;
+  return sr->dirty_amount >= kDirtyRecordsMax;
+}
 
-  h.prev_block_index = (size_t)(-1);
-  h.next_block_index = (size_t)(-1);
-  pos = block_pos;
-  ws = kernel_write(sr->storage_file, &h, sizeof(h), &pos);
-  if (ws != sizeof(h)) { return -EFAULT; }
 
-  if (sr->min_fileblock_for_seek_empty > fb_index) {
-    sr->min_fileblock_for_seek_empty = fb_index;
+/*! Запланировать запись отложенных полей тэгов
+\param urgent записать без задержки (см. QueueTagFieldWOLock) */
+void ScheduleDirtyFlush(struct StorageRaw* sr, bool urgent) {
+  if (urgent) {
+    mod_delayed_work(system_wq, &sr->dirty_flush_work, 0);
+  } else {
+    queue_delayed_work(system_wq, &sr->dirty_flush_work, kDirtyFlushDelay);
   }
-  return 0;
 }
 
 
-/*! Переписать (обновить) данные в файловом описателе. Другие данные остаются
-на месте, ничего не сдвигается. Если место записи выходит за границу существующей
-цепочки блоков, то запись прерывается. Функция может вызываться рекурсивно.
-Блокировка не ставится.
-\param blockino номер блока, в котором обновляются данные
-\param data данные для записи
-\param data_size размер данных для обновления
-\param data_pos позиция в файловом описателе, где обновлять данные
-\param nest_counter счётчик вложенности вызовов. В начальном вызове должен быть 0
-\return размер обновлённых данных */
-size_t UpdateDataIntoBlockChainWOLock(struct StorageRaw* sr, size_t blockino,
-    void* data, size_t data_size, size_t data_pos, size_t nest_counter) {
-  struct FileBlockHeader h;
-  loff_t block_pos;
-  loff_t pos;
-  size_t ws;
-  size_t max_data = sr->fileblock_size - sizeof(h);
+/*! Убрать отложенную запись поля тэгов удаляемого файла. Вызывается после
+удаления файла из таблицы (тогда новых записей для файла уже не появится) и
+под блокировкой dirty_flush_lock (тогда запись файла не выполняется прямо сейчас)
+\param ino номер файла */
+void DropDirtyRecordWOLock(struct StorageRaw* sr, size_t ino) {
+  struct DirtyRecord* dr;
+
+  mutex_lock(&sr->dirty_lock);
+  hash_for_each_possible(sr->dirty_records, dr, node, ino) {
+    if (dr->ino == ino) {
+      hash_del(&dr->node);
+      --sr->dirty_amount;
+      kfree(dr->field);
+      kfree(dr);
+      break;
+    }
+  }
+  mutex_unlock(&sr->dirty_lock);
+}
 
-  if (nest_counter > kMaxFileBlocks) { return 0; }
 
-  block_pos = sr->fileblock_table_pos + sr->fileblock_size * blockino;
-  pos = block_pos;
-  ws = kernel_read(sr->storage_file, &h, sizeof(h), &pos);
-  if (ws != sizeof(h)) { return 0; }
+int compare_dirty_records(const void* a, const void* b) {
+  const struct DirtyRecord* ra = *(const struct DirtyRecord* const*)(a);
+  const struct DirtyRecord* rb = *(const struct DirtyRecord* const*)(b);
 
-  if (data_pos < max_data) {
-    size_t tail = max_data - data_pos;
-    if (tail > data_size) {
-      tail = data_size;
+  if (ra->ino < rb->ino) { return -1; }
+  return ra->ino > rb->ino ? 1 : 0;
+}
+
+
+/*! Записать все отложенные поля тэгов в хранилище. Записи выполняются по
+возрастанию номеров файлов (последовательно по хранилищу). Блокируется
+только записываемая в данный момент файловая запись. Записи собираются в
+общие транзакции журнала (до kJournalTxMax), транзакция фиксируется до снятия
+блокировки dirty_flush_lock
+\return отрицательный код ошибки (первой из возникших). 0 - ошибок нет */
+int FlushDirtyRecords(struct StorageRaw* sr) {
+  struct DirtyRecord** records;
+  struct DirtyRecord* dr;
+  struct hlist_node* tmp;
+  struct JournalTx tx;
+  size_t amount = 0;
+  size_t i;
+  int bkt;
+  int res = 0;
+
+  tagfs_journal_tx_init(&tx);
+  mutex_lock(&sr->dirty_flush_lock);
+  mutex_lock(&sr->dirty_lock);
+  if (!sr->dirty_amount) {
+    mutex_unlock(&sr->dirty_lock);
+    mutex_unlock(&sr->dirty_flush_lock);
+    return 0;
+  }
+  records = kvmalloc_array(sr->dirty_amount, sizeof(struct DirtyRecord*), GFP_KERNEL);
+  if (!records) {
+    mutex_unlock(&sr->dirty_lock);
+    mutex_unlock(&sr->dirty_flush_lock);
+    return -ENOMEM;
+  }
+  hash_for_each_safe(sr->dirty_records, bkt, tmp, dr, node) {
+    hash_del(&dr->node);
+    records[amount++] = dr;
+  }
+  sr->dirty_amount = 0;
+  mutex_unlock(&sr->dirty_lock);
+
+  sort(records, amount, sizeof(struct DirtyRecord*), compare_dirty_records, NULL);
+  for (i = 0; i < amount; ++i) {
+    struct JournalTxPoint point = tagfs_journal_tx_save(&tx);
+    int ures;
+
+    dr = records[i];
+    down_write(RecordLock(sr, dr->ino));
+    ures = UpdateTagFieldWOLock(sr, &tx, dr->ino, dr->field, dr->field_len,
+        dr->field_size);
+    up_write(RecordLock(sr, dr->ino));
+    if (ures) {
+      // Запись файла не попадает в транзакцию целиком
+      tagfs_journal_tx_restore(sr->journal, &tx, point);
+      pr_warn("tagvfs: ERROR %d in writing tags of file %u\n", ures,
+          (unsigned int)dr->ino);
+      if (!res) { res = ures; }
     }
-    pos = block_pos + sizeof(h) + data_pos;
-    ws = kernel_write(sr->storage_file, data, tail, &pos);
-    if (ws != tail) { return ws; }
-    if (ws == data_size) { return ws; }
-    if (h.next_block_index == blockino) {
-      return ws;
+    kfree(dr->field);
+    kfree(dr);
+    if (tx.size >= kJournalTxMax || i + 1 == amount) {
+      ures = tagfs_journal_tx_commit(sr->journal, &tx);
+      if (ures) {
+        pr_warn("tagvfs: ERROR %d in committing tags of files\n", ures);
+        if (!res) { res = ures; }
+      }
     }
-
-    return ws + UpdateDataIntoBlockChainWOLock(sr, h.next_block_index, data + ws,
-        data_size - ws, 0, nest_counter + 1);
   }
+  mutex_unlock(&sr->dirty_flush_lock);
 
-  // Нет записи в текущем блоке. Идём в следующий
-  if (h.next_block_index == blockino) { return 0; }
-  return UpdateDataIntoBlockChainWOLock(sr, h.next_block_index, data, data_size,
-      data_pos - max_data, nest_counter + 1);
+  kvfree(records);
+  return res;
+}
+
+
+/*! Отложенная запись полей тэгов файлов */
+void DirtyFlushWork(struct work_struct* work) {
+  struct StorageRaw* sr = container_of(to_delayed_work(work), struct StorageRaw,
+      dirty_flush_work);
+
+  FlushDirtyRecords(sr);
 }
 
 
-/*! Сохранить информацию о новом файле в хранилище. Используется блокировка на
-файловую область.
+/*! Сохранить информацию о новом файле в хранилище. Используется блокировка
+новой записи (и alloc_lock при резервировании блоков)
 \param link_name, link_name_len - название файла и длина имени
 \param target_link, target_link_len - целевая ссылка и длина текстовой строки
 \return номер (ino) созданного файла. Или отрицательный код ошибки */
 size_t AddFileToStorage(struct StorageRaw* sr, const char* link_name, size_t link_name_len,
     const char* target_link, size_t target_link_len) {
+  const size_t payload = sr->fileblock_size - sizeof(struct FileBlockHeader);
   size_t file_info_size;
   void* file_info;
   size_t res = kNotFoundIno;
   struct FileHeader* fh;
   size_t pos;
-  size_t fb_cur, fb_prev;
-  void* chunk;
-  size_t chunk_tail;
+  size_t* blocks = NULL;
+  size_t amount;
+  size_t i;
   size_t ino = kNotFoundIno;
-
-  write_lock(&sr->fileblock_lock);
+  size_t run = kNotFoundIno;
+  struct JournalTx tx;
+  int wres;
+  // У нового файла нет тэгов: при разреженных наборах поле тэгов пустое
+  size_t tags_len = UseSparseTags(sr) ? 0 : sr->tag_mask_byte_size;
 
   // Сформируем информацию о файле
-  file_info_size = sizeof(struct FileHeader) + sr->tag_mask_byte_size + link_name_len + target_link_len;
+  file_info_size = sizeof(struct FileHeader) + tags_len + link_name_len + target_link_len;
   file_info = kzalloc(file_info_size, GFP_KERNEL);
-  if (!file_info) { goto err_nomem; }
+  if (!file_info) { return kNotFoundIno; }
   fh = (struct FileHeader*)(file_info);
-  fh->tags_field_size = cpu_to_le16(sr->tag_mask_byte_size);
+  fh->tags_field_size = cpu_to_le16(tags_len);
   fh->link_name_size = cpu_to_le16(link_name_len);
   fh->link_target_size = cpu_to_le16(target_link_len);
-  pos = sizeof(struct FileHeader) + sr->tag_mask_byte_size;
+  pos = sizeof(struct FileHeader) + tags_len;
   memcpy(file_info + pos, link_name, link_name_len);
   pos += link_name_len;
   memcpy(file_info + pos, target_link, target_link_len);
 
-  // Резервируем свободный блок. Первый зарезервирвоанный блок будет номер файла
-  ino = ReserveFileBlockWOLock(sr);
-  if (ino == kNotFoundIno) {
-    res = -EFAULT;
+  amount = DIV_ROUND_UP(file_info_size, payload);
+  if (amount > kMaxFileBlocks) {
+    res = -EFBIG;
+    goto err;
+  }
+  blocks = kmalloc_array(amount, sizeof(size_t), GFP_KERNEL);
+  if (!blocks) {
+    res = -ENOMEM;
     goto err;
   }
 
-  pr_info("TODO create new file with ino %u\n", (unsigned int)ino);
-
-  fb_cur = ino;
-  fb_prev = fb_cur;
-  chunk = file_info;
-  chunk_tail = file_info_size;
-
-  // Запишем файл в хранилище
-  while (chunk_tail > 0) {
-    size_t red;
-
-    red = WriteFileBlockWOLock(sr, fb_cur, fb_prev, chunk, chunk_tail);
-    if (red == 0 || red > chunk_tail) {
-      // TODO ERORR
-      goto err;
-    }
-
-    if (fb_prev != fb_cur) {
-      // Обновим ссылку на следующий блок у предыдущего блока
-      // Не делается на первом блоке (когда fb_prev == fb_cur)
-      res = UpdateNextFileBlockWOLock(sr, fb_prev, fb_cur);
-      if (res) { goto err; }
+  // Резервируем блоки. Первый зарезервированный блок будет номер файла.
+  // Для многоблочной записи сначала пробуем найти непрерывную последовательность блоков
+  if (amount > 1) {
+    run = ReserveFileBlockRun(sr, amount);
+  }
+  for (i = 0; i < amount; ++i) {
+    blocks[i] = run != kNotFoundIno ? run + i : ReserveFileBlock(sr);
+    if (blocks[i] == kNotFoundIno) {
+      res = -EFAULT;
+      goto err_reserved;
     }
+  }
 
-    chunk += red;
-    chunk_tail -= red;
-
-    if (chunk_tail == 0) {  // Так, записаны все данные. Просто выходим из цикла
-      break;
-    }
+  pr_info("TODO create new file with ino %u\n", (unsigned int)blocks[0]);
 
-    fb_prev = fb_cur;
-    fb_cur = ReserveFileBlockWOLock(sr);
-    if (fb_cur == kNotFoundIno) {
-      res = -EFAULT;
-      goto err;
+  // Запишем файл в хранилище
+  tagfs_journal_tx_init(&tx);
+  down_write(RecordLock(sr, blocks[0]));
+  wres = WriteChainWOLock(sr, &tx, blocks, amount, file_info, file_info_size);
+  if (!wres) {
+    wres = tagfs_journal_tx_commit(sr->journal, &tx);
+    if (wres) {
+      // Транзакция могла попасть в журнал: блоки освобождаются после его сброса
+      tagfs_journal_defer_free(sr->journal, blocks, amount);
+      i = 0;
     }
   }
+  up_write(RecordLock(sr, blocks[0]));
+  tagfs_journal_tx_release(sr->journal, &tx);
+  if (wres) {
+    res = wres;
+    goto err_reserved;
+  }
 
+  ino = blocks[0];
   res = ino;
-  // ---------------------
+  goto err;
+
+err_reserved:
+  while (i-- > 0) {
+    ReleaseFileBlockRun(sr, blocks[i], 1);
+  }
 err:
+  kfree(blocks);
   kfree(file_info);
-err_nomem:
-  write_unlock(&sr->fileblock_lock);
   return res;
 }
 
 
-/*! Удалить запись о файле из хранилища. Используется блокировка на
-файловую область.
+/*! Удалить запись о файле из хранилища. Используется блокировка записи
 \param fileino номер файла
 \return отрицательный код ошибки. 0 - нет ошибок */
 int DelFileFromStorage(struct StorageRaw* sr, size_t fileino) {
+  struct JournalTx tx;
   size_t fi = fileino;
   int res = 0;
   size_t prev = fi;
   size_t i;
 
-  write_lock(&sr->fileblock_lock);
+  tagfs_journal_tx_init(&tx);
+  down_write(RecordLock(sr, fileino));
   for (i = 0; i < kMaxFileBlocks; ++i) {
     size_t fn;
 
-    res = ClearFileBlockWOLock(sr, fi, prev, &fn);
+    res = ClearFileBlockWOLock(sr, &tx, fi, prev, &fn);
     if (res) {
       if (res == -EINVAL && fi == fileino) {
         // Ошибка неправильного аргумента на самом первом блоке.
@@ -1053,7 +2320,10 @@ int DelFileFromStorage(struct StorageRaw* sr, size_t fileino) {
   }
   res = -EFBIG;
 exit:
-  write_unlock(&sr->fileblock_lock);
+  // Цепочка освобождается целиком или не освобождается совсем
+  if (!res) { res = tagfs_journal_tx_commit(sr->journal, &tx); }
+  up_write(RecordLock(sr, fileino));
+  tagfs_journal_tx_release(sr->journal, &tx);
   return res;
 }
 
@@ -1112,7 +2382,7 @@ exit:
 соответствует желаемому, то информация о тэге не изменяется.
 Допускаются переходы: active -> blocked -> free -> active.
 При изменении состояния обрабатывается как кэш, так и хранилище. При обработке
-хранилища ставится блокировка на тэговую область.
+хранилища ставится блокировка записи тэга.
 \param tagino номер (ino) тэга
 \param expect_state ожидаемое состояние тэга (см. kTagFlagFree и др.)
 \param new_state новое состояние
@@ -1157,12 +2427,10 @@ int TagFlagUpdate(struct StorageRaw* sr, size_t tagino, u16 expect_state,
   }
 
   // Запишем изменения в хранилище
-  write_lock(&sr->tag_lock);
-  pos = basepos = sr->tag_table_pos + sr->tag_record_size * tagino;
-  if (kernel_read(sr->storage_file, &th, sizeof(th), &pos) != sizeof(th)) {
-    res = -EFAULT;
-    goto err;
-  }
+  down_write(TagLock(sr, tagino));
+  basepos = sr->tag_table_pos + sr->tag_record_size * tagino;
+  res = ReadStorageCached(sr, basepos, &th, sizeof(th));
+  if (res) { goto err; }
 
   th.tag_flags = new_state;
   if (new_state == kTagFlagActive) {
@@ -1188,63 +2456,165 @@ int TagFlagUpdate(struct StorageRaw* sr, size_t tagino, u16 expect_state,
 
   // -----------------
 err:
-  write_unlock(&sr->tag_lock);
+  up_write(TagLock(sr, tagino));
+  return res;
+}
+
+
+/*! Снять удаляемый тэг у файла. Бит снимается в таблице и поле ставится в
+отложенную запись под одной блокировкой dirty_lock, поэтому одновременное
+изменение маски файла не теряется. Индекс не обновляется: тэг убирается из
+индекса целиком после очистки всех файлов
+\param ino номер файла
+\param tagino номер удаляемого тэга
+\return отрицательный код ошибки. 0 - ошибок нет (в том числе, если файла
+или тэга у файла уже нет) */
+int ClearFileTag(struct StorageRaw* sr, size_t ino, size_t tagino) {
+  struct TagMask mask = tagmask_empty();
+  void* field = NULL;
+  size_t field_len;
+  u16 field_size;
+  struct DirtyRecord* spare;
+  bool urgent;
+  int res;
+
+  spare = kmalloc(sizeof(struct DirtyRecord), GFP_KERNEL);
+  if (!spare) { return -ENOMEM; }
+
+  mutex_lock(&sr->dirty_lock);
+  res = tagfs_file_table_clear_tag(sr->file_table, ino, tagino, &mask);
+  if (res) {
+    mutex_unlock(&sr->dirty_lock);
+    if (res == -ENOENT || res == -ENODATA) { res = 0; }
+    goto ex;
+  }
+  res = ComposeTagField(sr, mask, &field, &field_len, &field_size);
+  if (res) {
+    // Маска в памяти должна совпадать с хранилищем: бит возвращается
+    tagmask_set_tag(&mask, tagino, true);
+    if (tagfs_file_table_set_mask(sr->file_table, ino, mask, NULL)) {
+      pr_warn("tagvfs: ERROR can't restore tags of file %u\n", (unsigned int)ino);
+    }
+    mutex_unlock(&sr->dirty_lock);
+    goto ex;
+  }
+  urgent = QueueTagFieldWOLock(sr, ino, field, field_len, field_size, &spare);
+  mutex_unlock(&sr->dirty_lock);
+  ScheduleDirtyFlush(sr, urgent);
+
+ex:
+  tagmask_release(&mask);
+  kfree(spare);
   return res;
 }
 
 
-/*! Удалим тэг из всех файлов. Для поиска файлов используется информация из кэша.
-При очистке ставится блокировка на файловый блок
+/*! Удалим тэг из всех файлов. Файлы с тэгом берутся из индекса, поэтому
+перебираются только они. Маска обновляется и в кэше, и в хранилище.
+Перебор прерывается при закрытии хранилища
 \param tagino номер тэга, который будет удаляться
-\return отрицательный код ошибки . 0 если нет ошибок */
+\return отрицательный код ошибки (-EINTR - перебор прерван). 0 если нет ошибок */
 int RemoveTagFromAllFiles(struct StorageRaw* sr, size_t tagino) {
-  size_t i;
   int res = 0;
-  u64 fba = GetFileBlockAmount(sr);
+  size_t ino = kNotFoundIno;
+  struct TagMask on_mask = tagmask_init_by_tag(sr->tag_record_max_amount, tagino);
+  IndexFilter filter = NULL;
 
-  for (i = 0; i < fba; ++i) {
-    CacheIterator item;
-    struct TagMask mask = tagmask_empty();
+  if (tagmask_is_empty(on_mask)) {
+    res = -ENOMEM;
+    goto ex;
+  }
+  res = tagfs_index_init_filter(sr->file_index, &filter, on_mask, tagmask_empty());
+  if (res) { goto ex; }
 
-    write_lock(&sr->fileblock_lock);
-    item = tagfs_get_item_by_ino(sr->file_cache, i);
-    if (item) {
-      if (item->Name.name && item->Name.len) {
-        struct FileData* fd = item->user_data;
-        mask = tagmask_init_by_mask(fd->tag_mask);
-      }
+  while (true) {
+    int ures;
 
-      tagfs_release_item(item);
+    if (READ_ONCE(sr->files_load_stop)) {
+      res = -EINTR;
+      goto ex;
     }
+    ino = tagfs_index_next_file(sr->file_index, filter, ino);
+    if (ino == kNotFoundIno) { break; }
 
-    if (tagmask_check_tag(mask, tagino)) {
-      // Обновляем значения в маске
-      tagmask_set_tag(mask, tagino, false);
-      if (UpdateDataIntoBlockChainWOLock(sr, i, mask.data, mask.byte_len,
-          sizeof(struct FileHeader), 0) != mask.byte_len) { // TODO REMOVE MAGIC NUMBER (sizeof(struct FileHeader)) - add constant
-        res = -EFAULT;
-      }
-    }
+    ures = ClearFileTag(sr, ino, tagino);
+    if (ures) { res = ures; }
+  }
 
-    tagmask_release(&mask);
-    write_unlock(&sr->fileblock_lock);
+  if (!res) {
+    // Файлы с ошибками остаются в индексе до повторной очистки
+    tagfs_index_clear_tag(sr->file_index, tagino);
   }
 
+ex:
+  tagfs_index_release_filter(&filter);
+  tagmask_release(&on_mask);
   return res;
 }
 
 
-int tagfs_init_storage(Storage* stor, const char* file_storage) {
+/*! Фоновая очистка заблокированных (удаляемых) тэгов. Тэги очищаются по
+одному: снимаются биты тэга у файлов, изменения сбрасываются на диск, затем
+тэг освобождается. При ошибке тэг остаётся заблокированным до следующего
+удаления или открытия хранилища */
+void TagSweepWork(struct work_struct* work) {
+  struct StorageRaw* sr = container_of(work, struct StorageRaw, tag_sweep_work);
+
+  if (WaitFilesLoaded(sr)) { return; }
+
+  while (!READ_ONCE(sr->files_load_stop)) {
+    size_t tag;
+    int res;
+
+    mutex_lock(&sr->blocked_lock);
+    tag = sr->blocked_amount ? tagmask_next_tag(sr->blocked_tags, 0) :
+        sr->tag_record_max_amount;
+    mutex_unlock(&sr->blocked_lock);
+    if (tag >= sr->tag_record_max_amount) { break; }
+
+    res = RemoveTagFromAllFiles(sr, tag);
+    if (res) {
+      if (res != -EINTR) {
+        pr_warn("tagvfs: ERROR %d in removing tag %u from files\n", res,
+            (unsigned int)tag);
+      }
+      break;
+    }
+    // Снятые биты должны быть на диске раньше, чем освободится тэг: иначе после
+    // сбоя новый тэг в этом номере достался бы файлам удалённого тэга
+    res = tagfs_sync_storage(sr);
+    if (res) {
+      pr_warn("tagvfs: ERROR %d in syncing storage after removing tag %u\n", res,
+          (unsigned int)tag);
+      break;
+    }
+
+    mutex_lock(&sr->blocked_lock);
+    tagmask_set_tag(&sr->blocked_tags, tag, false);
+    --sr->blocked_amount;
+    mutex_unlock(&sr->blocked_lock);
+
+    res = TagFlagUpdate(sr, tag, kTagFlagBlocked, kTagFlagFree, NULL, 0);
+    if (res) {
+      pr_warn("tagvfs: ERROR %d in releasing tag %u\n", res, (unsigned int)tag);
+    }
+  }
+}
+
+
+int tagfs_init_storage(Storage* stor, const char* file_storage,
+    const struct StorageOptions* opts) {
   int err;
 
-  err = OpenTagFS(stor, file_storage);
+  err = OpenTagFS(stor, file_storage, opts);
+  if (err < 0 && opts->read_only) { return err; }
   if (err < 0) {
     err = CreateDefaultStorageFile(file_storage);
     if (err < 0) {
       return err;
     }
 
-    err = OpenTagFS(stor, file_storage);
+    err = OpenTagFS(stor, file_storage, opts);
     if (err < 0) {
       return err;
     }
@@ -1258,7 +2628,19 @@ void tagfs_release_storage(Storage* stor) {
 }
 
 
-void tagfs_sync_storage(Storage stor) {
+int tagfs_sync_storage(Storage stor) {
+  struct StorageRaw* sr;
+  int res;
+
+  BUG_ON(!stor);
+  sr = (struct StorageRaw*)(stor);
+  res = FlushDirtyRecords(sr);
+  if (res) { return res; }
+  res = FlushStorageHeader(sr);
+  if (res) { return res; }
+  // Сброс журнала записывает всё на диск и освобождает отложенные блоки
+  if (tagfs_journal_enabled(sr->journal)) { return tagfs_journal_checkpoint(sr->journal); }
+  return vfs_fsync(sr->storage_file, 0);
 }
 
 
@@ -1275,18 +2657,13 @@ struct qstr tagfs_get_tag_name_by_index(Storage stor, size_t index) {
 
 size_t tagfs_get_tagino_by_name(Storage stor, const struct qstr name) {
   struct StorageRaw* sr;
-  CacheIterator item;
-  size_t ino = kNotFoundIno;
+  size_t ino;
 
   BUG_ON(!stor);
   sr = (struct StorageRaw*)(stor);
-  item = tagfs_get_item_by_name(sr->tag_cache, name);
-  if (item) {
-    if (item->Name.name && item->Name.len) {
-      ino = item->Ino;
-    }
-
-    tagfs_release_item(item);
+  // В хэше имён есть только активные тэги (у заблокированных имя пустое)
+  if (!tagfs_get_ino_by_name(sr->tag_cache, name, &ino)) {
+    return kNotFoundIno;
   }
   return ino;
 }
@@ -1359,7 +2736,7 @@ struct qstr tagfs_get_next_tag(Storage stor, const struct TagMask exclude_mask,
 struct qstr tagfs_get_fname_by_ino(Storage stor, size_t ino,
     struct TagMask* mask) {
   struct StorageRaw* sr;
-  struct qstr name;
+  struct qstr name = get_null_qstr();
 
   BUG_ON(!stor);
   sr = (struct StorageRaw*)(stor);
@@ -1396,78 +2773,100 @@ enum FSSpecialName tagfs_get_special_type(Storage stor, struct qstr name) {
 }
 
 
-struct qstr tagfs_get_nth_file(Storage stor, const struct TagMask on_mask,
-    const struct TagMask off_mask, size_t index, size_t* found_ino) {
-  size_t i;
-  size_t cur_index;
-  struct StorageRaw* sr;
-  u64 fba;
+/*! Вызвать колбэк с данными файла без копирования. Пока файлы загружаются
+(отложенная загрузка), незагруженный файл читается из хранилища
+\return -ENOENT - файла нет. Иначе - результат колбэка */
+int VisitFile(struct StorageRaw* sr, size_t ino, FileInfoVisitor visitor,
+    void* ctx) {
+  struct qstr name = get_null_qstr();
+  struct qstr target = get_null_qstr();
+  struct TagMask mask = tagmask_empty();
+  int res;
 
-  if (index != 0) {
-    pr_info("TagVfs Low Performance: request n-th file with non-zero (%u) index\n",
-        (unsigned int)index); // TODO LOW PERFORMANCE
-  }
+  res = tagfs_file_table_visit(sr->file_table, ino, visitor, ctx);
+  if (res != -ENOENT || FilesLoaded(sr)) { return res; }
 
-  BUG_ON(!stor);
-  sr = (struct StorageRaw*)(stor);
-  fba = GetFileBlockAmount(sr);
+  res = ReadFileInfoFromStorage(sr, ino, &mask, &name, &target);
+  if (!res && visitor) {
+    res = visitor(ctx, ino, name, mask, target);
+  }
+  tagmask_release(&mask);
+  free_qstr(&target);
+  free_qstr(&name);
+  return res;
+}
 
-  for (i = 0, cur_index = 0; i < fba; ++i) {
-    struct qstr name = get_null_qstr();
-    struct TagMask mask = tagmask_empty();
 
-    if (GetFileInfo(sr, i, get_null_qstr(), NULL, &name, &mask, NULL)) { continue; }
-    if (!tagmask_check_filter(mask, on_mask, off_mask)) { goto free_next; }
+/*! Вызвать колбэк для файла, найденного в индексе. Если файл успели удалить
+из таблицы (между обращениями к индексу и таблице), то берётся следующий подходящий
+\param ino номер найденного в индексе файла (или kNotFoundIno)
+\param found_ino возвращает номер файла, для которого вызван колбэк, или kNotFoundIno
+\return -ENOENT - файлов нет. Иначе - результат колбэка */
+int VisitIndexedFile(struct StorageRaw* sr, IndexFilter filter, size_t ino,
+    size_t* found_ino, FileInfoVisitor visitor, void* ctx) {
+  while (ino != kNotFoundIno) {
+    int res = VisitFile(sr, ino, visitor, ctx);
 
-    if (cur_index == index) {
-      if (found_ino) { *found_ino = i; }
-      tagmask_release(&mask);
-      return name;
+    if (res != -ENOENT) {
+      *found_ino = ino;
+      return res;
     }
+    ino = tagfs_index_next_file(sr->file_index, filter, ino);
+  }
+
+  *found_ino = kNotFoundIno;
+  return -ENOENT;
+}
 
-    ++cur_index;
 
-free_next:
-    tagmask_release(&mask);
-    free_qstr(&name);
-  }
+int tagfs_init_file_filter(Storage stor, FileFilter* filter,
+    const struct TagMask on_mask, const struct TagMask off_mask) {
+  BUG_ON(!stor);
+  return tagfs_index_init_filter(((struct StorageRaw*)(stor))->file_index,
+      (IndexFilter*)(filter), on_mask, off_mask);
+}
 
-  // Ничего не нашли, или файлов маловато
-  if (found_ino) { *found_ino = kNotFoundIno; }
-  return get_null_qstr();
+
+void tagfs_release_file_filter(FileFilter* filter) {
+  tagfs_index_release_filter((IndexFilter*)(filter));
 }
 
 
-struct qstr tagfs_get_next_file(Storage stor, const struct TagMask on_mask,
-    const struct TagMask off_mask, size_t* ino) {
-  // TODO NEED TO IMPROVE PERFORMANCE
-  size_t i;
+int tagfs_visit_nth_file(Storage stor, FileFilter filter, size_t index,
+    size_t* found_ino, FileInfoVisitor visitor, void* ctx) {
   struct StorageRaw* sr;
-  u64 fba;
+  size_t ino;
 
   BUG_ON(!stor);
+  BUG_ON(!found_ino);
   sr = (struct StorageRaw*)(stor);
-  fba = GetFileBlockAmount(sr);
 
-  for (i = *ino + 1; i < fba; ++i) {
-    struct qstr name = get_null_qstr();
-    struct TagMask mask = tagmask_empty();
+  // Индекс тэгов строится при загрузке файлов
+  WaitFilesLoaded(sr);
+  ino = tagfs_index_nth_file(sr->file_index, filter, index);
+  return VisitIndexedFile(sr, filter, ino, found_ino, visitor, ctx);
+}
 
-    if (GetFileInfo(sr, i, get_null_qstr(), NULL, &name, &mask, NULL)) { continue; }
-    if (!tagmask_check_filter(mask, on_mask, off_mask)) { goto free_next; }
 
-    *ino = i;
-    tagmask_release(&mask);
-    return name;
-    // ----------------------
-free_next:
-    tagmask_release(&mask);
-    free_qstr(&name);
-  }
+int tagfs_visit_next_file(Storage stor, FileFilter filter, size_t* ino,
+    FileInfoVisitor visitor, void* ctx) {
+  struct StorageRaw* sr;
+  size_t next;
 
-  // Нет следующего файла
-  *ino = kNotFoundIno;
-  return get_null_qstr();
+  BUG_ON(!stor);
+  sr = (struct StorageRaw*)(stor);
+
+  // Индекс тэгов строится при загрузке файлов
+  WaitFilesLoaded(sr);
+  next = tagfs_index_next_file(sr->file_index, filter, *ino);
+  return VisitIndexedFile(sr, filter, next, ino, visitor, ctx);
+}
+
+
+int tagfs_visit_file(Storage stor, size_t ino, FileInfoVisitor visitor,
+    void* ctx) {
+  BUG_ON(!stor);
+  return VisitFile((struct StorageRaw*)(stor), ino, visitor, ctx);
 }
 
 
@@ -1486,9 +2885,29 @@ size_t tagfs_get_fileino_by_name(Storage stor, const struct qstr name,
 }
 
 
+bool tagfs_check_file_filter(Storage stor, size_t ino,
+    const struct TagMask on_mask, const struct TagMask off_mask) {
+  struct StorageRaw* sr;
+  struct TagMask mask = tagmask_empty();
+  bool res;
+
+  BUG_ON(!stor);
+  sr = (struct StorageRaw*)(stor);
+  if (FilesLoaded(sr)) {
+    return tagfs_file_table_check_filter(sr->file_table, ino, on_mask, off_mask);
+  }
+
+  // Файл может быть ещё не загружен - берём маску через общий путь
+  if (GetFileInfo(sr, ino, get_null_qstr(), NULL, NULL, &mask, NULL)) { return false; }
+  res = tagmask_check_filter(mask, on_mask, off_mask);
+  tagmask_release(&mask);
+  return res;
+}
+
+
 struct qstr tagfs_get_file_link(Storage stor, size_t ino) {
   struct StorageRaw* sr;
-  struct qstr res;
+  struct qstr res = get_null_qstr();
 
   BUG_ON(!stor);
   sr = (struct StorageRaw*)(stor);
@@ -1504,28 +2923,28 @@ size_t tagfs_add_new_file(Storage stor, const char* target_name,
     const struct qstr link_name) {
   struct StorageRaw* sr;
   size_t ino;
-  struct FileData* fd;
-  size_t target_len = strlen(target_name);
+  struct qstr target;
   int res;
 
   BUG_ON(!stor);
   sr = (struct StorageRaw*)(stor);
+  if (WaitFilesLoaded(sr)) { return kNotFoundIno; }
+  target.name = (const unsigned char*)target_name;
+  target.len = strlen(target_name);
   ino = AddFileToStorage(sr, link_name.name, link_name.len, target_name,
-      target_len);
+      target.len);
   if (IS_ERR_VALUE(ino)) { return kNotFoundIno; }
 
-  fd = kzalloc(sizeof(struct FileData), GFP_KERNEL);
-  if (!fd) {
-    pr_warn("tagvfs: ERROR no mem for file caching\n");
+  res = tagfs_file_table_insert(sr->file_table, ino, link_name, target,
+      tagmask_empty());
+  if (res) {
+    pr_warn("tagvfs: ERROR %d for caching file information\n", res);
     return kNotFoundIno;
   }
 
-  fd->tag_mask = tagmask_empty();
-  fd->link_target = alloc_qstr_from_str(target_name, target_len);
-  res = tagfs_insert_item(sr->file_cache, ino, link_name, fd, FileDataRemover);
+  res = tagfs_index_add_file(sr->file_index, ino, tagmask_empty());
   if (res) {
-    pr_warn("tagvfs: ERROR %d for caching file information\n", res);
-    return kNotFoundIno;
+    pr_warn("tagvfs: ERROR %d for indexing file information\n", res);
   }
 
   return ino;
@@ -1534,18 +2953,32 @@ size_t tagfs_add_new_file(Storage stor, const char* target_name,
 
 int tagfs_del_file(Storage stor, const struct qstr file) {
   struct StorageRaw* sr;
-  CacheIterator item;
+  size_t ino;
+  struct TagMask old_mask = tagmask_empty();
   int res;
 
   BUG_ON(!stor);
   sr = (struct StorageRaw*)(stor);
-  item = tagfs_get_item_by_name(sr->file_cache, file);
-  if (!item) { return -ENOENT; }
-  tagfs_delete_item(sr->file_cache, item);
-
-  res =  DelFileFromStorage(sr, item->Ino);
-  tagfs_release_item(item);
+  res = WaitFilesLoaded(sr);
+  if (res) { return res; }
+  res = GetFileInfo(sr, kNotFoundIno, file, &ino, NULL, NULL, NULL);
+  if (res) { return res; }
+  // Под dirty_lock, как и изменение маски (см. tagfs_set_file_mask)
+  mutex_lock(&sr->dirty_lock);
+  res = tagfs_file_table_delete(sr->file_table, ino, &old_mask);
+  if (!res) {
+    tagfs_index_del_file(sr->file_index, ino,
+        tagmask_is_empty(old_mask) ? NULL : &old_mask);
+  }
+  mutex_unlock(&sr->dirty_lock);
+  if (res) { return res; }
+  tagmask_release(&old_mask);
 
+  // Отложенная запись тэгов не должна попасть в освобождённые блоки
+  mutex_lock(&sr->dirty_flush_lock);
+  DropDirtyRecordWOLock(sr, ino);
+  res = DelFileFromStorage(sr, ino);
+  mutex_unlock(&sr->dirty_flush_lock);
   return res;
 }
 
@@ -1579,9 +3012,14 @@ size_t tagfs_get_maximum_tags_amount(Storage stor) {
 int tagfs_set_file_mask(Storage stor, size_t fileino,
     const struct TagMask mask) {
   struct StorageRaw* sr;
-  CacheIterator item;
-  struct FileData* fd = NULL;
-  struct FileData* prev_fd = NULL;
+  struct TagMask old_mask = tagmask_empty();
+  struct TagMask clean = tagmask_empty();
+  const struct TagMask* new_mask = &mask;
+  void* field = NULL;
+  size_t field_len;
+  u16 field_size;
+  struct DirtyRecord* spare;
+  bool urgent;
   int res;
 
   BUG_ON(!stor);
@@ -1593,49 +3031,59 @@ int tagfs_set_file_mask(Storage stor, size_t fileino,
     return -EFAULT;
   }
 
-  item = tagfs_get_item_by_ino(sr->file_cache, fileino);
-  if (!item) { return -ENOENT; }
-
-  // TODO CHECK ITEM ISNT HOLD
+  res = WaitFilesLoaded(sr);
+  if (res) { return res; }
 
-  // Подготовим новый элемент на замену старому
-  fd = kzalloc(sizeof(struct FileData), GFP_KERNEL);
-  if (!fd) {
-    pr_warn("tagvfs: ERROR no mem for file caching\n");
-    goto item_err;
+  // Биты удаляемых тэгов снимаются при любом изменении маски файла. Если
+  // памяти на копию маски нет, то их снимет фоновая очистка
+  mutex_lock(&sr->blocked_lock);
+  if (sr->blocked_amount) {
+    clean = tagmask_init_by_mask(mask);
+    if (!tagmask_is_empty(clean)) {
+      tagmask_exclude_mask(&clean, sr->blocked_tags);
+      new_mask = &clean;
+    }
   }
+  mutex_unlock(&sr->blocked_lock);
 
-  prev_fd = item->user_data;
-  fd->tag_mask = tagmask_init_by_mask(mask);
-  fd->link_target = alloc_qstr_from_qstr(prev_fd->link_target);
-  if (!tagmask_is_empty(mask) && tagmask_is_empty(fd->tag_mask)) {
-    goto item_err;
-  }
-  if (prev_fd->link_target.name && !fd->link_target.name) {
-    goto item_err;
+  res = ComposeTagField(sr, *new_mask, &field, &field_len, &field_size);
+  if (res) { goto ex_clean; }
+  spare = kmalloc(sizeof(struct DirtyRecord), GFP_KERNEL);
+  if (!spare) {
+    res = -ENOMEM;
+    goto ex_field;
   }
 
-  tagfs_delete_item(sr->file_cache, item);
-  res = tagfs_insert_item(sr->file_cache, item->Ino, item->Name, fd, FileDataRemover);
-  tagfs_release_item(item);
+  // Маска в таблице, индекс и отложенная запись меняются вместе, чтобы при
+  // одновременных изменениях в хранилище попала та же маска, что и в память
+  mutex_lock(&sr->dirty_lock);
+  res = tagfs_file_table_set_mask(sr->file_table, fileino, *new_mask, &old_mask);
+  if (res) {
+    mutex_unlock(&sr->dirty_lock);
+    goto ex;
+  }
 
-  if (!res) {
-    size_t updated;
-    write_lock(&sr->fileblock_lock);
-    updated = UpdateDataIntoBlockChainWOLock(sr, fileino, mask.data, mask.byte_len,
-        sizeof(struct FileHeader), 0);
-    write_unlock(&sr->fileblock_lock);
-    if (updated != mask.byte_len) {
-      return -EFAULT;
-    }
+  res = tagfs_index_update_file(sr->file_index, fileino,
+      tagmask_is_empty(old_mask) ? NULL : &old_mask, *new_mask);
+  if (res) {
+    pr_warn("tagvfs: ERROR %d for indexing file %u\n", res, (unsigned int)fileino);
   }
 
-  return 0;
-  // --------------
-item_err:
-  FileDataRemover(fd);
-  tagfs_release_item(item);
-  return -ENOMEM;
+  // Поле записывается в хранилище отложенно
+  urgent = QueueTagFieldWOLock(sr, fileino, field, field_len, field_size, &spare);
+  mutex_unlock(&sr->dirty_lock);
+  field = NULL;
+  ScheduleDirtyFlush(sr, urgent);
+  res = 0;
+
+ex:
+  tagmask_release(&old_mask);
+  kfree(spare);
+ex_field:
+  kfree(field);
+ex_clean:
+  tagmask_release(&clean);
+  return res;
 }
 
 
@@ -1651,8 +3099,7 @@ const struct qstr tagfs_get_no_prefix(Storage stor) {
 int tagfs_del_tag(Storage stor, const struct qstr tag) {
   struct StorageRaw* sr;
   size_t tino;
-  int tres;
-  int fres;
+  int res;
 
   WARN_ON(!stor);
   if (!stor) { return -EINVAL; }
@@ -1660,14 +3107,17 @@ int tagfs_del_tag(Storage stor, const struct qstr tag) {
   tino = tagfs_get_tagino_by_name(stor, tag);
   if (tino == kNotFoundIno) { return -ENOENT; }
 
-  tres = TagFlagUpdate(sr, tino, kTagFlagActive, kTagFlagBlocked, NULL, 0);
-  if (tres) { return tres; }
-
-  // Удалим упоминание о тэге во всех файлах
-  fres = RemoveTagFromAllFiles(sr, tino);
-
-  tres = TagFlagUpdate(sr, tino, kTagFlagBlocked, kTagFlagFree, NULL, 0);
-  if (tres) { return tres; }
+  // Заблокированный тэг сразу скрывается (имени в кэше нет)
+  res = TagFlagUpdate(sr, tino, kTagFlagActive, kTagFlagBlocked, NULL, 0);
+  if (res) { return res; }
 
-  return fres;
+  // Упоминания о тэге в файлах удаляются в фоне
+  mutex_lock(&sr->blocked_lock);
+  if (!tagmask_check_tag(sr->blocked_tags, tino)) {
+    tagmask_set_tag(&sr->blocked_tags, tino, true);
+    ++sr->blocked_amount;
+  }
+  mutex_unlock(&sr->blocked_lock);
+  queue_work(system_unbound_wq, &sr->tag_sweep_work);
+  return 0;
 }
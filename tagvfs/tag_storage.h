@@ -43,19 +43,37 @@ extern const size_t kNotFoundIno;
 
 typedef void* Storage;
 
+/*! Параметры открытия хранилища (задаются опциями монтирования) */
+struct StorageOptions {
+  /*! Отложенная загрузка: файлы загружаются в фоне, а хранилище готово к
+  работе сразу после чтения хедера и тэгов. Операции, которым нужны все файлы
+  (поиск по имени, перебор, изменения), дожидаются загрузки */
+  bool lazy_load;
+  /*! Обновить хранилище старого формата (версии 1) до версии 2 на месте и
+  создать журнал записи (область около 1 МБ в конце хранилища) */
+  bool upgrade;
+  /*! Хранилище монтируется только для чтения: хедер, индексы и журнал не
+  записываются */
+  bool read_only;
+};
+
 /*! Инициализация хранилища файловой системы
 \param stor указатель на хранилище, который будет инициализирован новым хранилищем.
 Для освобождения ресурсов нужно вызвать tagfs_release_storage.
 \param file_storage имя файла, который содержит данные файловой системы
+\param opts параметры открытия хранилища
 \return признак успешной инициализации (0), или отрицательный код ошибки */
-int tagfs_init_storage(Storage* stor, const char* file_storage);
+int tagfs_init_storage(Storage* stor, const char* file_storage,
+    const struct StorageOptions* opts);
 
 /*! Освобождение хранилища, закрытие ресурсов.
 \param stor указатель на закрываемое хранилище. */
 void tagfs_release_storage(Storage* stor);
 
-/*! Сохранить/Сериализовать хранилище. Ошибок не возвращает */
-void tagfs_sync_storage(Storage stor);
+/*! Сохранить/Сериализовать хранилище: записать отложенные изменения файлов,
+индекс тэгов и хедер, затем сбросить файл хранилища на диск
+\return отрицательный код ошибки. 0 - ошибок нет */
+int tagfs_sync_storage(Storage stor);
 
 
 /*! Возвращает название тэга по индексу/tagino. Если индекс невалидный или тэг удалён, то возвращается строка пустой длины
@@ -111,29 +129,59 @@ struct qstr tagfs_get_special_name(Storage stor, enum FSSpecialName name);
 возвращается kFSSpecialNameUndefined */
 enum FSSpecialName tagfs_get_special_type(Storage stor, const struct qstr name);
 
-// TODO Актуализировать описание
-/*! Ищет файл, который соответствует маске mask и имеет порядковый индекс index.
-Номера начинаются с нуля, номера уникальны, следующий поиск можно начинать с ранее найденного номера + 1.
+/*! Колбэк для доступа к данным файла без копирования. Данные действительны
+только во время вызова. Из колбэка нельзя изменять файлы хранилища. Данные из
+таблицы файлов выдаются под rcu_read_lock, поэтому колбэк не должен засыпать
+\param ctx контекст, переданный вызывающим
+\param ino номер файла
+\param name, mask, target имя, маска тэгов и целевая ссылка файла
+\return код, который возвращается вызывающему. Не должен быть -ENOENT */
+typedef int (*FileInfoVisitor)(void* ctx, size_t ino, const struct qstr name,
+    const struct TagMask mask, const struct qstr target);
+
+/*! Фильтр файлов по маскам тэгов для перебора директории */
+typedef void* FileFilter;
+
+/*! Создать фильтр файлов. Фильтр строится один раз (при открытии директории)
+и используется во всех вызовах tagfs_visit_*_file перебора
+\param filter указатель на переменную для фильтра. Изначально в переменной
+должен быть NULL. Фильтр удаляется через tagfs_release_file_filter
 \param on_mask маска битов, которые установлены у файла
 \param off_mask маска битов, которые сброшены у файла
+\return отрицательный код ошибки. 0 - ошибок нет */
+int tagfs_init_file_filter(Storage stor, FileFilter* filter,
+    const struct TagMask on_mask, const struct TagMask off_mask);
+
+/*! Удалить фильтр файлов
+\param filter указатель на переменную с удаляемым фильтром */
+void tagfs_release_file_filter(FileFilter* filter);
+
+/*! Ищет файл, который подходит под фильтр и имеет порядковый индекс index
+(отсчёт с нуля), и вызывает для него колбэк
+\param filter фильтр файлов (см. tagfs_init_file_filter)
 \param index порядковый индекс файла (отсчёт с нуля)
 \param found_ino найденный номер ino. Если  файл не найден, то возвращается
 значение kNotFoundIno. Параметр не может быть NULL
-\return найденное имя файла. Если файл не найден, то возвращается пустая
-строка. Строку потом необходимо явно удалить (пустую удалять необязательно) */
-// TODO Переделать на использование, аналогично nth_tag
-struct qstr tagfs_get_nth_file(Storage stor, const struct TagMask on_mask,
-    const struct TagMask off_mask, size_t index, size_t* found_ino);
-
-/*! Находит файл (следующий), подходящий по маскам on_mask/off_mask и стоящий
-следующим за номер ino
-\param on_mask маска битов, которые установлены у файла
-\param off_mask маска битов, которые сброшены у файла
+\param visitor колбэк для найденного файла. Может быть NULL
+\param ctx контекст для колбэка
+\return -ENOENT - файл не найден. Иначе - результат колбэка (0, если колбэка нет) */
+int tagfs_visit_nth_file(Storage stor, FileFilter filter, size_t index,
+    size_t* found_ino, FileInfoVisitor visitor, void* ctx);
+
+/*! Находит файл (следующий), подходящий под фильтр и стоящий следующим за
+номер ino, и вызывает для него колбэк
+\param filter фильтр файлов (см. tagfs_init_file_filter)
 \param ino на вход - номер файла, после которого искать следующий файл. На выход - номер найденного файла или kNotFoundIno
-\return найденное имя файла. Если файл не найден, то возвращается пустая
-строка. Строку потом необходимо явно удалить (пустую удалять необязательно) */
-struct qstr tagfs_get_next_file(Storage stor, const struct TagMask on_mask,
-    const struct TagMask off_mask, size_t* ino);
+\param visitor, ctx см. tagfs_visit_nth_file
+\return см. tagfs_visit_nth_file */
+int tagfs_visit_next_file(Storage stor, FileFilter filter, size_t* ino,
+    FileInfoVisitor visitor, void* ctx);
+
+/*! Вызывает колбэк с данными файла с номером ino
+\param visitor, ctx см. tagfs_visit_nth_file
+\return -ENOENT - файла нет. Иначе - результат колбэка */
+int tagfs_visit_file(Storage stor, size_t ino, FileInfoVisitor visitor,
+    void* ctx);
 
 /*! Находит номер файла с именем ino
 \param name имя файла, номер которого нужно получить
@@ -142,6 +190,13 @@ struct qstr tagfs_get_next_file(Storage stor, const struct TagMask on_mask,
 size_t tagfs_get_fileino_by_name(Storage stor, const struct qstr name,
     struct TagMask* mask);
 
+/*! Проверить, что файл подходит под фильтр тэгов. Маска файла не копируется
+\param ino номер файла
+\param on_mask, off_mask тэги, которые у файла должны быть и которых быть не должно
+\return true - файл существует и подходит под фильтр */
+bool tagfs_check_file_filter(Storage stor, size_t ino,
+    const struct TagMask on_mask, const struct TagMask off_mask);
+
 
 /*! Получить результирующую ссылку на файл.
 \param ino номер файла в файловой системе
@@ -149,8 +204,9 @@ size_t tagfs_get_fileino_by_name(Storage stor, const struct qstr name,
 struct qstr tagfs_get_file_link(Storage stor, size_t ino);
 
 
-/*! Обновляем маску на существующий файл. Так как размер маски задан на этапе
-формирования файловой системы и фиксирован, то размер файловой записи не меняется
+/*! Обновляем маску на существующий файл. Таблица файлов и индекс тэгов
+обновляются сразу, а поле тэгов записывается в хранилище отложенно (изменения
+одного файла объединяются). Для немедленной записи - tagfs_sync_storage
 \param fileino номер файла
 \param mask новая маска
 \return код ошибки */
@@ -189,7 +245,8 @@ size_t tagfs_get_active_tags_amount(Storage stor);
 \return строка с префиксом. Не может быть пустой */
 const struct qstr tagfs_get_no_prefix(Storage stor);
 
-/*! Удалим тэг из файловой системы
+/*! Удалим тэг из файловой системы. Тэг сразу скрывается, а его упоминания у
+файлов удаляются в фоне. Номер тэга освобождается после очистки
 \param tag имя тэга. Не может быть пустой строкой
 \return отрицательный код ошибки. 0 - нет ошибок */
 int tagfs_del_tag(Storage stor, const struct qstr tag);
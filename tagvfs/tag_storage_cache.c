@@ -1,14 +1,20 @@
 #include "tag_storage_cache.h"
 
+#include <linux/rculist.h>
+#include <linux/rcupdate.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 
 #include "common.h"
 
 
+/* Чтение кэша выполняется без блокировок (под rcu_read_lock). Изменения хэшей
+делаются под CacheLock, а освобождение памяти элемента откладывается до
+окончания всех текущих чтений (call_rcu) */
 struct CacheInternal {
   struct hlist_head* NameCache;
   struct hlist_head* InoCache;
-  rwlock_t CacheLock;
+  spinlock_t CacheLock; //!< Блокировка для изменения кэша. Читатели её не ставят
   size_t CacheSize;
   unsigned int CacheBits;
 };
@@ -21,6 +27,7 @@ struct ItemInternal {
   struct hlist_node NameNode;
   bool InoHashed; //!< Признак, что структура внесена в хэш номеров
   bool NameHashed; //!< Признак, что структура внесена в хэш имён
+  struct rcu_head Rcu; //!< Отложенное удаление элемента после завершения чтений
 
   struct CacheItem Item;
 };
@@ -37,13 +44,11 @@ unsigned int hash_name(const struct qstr name) {
 }
 
 
-/*! "Заявим" удаление элемента. Если элементом ещё пользуются, то фактического
-удаления не будет
-\param item элемент для удаления */
-void delete_item_wo_lock(struct ItemInternal* item) {
-  if (!atomic_dec_and_test(&item->LinkCounter)) { return; }
+/*! Фактическое удаление элемента. Вызывается после завершения всех чтений,
+которые могли видеть элемент в хэшах */
+void free_item_rcu(struct rcu_head* head) {
+  struct ItemInternal* item = container_of(head, struct ItemInternal, Rcu);
 
-  // So, counter is zero. Make real deletion
   free_qstr(&item->Item.Name);
   if (item->Item.data_remover) {
     item->Item.data_remover(item->Item.user_data);
@@ -52,18 +57,30 @@ void delete_item_wo_lock(struct ItemInternal* item) {
 }
 
 
+/*! "Заявим" удаление элемента. Если элементом ещё пользуются, то фактического
+удаления не будет. Память освобождается отложенно: элемент ещё могут
+просматривать читатели, которые нашли его в хэше без блокировки
+\param item элемент для удаления */
+void delete_item_wo_lock(struct ItemInternal* item) {
+  if (!atomic_dec_and_test(&item->LinkCounter)) { return; }
+
+  // So, counter is zero. Make real deletion
+  call_rcu(&item->Rcu, free_item_rcu);
+}
+
+
 /*! Отвяжем элемент из обеих хэш-таблиц. Эта функция не удаляет сам элемент
 \param item элемент для отвязки */
 void unlink_item_wo_lock(struct ItemInternal* item) {
   bool need_dec = false;
 
   if (item->InoHashed) {
-    hash_del(&item->InoNode);
+    hash_del_rcu(&item->InoNode);
     item->InoHashed = false;
     need_dec = true;
   }
   if (item->NameHashed) {
-    hash_del(&item->NameNode);
+    hash_del_rcu(&item->NameNode);
     item->NameHashed = false;
   }
 
@@ -95,7 +112,7 @@ int tagfs_init_cache(Cache* cache, unsigned int cache_bits) {
     INIT_HLIST_HEAD(&ci->InoCache[i]);
   }
 
-  rwlock_init(&ci->CacheLock);
+  spin_lock_init(&ci->CacheLock);
   ci->CacheSize = cache_size;
   ci->CacheBits = cache_bits;
 
@@ -121,7 +138,7 @@ void tagfs_release_cache(Cache* cache) {
 
   ci = (struct CacheInternal*)(*cache);
 
-  if (write_trylock(&ci->CacheLock) == 0) {
+  if (spin_trylock(&ci->CacheLock) == 0) {
     // Ошибка в логике: блокировка ещё используется. Оставляем все ресурсы в утечку памяти.
     WARN(1, "Tagvfs Logic Error: cache lock as active yet\n");
     return;
@@ -140,80 +157,100 @@ void tagfs_release_cache(Cache* cache) {
     }
   }
 
-  kfree(ci->InoCache);
-  kfree(ci->NameCache);
+  spin_unlock(&ci->CacheLock);
 
-  write_unlock(&ci->CacheLock);
+  // Дождёмся отложенных удалений элементов: они используют код модуля
+  rcu_barrier();
 
+  kfree(ci->InoCache);
+  kfree(ci->NameCache);
   kfree(ci);
   *cache = NULL;
 }
 
 
-/*! Ищем элемент кэша по имени и возвращаем что нашли. У найденного элемента
-увеличиваем счётчик ссылок использования.
+/*! Ищем элемент кэша по имени. Вызывается под rcu_read_lock (или под
+CacheLock). Счётчик ссылок не меняется
 \param name имя для поиска
 \return найденный элемент. Если элемент не найден, то возвращается NULL */
-CacheIterator item_by_name_wo_lock(struct CacheInternal* ci, const struct qstr name) {
+struct ItemInternal* find_by_name_rcu(struct CacheInternal* ci, const struct qstr name) {
   unsigned int key;
   struct ItemInternal* it;
 
   key = hash_name(name);
-  hlist_for_each_entry(it, &ci->NameCache[hash_min(key, ci->CacheBits)], NameNode) {
-    if (compare_qstr(it->Item.Name, name) != 0) { continue; }
-    atomic_inc(&it->LinkCounter);
-    return &(it->Item);
+  hlist_for_each_entry_rcu(it, &ci->NameCache[hash_min(key, ci->CacheBits)], NameNode) {
+    if (compare_qstr(it->Item.Name, name) == 0) { return it; }
   }
   return NULL;
 }
 
 
-/*! Ищем элемент кэша по номеру и возвращаем что нашли. У найденного элемента
-увеличиваем счётчик ссылок использования.
+/*! Ищем элемент кэша по номеру. Вызывается под rcu_read_lock (или под
+CacheLock). Счётчик ссылок не меняется
 \param ino номер для поиска
 \return найденный элемент. Если элемент не найден, то возвращается NULL */
-CacheIterator item_by_ino_wo_lock(struct CacheInternal* ci, size_t ino) {
+struct ItemInternal* find_by_ino_rcu(struct CacheInternal* ci, size_t ino) {
   struct ItemInternal* it;
 
-  hlist_for_each_entry(it, &ci->InoCache[hash_min(ino, ci->CacheBits)], InoNode) {
-    if (it->Item.Ino != ino) { continue; }
-    atomic_inc(&it->LinkCounter);
-    return &(it->Item);
+  hlist_for_each_entry_rcu(it, &ci->InoCache[hash_min(ino, ci->CacheBits)], InoNode) {
+    if (it->Item.Ino == ino) { return it; }
   }
   return NULL;
 }
 
 
-/*! Создадим элемент и добавим его кэш номеров. Если имя не пустое, то добавляем
-в кэш имён. В случае ошибок пользовательские данные НЕ удаляются (т.к. это
-внутренняя функция и обработка всех ошибок производится в базовых функциях).
+/*! Увеличить счётчик ссылок найденного элемента. Элемент, у которого счётчик
+уже обнулился (ожидает удаления), не выдаётся
+\return элемент для использования или NULL */
+CacheIterator hold_item(struct ItemInternal* it) {
+  if (!it || !atomic_inc_not_zero(&it->LinkCounter)) { return NULL; }
+  return &(it->Item);
+}
+
+
+/*! Создадим элемент для последующего добавления в кэш. Память выделяется
+до установки блокировки. В случае ошибок пользовательские данные НЕ удаляются
+(т.к. это внутренняя функция и обработка всех ошибок производится в базовых функциях).
 \param ino номер элемента
 \param name имя элемента. Может быть пустым
 \param user_data пользовательские данные. Могут быть NULL
-\param data_remover функция удаления пользовательских данных. Может быть NULL
-\return отрицательный код ошибки. Если ошибок нет - 0 */
-int create_add_item_wo_lock(struct CacheInternal* ci, size_t ino,
-    const struct qstr name, void* user_data, void (*data_remover)(void*)) {
-  unsigned int name_key = hash_name(name);
+\param data_remover функция удаления пользовательских данных. Может быть NULL.
+Функция вызывается отложенно (из контекста RCU) и не должна засыпать
+\return созданный элемент или NULL при нехватке памяти */
+struct ItemInternal* alloc_item(size_t ino, const struct qstr name,
+    void* user_data, void (*data_remover)(void*)) {
   struct ItemInternal* item = kzalloc(sizeof(struct ItemInternal), GFP_KERNEL);
   if (!item) {
-    return -ENOMEM;
+    return NULL;
   }
 
   item->Item.Ino = ino;
   item->Item.Name = get_null_qstr();
+  if (name.name && name.len) {
+    item->Item.Name = alloc_qstr_from_qstr(name);
+    if (!item->Item.Name.name) {
+      kfree(item);
+      return NULL;
+    }
+  }
   item->Item.user_data = user_data;
   item->Item.data_remover = data_remover;
+  atomic_set(&item->LinkCounter, 1);
+  return item;
+}
+
 
-  hlist_add_head(&item->InoNode, &ci->InoCache[hash_min(ino, ci->CacheBits)]);
+/*! Добавим созданный элемент в кэш номеров. Если имя не пустое, то добавляем
+в кэш имён. Блокировка CacheLock должна быть уже поставлена
+\param item элемент, созданный через alloc_item */
+void add_item_wo_lock(struct CacheInternal* ci, struct ItemInternal* item) {
+  hlist_add_head_rcu(&item->InoNode, &ci->InoCache[hash_min(item->Item.Ino, ci->CacheBits)]);
   item->InoHashed = true;
-  if (name.name && name.len) {
-    item->Item.Name = alloc_qstr_from_qstr(name);
-    hlist_add_head(&item->NameNode, &ci->NameCache[hash_min(name_key, ci->CacheBits)]);
+  if (item->Item.Name.name && item->Item.Name.len) {
+    unsigned int name_key = hash_name(item->Item.Name);
+    hlist_add_head_rcu(&item->NameNode, &ci->NameCache[hash_min(name_key, ci->CacheBits)]);
+    item->NameHashed = true;
   }
-  item->NameHashed = true;
-  atomic_set(&item->LinkCounter, 1);
-  return 0;
 }
 
 
@@ -225,9 +262,9 @@ const CacheIterator tagfs_get_item_by_name(Cache cache, const struct qstr name)
   if (unlikely(cache == NULL || name.len == 0 || name.name == NULL)) { return NULL; }
 
   ci = (struct CacheInternal*)(cache);
-  read_lock(&ci->CacheLock);
-  it = item_by_name_wo_lock(ci, name);
-  read_unlock(&ci->CacheLock);
+  rcu_read_lock();
+  it = hold_item(find_by_name_rcu(ci, name));
+  rcu_read_unlock();
   return it;
 }
 
@@ -240,44 +277,62 @@ const CacheIterator tagfs_get_item_by_ino(Cache cache, size_t ino) {
   if (unlikely(cache == NULL)) { return NULL; }
 
   ci = (struct CacheInternal*)(cache);
-  read_lock(&ci->CacheLock);
-  it = item_by_ino_wo_lock(ci, ino);
-  read_unlock(&ci->CacheLock);
+  rcu_read_lock();
+  it = hold_item(find_by_ino_rcu(ci, ino));
+  rcu_read_unlock();
   return it;
 }
 
 
+// Описание в хедере
+bool tagfs_get_ino_by_name(Cache cache, const struct qstr name, size_t* ino) {
+  struct CacheInternal* ci;
+  struct ItemInternal* it;
+  bool res = false;
+
+  if (unlikely(cache == NULL || name.len == 0 || name.name == NULL)) { return false; }
+
+  ci = (struct CacheInternal*)(cache);
+  rcu_read_lock();
+  it = find_by_name_rcu(ci, name);
+  if (it && atomic_read(&it->LinkCounter)) {
+    if (ino) { *ino = it->Item.Ino; }
+    res = true;
+  }
+  rcu_read_unlock();
+  return res;
+}
+
+
 // Описание в хедере
 int tagfs_insert_item(Cache cache, size_t ino, const struct qstr name, void* data, void (*remover)(void*)) {
   struct CacheInternal* ci;
-  CacheIterator it;
+  struct ItemInternal* item;
   int res = 0;
 
   if (unlikely(cache == NULL || name.name == NULL || name.len == 0)) { return -EINVAL; }
 
   ci = (struct CacheInternal*)(cache);
+  item = alloc_item(ino, name, data, remover);
+  if (!item) {
+    if (data && remover) {
+      remover(data);
+    }
+    return -ENOMEM;
+  }
 
-  write_lock(&ci->CacheLock);
-
-  it = item_by_ino_wo_lock(ci, ino);
-  if (it) {
-    tagfs_release_item(it);
+  spin_lock(&ci->CacheLock);
+  if (find_by_ino_rcu(ci, ino) || find_by_name_rcu(ci, name)) {
     res = -EEXIST;
   } else {
-    it = item_by_name_wo_lock(ci, name);
-    if (it) {
-      tagfs_release_item(it);
-      res = -EEXIST;
-    } else {
-      // Добавляем
-      res = create_add_item_wo_lock(ci, ino, name, data, remover);
-    }
+    // Добавляем
+    add_item_wo_lock(ci, item);
   }
+  spin_unlock(&ci->CacheLock);
 
-  write_unlock(&ci->CacheLock);
-
-  if (res && data && remover) {
-    remover(data);
+  if (res) {
+    // Элемент никому не был виден - удаляем сразу
+    free_item_rcu(&item->Rcu);
   }
   return res;
 }
@@ -291,9 +346,9 @@ void tagfs_delete_item(Cache cache, CacheIterator it)
 
   ci = (struct CacheInternal*)(cache);
   item = container_of(it, struct ItemInternal, Item);
-  write_lock(&ci->CacheLock);
+  spin_lock(&ci->CacheLock);
   unlink_item_wo_lock(item);
-  write_unlock(&ci->CacheLock);
+  spin_unlock(&ci->CacheLock);
 }
 
 
@@ -309,34 +364,36 @@ void tagfs_release_item(CacheIterator it) {
 
 int tagfs_hold_ino(Cache cache, size_t ino) {
   struct CacheInternal* ci;
-  CacheIterator it;
+  struct ItemInternal* item;
+  struct ItemInternal* holder;
   int res = 0;
 
   if (unlikely(cache == NULL)) { return -EINVAL; }
 
   ci = (struct CacheInternal*)(cache);
-  write_lock(&ci->CacheLock);
-  it = item_by_ino_wo_lock(ci, ino);
-  if (it == NULL) {
+  // Элемент-заглушка с требуемым номером (без имени и данных)
+  holder = alloc_item(ino, get_null_qstr(), NULL, NULL);
+  if (!holder) { return -ENOMEM; }
+
+  spin_lock(&ci->CacheLock);
+  item = find_by_ino_rcu(ci, ino); //!< Элемент кэша на удаление. Он ещё может быть в использовании другими
+  if (item == NULL) {
     res = -ENOENT;
+  } else if (!item->Item.Name.name && item->Item.Name.len == 0) {
+    // Элемент уже в блокировке
+    res = -EINVAL;
   } else {
-    struct ItemInternal* item = container_of(it, struct ItemInternal, Item); //!< Элемент кэша на удаление. Он ещё может быть в использовании другими
-    if (!it->Name.name && it->Name.len == 0) {
-      // Элемент уже в блокировке
-      res = -EINVAL;
-    } else {
-      // Удалим элемент с требуемым номером из кэша
-      unlink_item_wo_lock(item);
-      // Создадим элемент с требуемым номером
-      // Такое удаление/создание требуется, т.к. элемент может быть в использовании
-      res = create_add_item_wo_lock(ci, ino, get_null_qstr(), NULL, NULL);
-    }
-    delete_item_wo_lock(item);
+    // Удалим элемент с требуемым номером из кэша и поставим заглушку.
+    // Такое удаление/создание требуется, т.к. элемент может быть в использовании
+    unlink_item_wo_lock(item);
+    add_item_wo_lock(ci, holder);
+    holder = NULL;
   }
-  write_unlock(&ci->CacheLock);
-
-  // Пользовательские данные после ошибок create_add_item_wo_lock удалять не нужно, т.к. там всё NULL
+  spin_unlock(&ci->CacheLock);
 
+  if (holder) {
+    free_item_rcu(&holder->Rcu);
+  }
   return res;
 }
 
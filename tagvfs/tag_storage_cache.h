@@ -40,6 +40,14 @@ const CacheIterator tagfs_get_item_by_name(Cache cache, const struct qstr name);
 \return указатель на элемент к кэше. Если элемента нет, то NULL */
 const CacheIterator tagfs_get_item_by_ino(Cache cache, size_t ino);
 
+/*! Найти номер элемента по имени. Поиск выполняется без блокировок и без
+изменения счётчика ссылок, поэтому подходит для частых запросов
+\param cache кэш-хранилище
+\param name имя для поиска
+\param ino указатель для возврата номера найденного элемента. Может быть NULL
+\return признак, что элемент найден */
+bool tagfs_get_ino_by_name(Cache cache, const struct qstr name, size_t* ino);
+
 /*! Вставить элемент в кэш. В кэше не должно быть элемента-дубликата с номером ино.
 Также не должно быть дублирующего имени (прим.: пустые имена могут дублироваться)
 Если будет дубликат, то функция вернёт -EEXIST.
@@ -49,7 +57,8 @@ const CacheIterator tagfs_get_item_by_ino(Cache cache, size_t ino);
 \param ino номер/индекс элемента. Номер 0 - допустимое значение
 \param name имя элемента. Имя не может быть пустым (иначе вернётся ошибка -EINVAL)
 \param data указатель на пользовательские данные
-\param remover функция удаления пользовательских данных
+\param remover функция удаления пользовательских данных. Удаление может
+выполняться отложенно (после завершения чтений кэша), поэтому функция не должна засыпать
 \return код ошибки. Если ошибок нет, то возваращается 0 */
 int tagfs_insert_item(Cache cache, size_t ino, const struct qstr name, void* data,
     void (*remover)(void*));
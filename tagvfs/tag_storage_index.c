@@ -0,0 +1,416 @@
+// This file is part of tagvfs
+// Copyright (C) 2023 Evgeny Kislov
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "tag_storage_index.h"
+
+#include <linux/mm.h>
+#include <linux/rwsem.h>
+#include <linux/slab.h>
+
+#include "tag_storage.h"
+
+#define kPostingMinCapacity 16
+
+
+/*! Отсортированный по возрастанию список номеров файлов */
+struct PostingList {
+  u32* inos;
+  size_t amount;
+  size_t capacity;
+};
+
+struct IndexInternal {
+  /*! Блокировка индекса. Используется семафор, т.к. при изменении списков
+  выделяется память (с возможным засыпанием) */
+  struct rw_semaphore lock;
+  size_t tags_amount;
+  struct PostingList files; //!< Список всех активных файлов
+  struct PostingList* tags; //!< Списки файлов для каждого тэга (tags_amount штук)
+};
+
+
+/*! Найти позицию первого элемента, не меньшего ino
+\return позиция в списке (от 0 до amount включительно) */
+size_t posting_lower_bound(const struct PostingList* pl, size_t ino) {
+  size_t left = 0;
+  size_t right = pl->amount;
+
+  while (left < right) {
+    size_t mid = left + (right - left) / 2;
+    if (pl->inos[mid] < ino) {
+      left = mid + 1;
+    } else {
+      right = mid;
+    }
+  }
+  return left;
+}
+
+
+/*! Проверить наличие номера в списке */
+bool posting_contains(const struct PostingList* pl, size_t ino) {
+  size_t pos = posting_lower_bound(pl, ino);
+  return pos < pl->amount && pl->inos[pos] == ino;
+}
+
+
+/*! Добавить номер в список с сохранением сортировки. Если номер уже есть, то
+список не меняется. Блокировка не ставится
+\return отрицательный код ошибки. 0 - ошибок нет */
+int posting_insert_wo_lock(struct PostingList* pl, size_t ino) {
+  size_t pos;
+
+  // Обычно номера добавляются по возрастанию (например, при открытии хранилища)
+  if (pl->amount == 0 || pl->inos[pl->amount - 1] < ino) {
+    pos = pl->amount;
+  } else {
+    pos = posting_lower_bound(pl, ino);
+    if (pos < pl->amount && pl->inos[pos] == ino) { return 0; }
+  }
+
+  if (pl->amount == pl->capacity) {
+    size_t new_cap = pl->capacity ? pl->capacity * 2 : kPostingMinCapacity;
+    u32* new_inos = kvmalloc_array(new_cap, sizeof(u32), GFP_KERNEL);
+
+    if (!new_inos) { return -ENOMEM; }
+    if (pl->amount) {
+      memcpy(new_inos, pl->inos, pl->amount * sizeof(u32));
+    }
+    kvfree(pl->inos);
+    pl->inos = new_inos;
+    pl->capacity = new_cap;
+  }
+
+  memmove(pl->inos + pos + 1, pl->inos + pos, (pl->amount - pos) * sizeof(u32));
+  pl->inos[pos] = ino;
+  ++pl->amount;
+  return 0;
+}
+
+
+/*! Удалить номер из списка. Если номера нет, то ничего не делается.
+Блокировка не ставится */
+void posting_remove_wo_lock(struct PostingList* pl, size_t ino) {
+  size_t pos = posting_lower_bound(pl, ino);
+
+  if (pos >= pl->amount || pl->inos[pos] != ino) { return; }
+  memmove(pl->inos + pos, pl->inos + pos + 1,
+      (pl->amount - pos - 1) * sizeof(u32));
+  --pl->amount;
+}
+
+
+/*! Освободить память списка */
+void posting_release(struct PostingList* pl) {
+  kvfree(pl->inos);
+  pl->inos = NULL;
+  pl->amount = 0;
+  pl->capacity = 0;
+}
+
+
+/*! Привести тэговые списки файла в соответствие маске. Перебираются только
+выставленные тэги старой и новой масок, поэтому при большом количестве тэгов
+обновление не зависит от размера маски. Блокировка не ставится
+\param old_mask прежние тэги файла. NULL - прежние тэги неизвестны, проверяются
+списки всех тэгов
+\return отрицательный код ошибки. 0 - ошибок нет */
+int update_file_tags_wo_lock(struct IndexInternal* ii, size_t ino,
+    const struct TagMask* old_mask, const struct TagMask mask) {
+  size_t tag;
+  int res = 0;
+
+  if (!old_mask) {
+    for (tag = 0; tag < ii->tags_amount; ++tag) {
+      if (!tagmask_check_tag(mask, tag)) {
+        posting_remove_wo_lock(&ii->tags[tag], ino);
+      }
+    }
+  } else {
+    for (tag = tagmask_next_tag(*old_mask, 0); tag < min(old_mask->bit_len,
+        ii->tags_amount); tag = tagmask_next_tag(*old_mask, tag + 1)) {
+      if (!tagmask_check_tag(mask, tag)) {
+        posting_remove_wo_lock(&ii->tags[tag], ino);
+      }
+    }
+  }
+
+  for (tag = tagmask_next_tag(mask, 0); tag < min(mask.bit_len, ii->tags_amount);
+      tag = tagmask_next_tag(mask, tag + 1)) {
+    int r;
+
+    if (old_mask && tagmask_check_tag(*old_mask, tag)) { continue; }
+    r = posting_insert_wo_lock(&ii->tags[tag], ino);
+    if (r) { res = r; }
+  }
+  return res;
+}
+
+
+/*! Фильтр для поиска файлов: списки тэгов, которые у файла должны быть (on)
+и которых быть не должно (off). Списки принадлежат индексу, поэтому фильтр
+действителен, пока существует индекс */
+struct IndexFilterInternal {
+  const struct PostingList** on;
+  size_t on_amount;
+  const struct PostingList** off;
+  size_t off_amount;
+};
+
+
+/*! Выбрать ведущий список фильтра: самый короткий из списков on (или список
+всех файлов). По нему перебираются кандидаты. Блокировка должна быть уже
+поставлена */
+const struct PostingList* filter_driver_wo_lock(struct IndexInternal* ii,
+    const struct IndexFilterInternal* flt) {
+  const struct PostingList* driver = &ii->files;
+  size_t i;
+
+  for (i = 0; i < flt->on_amount; ++i) {
+    if (driver == &ii->files || flt->on[i]->amount < driver->amount) {
+      driver = flt->on[i];
+    }
+  }
+  return driver;
+}
+
+
+/*! Проверить, что кандидат из ведущего списка подходит под фильтр */
+bool filter_check(const struct IndexFilterInternal* flt,
+    const struct PostingList* driver, size_t ino) {
+  size_t i;
+
+  for (i = 0; i < flt->on_amount; ++i) {
+    if (flt->on[i] == driver) { continue; }
+    if (!posting_contains(flt->on[i], ino)) { return false; }
+  }
+  for (i = 0; i < flt->off_amount; ++i) {
+    if (posting_contains(flt->off[i], ino)) { return false; }
+  }
+  return true;
+}
+
+
+// Описание в хедере
+int tagfs_init_index(TagIndex* index, size_t tags_amount) {
+  struct IndexInternal* ii;
+
+  if (index == NULL || (*index) != NULL) { return -EINVAL; }
+
+  ii = kzalloc(sizeof(struct IndexInternal), GFP_KERNEL);
+  if (!ii) { return -ENOMEM; }
+
+  if (tags_amount) {
+    ii->tags = kvcalloc(tags_amount, sizeof(struct PostingList), GFP_KERNEL);
+    if (!ii->tags) {
+      kfree(ii);
+      return -ENOMEM;
+    }
+  }
+
+  init_rwsem(&ii->lock);
+  ii->tags_amount = tags_amount;
+  *index = ii;
+  return 0;
+}
+
+
+// Описание в хедере
+void tagfs_release_index(TagIndex* index) {
+  struct IndexInternal* ii;
+  size_t tag;
+
+  if (index == NULL || (*index) == NULL) { return; }
+
+  ii = (struct IndexInternal*)(*index);
+  for (tag = 0; tag < ii->tags_amount; ++tag) {
+    posting_release(&ii->tags[tag]);
+  }
+  posting_release(&ii->files);
+  kvfree(ii->tags);
+  kfree(ii);
+  *index = NULL;
+}
+
+
+// Описание в хедере
+int tagfs_index_add_file(TagIndex index, size_t ino, const struct TagMask mask) {
+  struct IndexInternal* ii = (struct IndexInternal*)(index);
+  const struct TagMask no_tags = tagmask_empty();
+  int res;
+
+  if (unlikely(!ii)) { return -EINVAL; }
+  if (ino > U32_MAX) { return -ERANGE; }
+
+  down_write(&ii->lock);
+  if (posting_contains(&ii->files, ino)) {
+    res = update_file_tags_wo_lock(ii, ino, NULL, mask);
+  } else {
+    // Новый файл не может быть в списках тэгов
+    res = posting_insert_wo_lock(&ii->files, ino);
+    if (!res) {
+      res = update_file_tags_wo_lock(ii, ino, &no_tags, mask);
+    }
+  }
+  up_write(&ii->lock);
+  return res;
+}
+
+
+// Описание в хедере
+int tagfs_index_update_file(TagIndex index, size_t ino,
+    const struct TagMask* old_mask, const struct TagMask mask) {
+  struct IndexInternal* ii = (struct IndexInternal*)(index);
+  int res = -ENOENT;
+
+  if (unlikely(!ii)) { return -EINVAL; }
+  if (ino > U32_MAX) { return -ERANGE; }
+
+  down_write(&ii->lock);
+  if (posting_contains(&ii->files, ino)) {
+    res = update_file_tags_wo_lock(ii, ino, old_mask, mask);
+  }
+  up_write(&ii->lock);
+  return res;
+}
+
+
+// Описание в хедере
+void tagfs_index_del_file(TagIndex index, size_t ino, const struct TagMask* mask) {
+  struct IndexInternal* ii = (struct IndexInternal*)(index);
+
+  if (unlikely(!ii) || ino > U32_MAX) { return; }
+
+  down_write(&ii->lock);
+  posting_remove_wo_lock(&ii->files, ino);
+  update_file_tags_wo_lock(ii, ino, mask, tagmask_empty());
+  up_write(&ii->lock);
+}
+
+
+// Описание в хедере
+void tagfs_index_clear_tag(TagIndex index, size_t tag) {
+  struct IndexInternal* ii = (struct IndexInternal*)(index);
+
+  if (unlikely(!ii) || tag >= ii->tags_amount) { return; }
+
+  down_write(&ii->lock);
+  posting_release(&ii->tags[tag]);
+  up_write(&ii->lock);
+}
+
+
+// Описание в хедере
+int tagfs_index_init_filter(TagIndex index, IndexFilter* filter,
+    const struct TagMask on_mask, const struct TagMask off_mask) {
+  struct IndexInternal* ii = (struct IndexInternal*)(index);
+  struct IndexFilterInternal* flt;
+  size_t on_bits = tagmask_on_bits_amount(on_mask);
+  size_t off_bits = tagmask_on_bits_amount(off_mask);
+  size_t tag;
+
+  if (unlikely(!ii)) { return -EINVAL; }
+  if (filter == NULL || (*filter) != NULL) { return -EINVAL; }
+
+  flt = kzalloc(sizeof(struct IndexFilterInternal) +
+      (on_bits + off_bits) * sizeof(struct PostingList*), GFP_KERNEL);
+  if (!flt) { return -ENOMEM; }
+  flt->on = (const struct PostingList**)(flt + 1);
+  flt->off = flt->on + on_bits;
+
+  // Перебираются только выставленные биты масок
+  for (tag = tagmask_next_tag(on_mask, 0); tag < min(on_mask.bit_len,
+      ii->tags_amount) && flt->on_amount < on_bits;
+      tag = tagmask_next_tag(on_mask, tag + 1)) {
+    flt->on[flt->on_amount++] = &ii->tags[tag];
+  }
+  for (tag = tagmask_next_tag(off_mask, 0); tag < min(off_mask.bit_len,
+      ii->tags_amount) && flt->off_amount < off_bits;
+      tag = tagmask_next_tag(off_mask, tag + 1)) {
+    flt->off[flt->off_amount++] = &ii->tags[tag];
+  }
+
+  *filter = flt;
+  return 0;
+}
+
+
+// Описание в хедере
+void tagfs_index_release_filter(IndexFilter* filter) {
+  if (filter == NULL || (*filter) == NULL) { return; }
+
+  kfree(*filter);
+  *filter = NULL;
+}
+
+
+// Описание в хедере
+size_t tagfs_index_next_file(TagIndex index, IndexFilter filter, size_t ino) {
+  struct IndexInternal* ii = (struct IndexInternal*)(index);
+  const struct IndexFilterInternal* flt = (const struct IndexFilterInternal*)(filter);
+  const struct PostingList* driver;
+  size_t pos;
+  size_t res = kNotFoundIno;
+
+  if (unlikely(!ii || !flt)) { return kNotFoundIno; }
+
+  down_read(&ii->lock);
+  driver = filter_driver_wo_lock(ii, flt);
+  pos = ino == kNotFoundIno ? 0 : posting_lower_bound(driver, ino + 1);
+  for (; pos < driver->amount; ++pos) {
+    size_t cand = driver->inos[pos];
+    if (filter_check(flt, driver, cand)) {
+      res = cand;
+      break;
+    }
+  }
+  up_read(&ii->lock);
+  return res;
+}
+
+
+// Описание в хедере
+size_t tagfs_index_nth_file(TagIndex index, IndexFilter filter, size_t nth) {
+  struct IndexInternal* ii = (struct IndexInternal*)(index);
+  const struct IndexFilterInternal* flt = (const struct IndexFilterInternal*)(filter);
+  const struct PostingList* driver;
+  size_t pos;
+  size_t res = kNotFoundIno;
+
+  if (unlikely(!ii || !flt)) { return kNotFoundIno; }
+
+  down_read(&ii->lock);
+  driver = filter_driver_wo_lock(ii, flt);
+  if (flt->on_amount == 0 && flt->off_amount == 0) {
+    // Фильтра нет - выдаём файл по позиции напрямую
+    if (nth < driver->amount) { res = driver->inos[nth]; }
+    goto ex;
+  }
+
+  for (pos = 0; pos < driver->amount; ++pos) {
+    size_t cand = driver->inos[pos];
+    if (!filter_check(flt, driver, cand)) { continue; }
+    if (nth == 0) {
+      res = cand;
+      break;
+    }
+    --nth;
+  }
+
+ex:
+  up_read(&ii->lock);
+  return res;
+}
@@ -0,0 +1,99 @@
+// This file is part of tagvfs
+// Copyright (C) 2023 Evgeny Kislov
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef TAG_STORAGE_INDEX_H
+#define TAG_STORAGE_INDEX_H
+
+#include <linux/kernel.h>
+
+#include "tag_tag_mask.h"
+
+/*! Индекс файлов по тэгам (инвертированный индекс). Для каждого тэга хранится
+отсортированный список номеров (ino) файлов, у которых этот тэг выставлен.
+Дополнительно хранится список всех активных файлов. Индекс позволяет выдавать
+содержимое директорий пересечением списков вместо перебора всех файлов. */
+typedef void* TagIndex;
+
+
+/*! Создать и инициализировать пустой индекс
+\param index указатель на переменную для индекса. Изначально в переменной должен быть NULL
+\param tags_amount количество тэгов (размер маски тэгов) в хранилище
+\return отрицательный код ошибки. Если ошибок нет - возвращается 0 */
+int tagfs_init_index(TagIndex* index, size_t tags_amount);
+
+/*! Удалить индекс, освободить все ресурсы
+\param index указатель на переменную с удаляемым индексом */
+void tagfs_release_index(TagIndex* index);
+
+/*! Добавить файл в индекс. Если файл уже есть в индексе, то обновляются
+только его тэги
+\param ino номер файла
+\param mask маска тэгов файла. Может быть пустой (файл без тэгов)
+\return отрицательный код ошибки. 0 - ошибок нет */
+int tagfs_index_add_file(TagIndex index, size_t ino, const struct TagMask mask);
+
+/*! Обновить тэги файла в индексе. Файл должен быть уже добавлен в индекс.
+Если известна прежняя маска, то обновляются только списки изменившихся тэгов
+\param ino номер файла
+\param old_mask прежняя маска тэгов файла. Может быть NULL (тогда
+просматриваются списки всех тэгов)
+\param mask новая маска тэгов файла
+\return отрицательный код ошибки (-ENOENT - файла нет в индексе). 0 - ошибок нет */
+int tagfs_index_update_file(TagIndex index, size_t ino,
+    const struct TagMask* old_mask, const struct TagMask mask);
+
+/*! Удалить файл из индекса (из списка файлов и из списков его тэгов).
+Если файла нет в индексе, то ничего не делается
+\param ino номер удаляемого файла
+\param mask маска тэгов файла. Может быть NULL (тогда файл удаляется из
+списков всех тэгов) */
+void tagfs_index_del_file(TagIndex index, size_t ino, const struct TagMask* mask);
+
+/*! Очистить список файлов у тэга. Используется при удалении тэга
+\param tag номер тэга */
+void tagfs_index_clear_tag(TagIndex index, size_t tag);
+
+/*! Фильтр поиска файлов по маскам тэгов. Строится один раз (например, на всё
+время перебора директории) и используется во многих поисках. Фильтр
+действителен, пока существует индекс */
+typedef void* IndexFilter;
+
+/*! Создать фильтр поиска файлов
+\param filter указатель на переменную для фильтра. Изначально в переменной должен быть NULL
+\param on_mask маска тэгов, которые должны быть у файла
+\param off_mask маска тэгов, которых не должно быть у файла
+\return отрицательный код ошибки. 0 - ошибок нет */
+int tagfs_index_init_filter(TagIndex index, IndexFilter* filter,
+    const struct TagMask on_mask, const struct TagMask off_mask);
+
+/*! Удалить фильтр поиска файлов
+\param filter указатель на переменную с удаляемым фильтром */
+void tagfs_index_release_filter(IndexFilter* filter);
+
+/*! Найти следующий (после ino) файл, подходящий под фильтр
+\param filter фильтр (см. tagfs_index_init_filter)
+\param ino номер файла, после которого искать. kNotFoundIno - искать с начала
+\return номер найденного файла или kNotFoundIno, если файлов больше нет */
+size_t tagfs_index_next_file(TagIndex index, IndexFilter filter, size_t ino);
+
+/*! Найти файл с порядковым номером nth (с нуля) среди подходящих под фильтр.
+Для пустого фильтра (все файлы) поиск выполняется за O(1)
+\param filter фильтр (см. tagfs_index_init_filter)
+\param nth порядковый номер файла
+\return номер найденного файла или kNotFoundIno */
+size_t tagfs_index_nth_file(TagIndex index, IndexFilter filter, size_t nth);
+
+#endif // TAG_STORAGE_INDEX_H
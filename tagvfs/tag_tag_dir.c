@@ -39,6 +39,7 @@ struct FileInfo {
   size_t last_iterate_tag; //!< Номер тэга, соответствующий last_iterate_pos. Или kNotFoundIno - если позиция не тэг
   size_t last_iterate_file; //!< Номер файла, соответствующего last_iterate_pos. Или kNotFoundIno - если позиция не файл
   loff_t aftertag_pos; //!< Позиция в каталоге после последнего тэга (начинаются файлы)
+  FileFilter filter; //!< Фильтр файлов директории, строится при открытии директории
 };
 
 
@@ -59,7 +60,6 @@ struct dentry* tagfs_tag_dir_lookup(struct inode* dir, struct dentry *de,
   Storage stor;
   size_t tagino, fileino;
   struct InodeInfo* dir_info = get_inode_info(dir);
-  struct TagMask mask = tagmask_empty();
   bool mask_suitable;
   struct qstr np;
   bool no_tag = false;
@@ -96,20 +96,19 @@ struct dentry* tagfs_tag_dir_lookup(struct inode* dir, struct dentry *de,
     iinfo->on_mask = tagmask_init_by_mask(dir_info->on_mask);
     iinfo->off_mask = tagmask_init_by_mask(dir_info->off_mask);
     if (no_tag) {
-      tagmask_set_tag(iinfo->off_mask, tagino, true);
+      tagmask_set_tag(&iinfo->off_mask, tagino, true);
     } else {
-      tagmask_set_tag(iinfo->on_mask, tagino, true);
+      tagmask_set_tag(&iinfo->on_mask, tagino, true);
     }
 
     return NULL;
   }
 
   // Имя - это файл
-  fileino = tagfs_get_fileino_by_name(stor, de->d_name, &mask);
-  mask_suitable = tagmask_check_filter(mask, dir_info->on_mask,
-      dir_info->off_mask);
-  tagmask_release(&mask);
-  if (!mask_suitable || fileino == kNotFoundIno) {
+  fileino = tagfs_get_fileino_by_name(stor, de->d_name, NULL);
+  mask_suitable = fileino != kNotFoundIno && tagfs_check_file_filter(stor,
+      fileino, dir_info->on_mask, dir_info->off_mask);
+  if (!mask_suitable) {
     d_set_d_op(de, &tagfs_tag_dir_negative_dentry_ops);
     d_add(de, NULL);
     return NULL;
@@ -122,6 +121,17 @@ struct dentry* tagfs_tag_dir_lookup(struct inode* dir, struct dentry *de,
 }
 
 
+/*! Колбэк для сравнения целевой ссылки файла с новой ссылкой
+\param ctx новая целевая ссылка (struct qstr)
+\return 0 - ссылки совпадают, -EEXIST - отличаются */
+int check_same_target(void* ctx, size_t ino, const struct qstr name,
+    const struct TagMask mask, const struct qstr target) {
+  const struct qstr* income = (const struct qstr*)(ctx);
+
+  return compare_qstr(target, *income) == 0 ? 0 : -EEXIST;
+}
+
+
 /*! Колбэк на создание символьной ссылки в каталоге. В колбэк передаётся негативный
 dentry, который нужно дополнить новым inode.
 \param dir директория, в которой создаётся новая ссылка
@@ -141,27 +151,15 @@ int tagfs_tag_dir_symlink(struct inode* dir, struct dentry* de, const char* name
   // исходная маска mask (для нового файла она заполнена нулями)
   ino = tagfs_get_fileino_by_name(stor, de->d_name, &mask);
   if (ino != kNotFoundIno) {
-    struct qstr target = get_null_qstr();
-    struct qstr income = alloc_qstr_from_str(name, strlen(name)); // TODO PERFORMANCE. REMOVE allocation
-    target = tagfs_get_file_link(stor, ino);
-    if (!income.name) {
-      res = -ENOMEM;
-      goto exist_err;
-    }
-
-    if (compare_qstr(target, income) != 0) {
-      // Попытка создать символьную ссылку с существующим именем, указывающую на
-      // другой файл. Говорим, что такой файл уже есть
-      res = -EEXIST;
-      goto exist_err;
+    struct qstr income = QSTR_INIT(name, strlen(name));
+
+    // Попытка создать символьную ссылку с существующим именем, указывающую на
+    // другой файл, завершится ошибкой - такой файл уже есть
+    res = tagfs_visit_file(stor, ino, check_same_target, &income);
+    if (res) {
+      tagmask_release(&mask);
+      return res == -ENOENT ? -EFAULT : res;
     }
-
-    // -------
-exist_err:
-    free_qstr(&income);
-    free_qstr(&target);
-
-    if (res) { return res; }
   } else {
     // Создаём новый файл
     ino = tagfs_add_new_file(stor, name, de->d_name);
@@ -173,8 +171,8 @@ exist_err:
   // Создадим ноду, пропишем маски и операции
   WARN_ON(tagmask_is_empty(mask));
   WARN_ON(ino == kNotFoundIno);
-  tagmask_or_mask(mask, dir_info->on_mask);
-  tagmask_exclude_mask(mask, dir_info->off_mask);
+  tagmask_or_mask(&mask, dir_info->on_mask);
+  tagmask_exclude_mask(&mask, dir_info->off_mask);
   res = tagfs_set_file_mask(stor, ino, mask);
   tagmask_release(&mask);
   if (res) { return res; }
@@ -225,10 +223,10 @@ int tagfs_tag_dir_unlink(struct inode* dir, struct dentry* de) {
   // Модифицируем маску файла: удаляем/добавляем соответствующий тэг
   mask_bit = tagmask_check_tag(mask, dir_info->tag_ino);
   if (dir_info->on_tag) {
-    if (mask_bit) { tagmask_set_tag(mask, dir_info->tag_ino, false); }
+    if (mask_bit) { tagmask_set_tag(&mask, dir_info->tag_ino, false); }
     else { res = -EINVAL; }
   } else {
-    if (!mask_bit) { tagmask_set_tag(mask, dir_info->tag_ino, true); }
+    if (!mask_bit) { tagmask_set_tag(&mask, dir_info->tag_ino, true); }
     else { res = -EINVAL; }
   }
   res = tagfs_set_file_mask(stor, fileino, mask);
@@ -265,8 +263,8 @@ int tagfs_tag_dir_mkdir(struct inode* dir,struct dentry* de, umode_t mode) {
   mask_len = tagfs_get_maximum_tags_amount(stor);
   new_info->on_mask = tagmask_init_by_tag(mask_len, tagino);
   new_info->off_mask = tagmask_init_zero(mask_len);
-  tagmask_or_mask(new_info->on_mask, dir_info->on_mask);
-  tagmask_or_mask(new_info->off_mask, dir_info->off_mask);
+  tagmask_or_mask(&new_info->on_mask, dir_info->on_mask);
+  tagmask_or_mask(&new_info->off_mask, dir_info->off_mask);
   return 0;
 }
 
@@ -288,7 +286,7 @@ int tagfs_tag_dir_iterate_tag(struct dir_context* dc, Storage stor,
   struct qstr noprefix = tagfs_get_no_prefix(stor);
   // Готовим маску с тэгами, которые уже были (excl_mask)
   excl_mask = tagmask_init_by_mask(iinfo->on_mask);
-  tagmask_or_mask(excl_mask, iinfo->off_mask);
+  tagmask_or_mask(&excl_mask, iinfo->off_mask);
 
 
   BUG_ON(dc->pos < kAfterDotsPos);
@@ -378,30 +376,31 @@ int tagfs_tag_dir_iterate_file(struct dir_context* dc, Storage stor,
   size_t file_start;
   size_t file_ino;
   size_t file_pos;
+  struct DirEmitFile ef;
+  int res;
 
   // Перейдём к обработке файлов
   file_start = dc->pos - fi->aftertag_pos;
   if (fi->last_iterate_file == -1 || file_start == 0) {
     // Выдадим самый первый файл
-    struct qstr name = tagfs_get_nth_file(stor, iinfo->on_mask, iinfo->off_mask,
-        0, &file_ino);
-    if (!name.name) {
+    bool emit = dc->pos == fi->aftertag_pos;
+
+    res = tagfs_visit_nth_file(stor, fi->filter, 0, &file_ino,
+        emit ? copy_file_for_emit : NULL, &ef);
+    if (res == -ENOENT) {
       // Нету файлов. Вообще
       return 0;
     }
-
-    if (dc->pos == fi->aftertag_pos) {
-      if (!dir_emit(dc, name.name, name.len, file_ino + kFSRealFilesStartIno, DT_LNK)) {
-        free_qstr(&name);
-        return -ENOMEM;
-      }
+    if (res) { return res; }
+    if (emit) {
+      res = emit_copied_file(dc, &ef);
+      if (res) { return res; }
       dc->pos += 1;
     }
 
     fi->last_iterate_pos = fi->aftertag_pos;
     fi->last_iterate_file = file_ino;
     fi->last_iterate_tag = -1;
-    free_qstr(&name);
   }
 
   // Выдадим остальные файлы
@@ -411,24 +410,21 @@ int tagfs_tag_dir_iterate_file(struct dir_context* dc, Storage stor,
   file_ino = fi->last_iterate_file;
   file_pos = fi->last_iterate_pos;
   while (true) {
-    struct qstr name = tagfs_get_next_file(stor, iinfo->on_mask, iinfo->off_mask,
-        &file_ino);
-    if (!name.name) {
-      return 0;
-    }
-    ++file_pos;
+    bool emit = dc->pos == file_pos + 1;
 
-    if (dc->pos == file_pos) {
-      if (!dir_emit(dc, name.name, name.len, file_ino + kFSRealFilesStartIno, DT_LNK)) {
-        free_qstr(&name);
-        return -ENOMEM;
-      }
+    res = tagfs_visit_next_file(stor, fi->filter, &file_ino,
+        emit ? copy_file_for_emit : NULL, &ef);
+    if (res == -ENOENT) { return 0; }
+    if (res) { return res; }
+    if (emit) {
+      res = emit_copied_file(dc, &ef);
+      if (res) { return res; }
       dc->pos += 1;
     }
+    ++file_pos;
 
     fi->last_iterate_pos = file_pos;
     fi->last_iterate_file = file_ino;
-    free_qstr(&name);
   }
 }
 
@@ -464,21 +460,34 @@ int tagfs_tag_dir_iterate(struct file* f, struct dir_context* dc) {
 
 int tagfs_tag_dir_open(struct inode* dir, struct file* f) {
   struct FileInfo* fi;
+  struct InodeInfo* iinfo;
+  int res;
 
+  iinfo = get_inode_info(dir); BUG_ON(!iinfo);
   fi = (struct FileInfo*)kzalloc(sizeof(struct FileInfo), GFP_KERNEL);
   if (fi == NULL) { return -ENOMEM; }
-  f->private_data = fi;
   fi->last_iterate_pos = -1;
   fi->last_iterate_tag = kNotFoundIno;
   fi->last_iterate_file = kNotFoundIno;
   fi->aftertag_pos = -1;
+  // Маски директории не меняются, поэтому фильтр строится один раз
+  res = tagfs_init_file_filter(inode_storage(dir), &fi->filter, iinfo->on_mask,
+      iinfo->off_mask);
+  if (res) {
+    kfree(fi);
+    return res;
+  }
+  f->private_data = fi;
 
   return 0;
 }
 
 int tagfs_tag_dir_release(struct inode* dir, struct file* f) {
-  WARN_ON(!f->private_data);
-  kfree(f->private_data);
+  struct FileInfo* fi = f->private_data;
+
+  WARN_ON(!fi);
+  if (fi) { tagfs_release_file_filter(&fi->filter); }
+  kfree(fi);
   return 0;
 }
 
@@ -16,11 +16,19 @@
 
 #include "tag_tag_mask.h"
 
+#include <linux/bitops.h>
 #include <linux/slab.h>
 
 #define kMaskSizeAlignment 8
 
-const struct TagMask kEmptyMask = { .data = NULL, .bit_len = 0, .byte_len = 0 };
+/*! Данные маски обрабатываются 64-битными словами. Размер маски выровнен на
+kMaskSizeAlignment, а память под неё выделяется kzalloc или во встроенном
+буфере (с выравниванием не меньше 8 байт), поэтому хвост из отдельных байтов
+бывает только у заимствованных масок */
+#define kMaskWordSize sizeof(u64)
+
+const struct TagMask kEmptyMask = { .data = NULL, .bit_len = 0, .byte_len = 0,
+    .storage = kTagMaskNone };
 
 /* Выдать номер байта и положение для тэга */
 size_t GetTagPosition(size_t tag, u8* byte_mask) {
@@ -38,16 +46,21 @@ size_t tagmask_get_byte_len(size_t mask_len) {
 
 
 struct TagMask tagmask_init_zero(size_t mask_len) {
-  struct TagMask res;
+  struct TagMask res = kEmptyMask;
 
-  if (mask_len == 0) { return tagmask_empty(); }
+  if (mask_len == 0) { return res; }
   res.bit_len = mask_len;
-  res.byte_len = (mask_len + kMaskSizeAlignment * 8 - 1) /
-      (kMaskSizeAlignment * 8) * kMaskSizeAlignment;
+  res.byte_len = tagmask_get_byte_len(mask_len);
+  if (res.byte_len <= kTagMaskInlineSize) {
+    res.storage = kTagMaskInline;
+    return res;
+  }
+
   res.data = kzalloc(res.byte_len, GFP_KERNEL);
   if (!res.data) {
     return tagmask_empty();
   }
+  res.storage = kTagMaskHeap;
   return res;
 }
 
@@ -57,7 +70,7 @@ struct TagMask tagmask_init_by_tag(size_t mask_len, size_t tag) {
   if (tag >= mask_len) { return tagmask_empty(); }
   res = tagmask_init_zero(mask_len);
   if (tagmask_is_empty(res)) { return res; }
-  tagmask_set_tag(res, tag, true);
+  tagmask_set_tag(&res, tag, true);
   return res;
 }
 
@@ -72,7 +85,7 @@ struct TagMask tagmask_init_by_mask(const struct TagMask mask) {
     return tagmask_empty();
   }
 
-  memcpy(res.data, mask.data, res.byte_len);
+  memcpy(tagmask_data(&res), tagmask_const_data(&mask), res.byte_len);
   return res;
 }
 
@@ -82,17 +95,53 @@ struct TagMask tagmask_empty(void) {
 }
 
 
+// Описание в хедере
+struct TagMask tagmask_borrow(void* data, size_t byte_len) {
+  struct TagMask res = kEmptyMask;
+
+  if (!data || !byte_len) { return res; }
+  res.data = data;
+  res.bit_len = byte_len * BITS_PER_BYTE;
+  res.byte_len = byte_len;
+  res.storage = kTagMaskBorrowed;
+  return res;
+}
+
+
+// Описание в хедере
+void* tagmask_data(struct TagMask* mask) {
+  switch (mask->storage) {
+    case kTagMaskInline:
+      return mask->inline_data;
+    case kTagMaskHeap:
+    case kTagMaskBorrowed:
+      return mask->data;
+    case kTagMaskNone:
+      break;
+  }
+  return NULL;
+}
+
+
+// Описание в хедере
+const void* tagmask_const_data(const struct TagMask* mask) {
+  return tagmask_data((struct TagMask*)mask);
+}
+
+
 /*! Удалить маску, освободить ресурсы
 \param mask - удаляемая маска */
 void tagmask_release(struct TagMask* mask) {
   if (!mask) { return; }
-  kfree(mask->data);
+  if (mask->storage == kTagMaskHeap) {
+    kfree(mask->data);
+  }
   *mask = kEmptyMask;
 }
 
 bool tagmask_is_empty(const struct TagMask mask) {
-  WARN_ON(mask.data && !(mask.byte_len && mask.bit_len));
-  return mask.data == NULL;
+  WARN_ON(mask.storage != kTagMaskNone && !(mask.byte_len && mask.bit_len));
+  return mask.storage == kTagMaskNone;
 }
 
 bool tagmask_check_tag(const struct TagMask mask, size_t tag) {
@@ -101,104 +150,197 @@ bool tagmask_check_tag(const struct TagMask mask, size_t tag) {
 
   if (tag >= mask.bit_len) { return false; }
   pos = GetTagPosition(tag, &m);
-  return (((u8*)mask.data)[pos] & m) != 0;
+  return (((const u8*)tagmask_const_data(&mask))[pos] & m) != 0;
 }
 
 
 size_t tagmask_on_bits_amount(const struct TagMask mask) {
+  const size_t words = mask.byte_len / kMaskWordSize;
+  const void* data = tagmask_const_data(&mask);
   size_t pos;
   size_t c = 0;
 
-  for (pos = 0; pos < mask.byte_len; ++pos) {
-    u8 v = ((u8*)mask.data)[pos];
-    if (v & 0x01) { ++c; }
-    if (v & 0x02) { ++c; }
-    if (v & 0x04) { ++c; }
-    if (v & 0x08) { ++c; }
-    if (v & 0x10) { ++c; }
-    if (v & 0x20) { ++c; }
-    if (v & 0x40) { ++c; }
-    if (v & 0x80) { ++c; }
+  for (pos = 0; pos < words; ++pos) {
+    c += hweight64(((const u64*)data)[pos]);
+  }
+  for (pos = words * kMaskWordSize; pos < mask.byte_len; ++pos) {
+    c += hweight8(((const u8*)data)[pos]);
   }
 
   return c;
 }
 
-void tagmask_set_tag(struct TagMask mask, size_t tag, bool state) {
+void tagmask_set_tag(struct TagMask* mask, size_t tag, bool state) {
   size_t pos;
   u8 m;
+  u8* data;
 
-  if (tag >= mask.bit_len) { return; }
+  if (tag >= mask->bit_len) { return; }
   pos = GetTagPosition(tag, &m);
+  data = tagmask_data(mask);
   if (state) {
-    ((u8*)mask.data)[pos] |= m;
+    data[pos] |= m;
   } else {
-    ((u8*)mask.data)[pos] &= ~m;
+    data[pos] &= ~m;
   }
 }
 
 
-void tagmask_fill_from_buffer(struct TagMask mask, void* buf, size_t buf_size) {
-  size_t l = mask.byte_len;
+void tagmask_fill_from_buffer(struct TagMask* mask, const void* buf, size_t buf_size) {
+  size_t l = mask->byte_len;
+  void* data = tagmask_data(mask);
+
   if (l > buf_size) {
-    memcpy(mask.data, buf, buf_size);
-    memset(mask.data + buf_size, 0, l - buf_size);
+    memcpy(data, buf, buf_size);
+    memset(data + buf_size, 0, l - buf_size);
   } else {
-    memcpy(mask.data, buf, l);
+    memcpy(data, buf, l);
   }
 }
 
 
 /*! Логические операции над масками ??? */
-void tagmask_or_mask(struct TagMask result, const struct TagMask arg) {
-  size_t ml = result.byte_len;
+void tagmask_or_mask(struct TagMask* result, const struct TagMask arg) {
+  size_t ml = result->byte_len;
+  void* dst = tagmask_data(result);
+  const void* src = tagmask_const_data(&arg);
   size_t i;
 
   if (arg.byte_len < ml) { ml = arg.byte_len; }
-  for (i = 0; i < ml; ++i) {
-    ((u8*)result.data)[i] |= ((u8*)arg.data)[i];
+  for (i = 0; i < ml / kMaskWordSize; ++i) {
+    ((u64*)dst)[i] |= ((const u64*)src)[i];
+  }
+  for (i *= kMaskWordSize; i < ml; ++i) {
+    ((u8*)dst)[i] |= ((const u8*)src)[i];
   }
 }
 
 
-void tagmask_exclude_mask(struct TagMask result, struct TagMask arg) {
-  size_t ml = result.byte_len;
+void tagmask_exclude_mask(struct TagMask* result, const struct TagMask arg) {
+  size_t ml = result->byte_len;
+  void* dst = tagmask_data(result);
+  const void* src = tagmask_const_data(&arg);
   size_t i;
 
   if (arg.byte_len < ml) { ml = arg.byte_len; }
-  for (i = 0; i < ml; ++i) {
-    ((u8*)result.data)[i] &= ~(((u8*)arg.data)[i]);
+  for (i = 0; i < ml / kMaskWordSize; ++i) {
+    ((u64*)dst)[i] &= ~(((const u64*)src)[i]);
+  }
+  for (i *= kMaskWordSize; i < ml; ++i) {
+    ((u8*)dst)[i] &= ~(((const u8*)src)[i]);
   }
 }
 
 
 bool tagmask_check_filter(const struct TagMask item, const struct TagMask on_mask,
     const struct TagMask off_mask) {
+  const void* di = tagmask_const_data(&item);
+  const void* don = tagmask_const_data(&on_mask);
+  const void* doff = tagmask_const_data(&off_mask);
   size_t i;
 
   if (on_mask.byte_len != off_mask.byte_len) { return false; }
   if (item.byte_len != on_mask.byte_len) { return false; }
-  if (!item.data || !on_mask.data || !off_mask.data) { return false; }
+  if (!di || !don || !doff) { return false; }
 
-  for (i = 0; i < item.byte_len; ++i) { // TODO IMPROVE PERFORMANCE (x*8 byte)
-    const u8 vi = ((const u8*)item.data)[i];
-    const u8 von = ((const u8*)on_mask.data)[i];
-    const u8 voff = ((const u8*)off_mask.data)[i];
+  // Отказ, если нет хотя бы одного тэга из on_mask или есть хотя бы один из off_mask
+  for (i = 0; i < item.byte_len / kMaskWordSize; ++i) {
+    const u64 vi = ((const u64*)di)[i];
+    const u64 von = ((const u64*)don)[i];
+    const u64 voff = ((const u64*)doff)[i];
 
-    if ((vi & von) != von) { return false; }
-    if ((~vi & voff) != voff) { return false; }
+    if ((von & ~vi) | (voff & vi)) { return false; }
+  }
+  for (i *= kMaskWordSize; i < item.byte_len; ++i) {
+    const u8 vi = ((const u8*)di)[i];
+    const u8 von = ((const u8*)don)[i];
+    const u8 voff = ((const u8*)doff)[i];
+
+    if ((von & ~vi) | (voff & vi)) { return false; }
   }
   return true;
 }
 
 
+// Описание в хедере
+size_t tagmask_next_tag(const struct TagMask mask, size_t tag) {
+  const u8* data = tagmask_const_data(&mask);
+  size_t pos;
+
+  if (!data) { return mask.bit_len; }
+
+  // Пустые слова пропускаются целиком
+  for (pos = tag / 8; pos < mask.byte_len && tag < mask.bit_len; pos = tag / 8) {
+    u8 v;
+
+    if (tag % 64 == 0 && pos + kMaskWordSize <= mask.byte_len &&
+        pos % kMaskWordSize == 0 && ((const u64*)data)[pos / kMaskWordSize] == 0) {
+      tag += 64;
+      continue;
+    }
+    v = data[pos] >> (tag % 8);
+    if (v) {
+      tag += __ffs(v);
+      return tag < mask.bit_len ? tag : mask.bit_len;
+    }
+    tag = (pos + 1) * 8;
+  }
+  return mask.bit_len;
+}
+
+
+// Описание в хедере
+size_t tagmask_get_tags(const struct TagMask mask, u16* tags, size_t max_amount) {
+  size_t amount = 0;
+  size_t tag;
+
+  for (tag = tagmask_next_tag(mask, 0); tag < mask.bit_len;
+      tag = tagmask_next_tag(mask, tag + 1)) {
+    if (amount < max_amount) { tags[amount] = tag; }
+    ++amount;
+  }
+  return amount;
+}
+
+
+// Описание в хедере
+void tagmask_fill_from_tags(struct TagMask* mask, const u16* tags, size_t amount) {
+  void* data = tagmask_data(mask);
+  size_t i;
+
+  if (!data) { return; }
+  memset(data, 0, mask->byte_len);
+  for (i = 0; i < amount; ++i) {
+    tagmask_set_tag(mask, tags[i], true);
+  }
+}
+
+
+// Описание в хедере
+bool tagmask_check_filter_tags(const u16* tags, size_t amount,
+    const struct TagMask on_mask, const struct TagMask off_mask) {
+  size_t on_found = 0;
+  size_t i;
+
+  if (on_mask.byte_len != off_mask.byte_len) { return false; }
+
+  for (i = 0; i < amount; ++i) {
+    if (tagmask_check_tag(off_mask, tags[i])) { return false; }
+    if (tagmask_check_tag(on_mask, tags[i])) { ++on_found; }
+  }
+  // Все тэги из on_mask должны найтись в наборе
+  return on_found == tagmask_on_bits_amount(on_mask);
+}
+
+
 // LCOV_EXCL_START
 void tagmask_printk(const struct TagMask mask) {
+  const void* data = tagmask_const_data(&mask);
   size_t i;
 
   pr_info("Mask: bit size: %zu (%zu bytes) - ", mask.bit_len, mask.byte_len);
   for (i = 0; i < mask.byte_len / 4; ++i) {
-    pr_cont("%08x ", ((u32*)mask.data)[i]);
+    pr_cont("%08x ", ((const u32*)data)[i]);
   }
   pr_cont("\n");
 }
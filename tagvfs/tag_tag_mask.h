@@ -20,11 +20,25 @@
 #include <linux/kernel.h>
 
 
-/*! Структура, описывающая набор тэгов */
+#define kTagMaskInlineSize 16 //!< Маски до 128 тэгов хранятся прямо в структуре, без выделения памяти
+
+/*! Место хранения данных маски */
+enum TagMaskStorage {
+  kTagMaskNone = 0, //!< Пустая маска, данных нет
+  kTagMaskInline = 1, //!< Данные во встроенном буфере структуры
+  kTagMaskHeap = 2, //!< Данные выделены в куче, удаляются tagmask_release
+  kTagMaskBorrowed = 3 //!< Данные заимствованы (принадлежат кому-то другому), не удаляются
+};
+
+/*! Структура, описывающая набор тэгов. Небольшие маски хранятся во встроенном
+буфере, поэтому доступ к данным - только через tagmask_data/tagmask_const_data
+(при копировании структуры встроенные данные копируются вместе с ней) */
 struct TagMask {
-  void* data;
+  void* data; //!< Данные маски в куче или заимствованные. Для встроенной маски не используется
   size_t bit_len;
   size_t byte_len;
+  enum TagMaskStorage storage;
+  u64 inline_data[kTagMaskInlineSize / sizeof(u64)];
 };
 
 /*! Выдать байтовый размер маски в зависимости от битового размера
@@ -50,6 +64,21 @@ struct TagMask tagmask_init_by_mask(const struct TagMask mask);
 /*! ??? */
 struct TagMask tagmask_empty(void);
 
+/*! Создать маску, заимствующую чужие данные (например, маску в записи
+таблицы файлов или в прочитанном блоке хранилища). Данные не копируются и не
+удаляются, поэтому должны жить дольше маски
+\param data, byte_len данные маски и их размер в байтах
+\return маска, которую можно удалять через tagmask_release (данные не удаляются) */
+struct TagMask tagmask_borrow(void* data, size_t byte_len);
+
+/*! Выдать указатель на данные маски (с учётом встроенного буфера)
+\param mask маска. Указатель действителен, пока существует именно эта структура
+\return указатель на данные или NULL для пустой маски */
+void* tagmask_data(struct TagMask* mask);
+
+/*! Константный вариант tagmask_data */
+const void* tagmask_const_data(const struct TagMask* mask);
+
 
 /*! Удалить маску, освободить ресурсы
 \param mask - удаляемая маска */
@@ -71,7 +100,7 @@ size_t tagmask_on_bits_amount(const struct TagMask mask);
 \param mask маска, в которой меняется тэговый бит
 \param tag номер тэга, для которого изменяется состояние
 \state требуемое состояние */
-void tagmask_set_tag(struct TagMask mask, size_t tag, bool state);
+void tagmask_set_tag(struct TagMask* mask, size_t tag, bool state);
 
 
 /*! Заполняет маску данными из буфера. Если маска больше буфера, то остаток
@@ -80,20 +109,47 @@ void tagmask_set_tag(struct TagMask mask, size_t tag, bool state);
 \param mask маска, которая заполняется данными из буфера. Маска должна быть
 инициализирована (и желаемым размером). Исходные данные маски будут вычищены
 \param buf, buf_size буфер с данными для заполнения маски */
-void tagmask_fill_from_buffer(struct TagMask mask, void* buf, size_t buf_size);
+void tagmask_fill_from_buffer(struct TagMask* mask, const void* buf, size_t buf_size);
 
 
 /*! Логические операции над масками ??? */
-void tagmask_or_mask(struct TagMask result, struct TagMask arg);
+void tagmask_or_mask(struct TagMask* result, const struct TagMask arg);
 
 /*! ??? */
-void tagmask_exclude_mask(struct TagMask result, struct TagMask arg);
+void tagmask_exclude_mask(struct TagMask* result, const struct TagMask arg);
 
 
 /* ??? */
 bool tagmask_check_filter(const struct TagMask item, const struct TagMask on_mask,
     const struct TagMask off_mask);
 
+/*! Найти следующий выставленный тэг в маске
+\param tag номер тэга, с которого начинается поиск (включительно)
+\return номер найденного тэга или bit_len маски, если тэгов больше нет */
+size_t tagmask_next_tag(const struct TagMask mask, size_t tag);
+
+/*! Выдать тэги маски разреженным набором: отсортированным массивом номеров.
+Используется для масок с большим количеством тэгов, у которых выставлено
+немного битов
+\param tags массив для номеров тэгов
+\param max_amount размер массива
+\return количество тэгов в маске. Если оно больше max_amount, то в массив
+попадают только первые max_amount тэгов */
+size_t tagmask_get_tags(const struct TagMask mask, u16* tags, size_t max_amount);
+
+/*! Заполнить маску по разреженному набору тэгов. Исходные данные маски будут
+вычищены. Тэги вне границ маски игнорируются
+\param mask маска (должна быть инициализирована желаемым размером)
+\param tags, amount номера тэгов и их количество */
+void tagmask_fill_from_tags(struct TagMask* mask, const u16* tags, size_t amount);
+
+/*! Проверить разреженный набор тэгов фильтром (см. tagmask_check_filter).
+Проверка идёт по тэгам набора, без построения маски
+\param tags, amount номера тэгов и их количество
+\return true - набор подходит под фильтр */
+bool tagmask_check_filter_tags(const u16* tags, size_t amount,
+    const struct TagMask on_mask, const struct TagMask off_mask);
+
 /*! Отладочный вывод информации о маске в kern.log
 \param mask выводиимая маска */
 void tagmask_printk(const struct TagMask mask);
@@ -6,14 +6,18 @@ CONFIG -= qt
 SOURCES += \
   common.c \
   tag_allfiles_dir.c \
+  tag_block_map.c \
   tag_dir.c \
   tag_file.c \
+  tag_file_table.c \
   tag_fs.c \
   tag_inode.c \
+  tag_journal.c \
   tag_module.c \
   tag_onlytags_dir.c \
   tag_storage.c \
   tag_storage_cache.c \
+  tag_storage_index.c \
   tag_tag_dir.c \
   tag_tag_mask.c
 
@@ -21,13 +25,17 @@ HEADERS += \
   common.h \
   inode_info.h \
   tag_allfiles_dir.h \
+  tag_block_map.h \
   tag_dir.h \
   tag_file.h \
+  tag_file_table.h \
   tag_fs.h \
   tag_inode.h \
+  tag_journal.h \
   tag_onlytags_dir.h \
   tag_storage.h \
   tag_storage_cache.h \
+  tag_storage_index.h \
   tag_tag_dir.h \
   tag_tag_mask.h
 
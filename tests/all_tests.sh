@@ -70,6 +70,11 @@ RunTest test_same_filename_copy
 RunTest test_long_names
 RunTest test_only_tags_feature
 RunTest test_only_files_feature
+RunTest test_lazy_mount
+RunTest test_tagpack
+RunTest test_tag_sweep
+RunTest test_journal_replay
+RunTest test_sparse_tags
 
 if ! [[ ${SUMM_RES} -eq 0 ]]; then
   echo "ALL TESTS executed successfully"